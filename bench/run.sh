@@ -0,0 +1,111 @@
+#!/bin/sh
+# Runtime benchmarks for vm.c
+#
+#   bench/run.sh [-n runs] [-e switch|threaded|jit] [-f compiler-flags] [-o results.json] [-c baseline.json] [-t percent]
+#
+# Builds compiler.c and vm.c, compiles every bench/*.txt with the -f flags (e.g. "-O2") and runs
+# it n times (default 5) with tracing off. The results go to stdout or the -o file as JSON, one
+# benchmark per line: instructions executed and peak stack depth (from one switch engine run with
+# --stats --depth), best and median wall time of the process, and instructions per second at the
+# best time.
+# With -c the results are compared against a saved run: a benchmark whose best time is more
+# than -t percent (default 10) slower is reported as a regression and the script exits 1.
+
+runs=5
+engine=switch
+out=
+baseline=
+threshold=10
+flags=
+while getopts n:e:f:o:c:t: opt; do
+    case $opt in
+        n) runs=$OPTARG ;;
+        e) engine=$OPTARG ;;
+        f) flags=$OPTARG ;;
+        o) out=$OPTARG ;;
+        c) baseline=$OPTARG ;;
+        t) threshold=$OPTARG ;;
+        *) sed -n 4p "$0" >&2; exit 2 ;;
+    esac
+done
+
+bench=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -o "$work/compiler" "$bench/../compiler.c" || exit 2
+gcc -O2 -pthread -o "$work/vm" "$bench/../vm.c" || exit 2
+
+#nanoseconds since the epoch
+now() {
+    date +%s%N
+}
+
+results="$work/results.json"
+{
+    echo "{\"engine\": \"$engine\", \"runs\": $runs, \"benchmarks\": ["
+    sep=
+    for src in "$bench"/*.txt; do
+        name=$(basename "$src" .txt)
+        (cd "$work" && ./compiler $flags -o "$name.bin" "$src" > /dev/null) || { echo "$name does not compile" >&2; exit 2; }
+
+        stats=$("$work/vm" --stats --depth "$work/$name.bin" 2>&1 > /dev/null < /dev/null)
+        instructions=$(echo "$stats" | sed -n 's/^executed \([0-9]*\) instructions.*/\1/p')
+        depth=$(echo "$stats" | sed -n 's/^peak stack depth \([0-9]*\) words/\1/p')
+
+        times=
+        i=0
+        while [ $i -lt "$runs" ]; do
+            start=$(now)
+            "$work/vm" --engine "$engine" "$work/$name.bin" > /dev/null < /dev/null
+            end=$(now)
+            times="$times $((end - start))"
+            i=$((i + 1))
+        done
+
+        echo "$times" | tr ' ' '\n' | sed '/^$/d' | sort -n | awk -v name="$name" -v ins="$instructions" \
+            -v depth="$depth" -v sep="$sep" '
+            { t[NR] = $1 }
+            END {
+                best = t[1] / 1e9
+                median = (NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2) / 1e9
+                printf "%s{\"name\": \"%s\", \"instructions\": %d, \"wall_best_s\": %.6f, \"wall_median_s\": %.6f, \"instructions_per_s\": %.0f, \"peak_stack_words\": %d}\n",
+                    sep, name, ins, best, median, ins / best, depth
+            }'
+        sep=", "
+    done
+    echo "]}"
+} > "$results" || exit 2
+
+if [ -n "$out" ]; then
+    cp "$results" "$out"
+else
+    cat "$results"
+fi
+
+[ -z "$baseline" ] && exit 0
+
+#each benchmark sits on a line of its own, in both files
+field() {
+    sed -n "s/.*\"name\": \"$2\".*\"$3\": \([0-9.]*\).*/\1/p" "$1"
+}
+
+status=0
+for name in $(sed -n 's/.*"name": "\([^"]*\)".*/\1/p' "$results"); do
+    old=$(field "$baseline" "$name" wall_best_s)
+    new=$(field "$results" "$name" wall_best_s)
+    if [ -z "$old" ]; then
+        echo "$name: not in $baseline" >&2
+        continue
+    fi
+    if [ "$(field "$baseline" "$name" instructions)" != "$(field "$results" "$name" instructions)" ]; then
+        echo "$name: instruction count changed, the program or the compiler output differs" >&2
+    fi
+    if awk -v old="$old" -v new="$new" -v t="$threshold" 'BEGIN { exit !(new > old * (1 + t / 100)) }'; then
+        echo "$name: REGRESSION ${old}s -> ${new}s" >&2
+        status=1
+    else
+        echo "$name: ok ${old}s -> ${new}s" >&2
+    fi
+done
+exit $status
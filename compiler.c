@@ -3,17 +3,42 @@
 /************************************************************/
 
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define INPUT_MAX 1024
-#define TOKENS_MAX 2048
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "pl0.h"
+#include "pl0image.h"
+#include "pl0object.h"
+#include "pl0server.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #define WORDS_SYMBOLS 30
-#define MAX_SYMBOL_TABLE_SIZE 500
-#define MAX_INSTRUCTIONS 500
+#define KEYWORD_SLOTS 32 // perfect hash table size, see keywordHash
 #define LEV_MAX 4
-
-//struct for symbols to be contained in symbol table
+#define ARENA_CHUNK_MIN (64 * 1024) // bytes in the first arena chunk, later ones double
+#define SYMBOL_DECLARE 0
+#define SYMBOL_LOOKUP 1
+#define SYMBOL_POP 2
+#define PHASE_SCAN 0 // --time-report phases
+#define PHASE_PARSE 1
+#define PHASE_OPTIMIZE 2
+#define PHASE_OUTPUT 3
+#define PHASES 4
+
+//one symbol as a record, the live table keeps these fields in separate columns (see PARSER VARIABLES)
 typedef struct
 {
     int kind; // const = 1, var = 2, proc = 3
@@ -24,6 +49,23 @@ typedef struct
     int mark; // to indicate unavailable or deleted
 } symbol_t;
 
+//packed token, the lexeme itself stays in the source
+//an identifier's length is its atom's, the parser never needs the length of anything else
+#define MAX_ATOMS (1 << 24)
+typedef struct
+{
+    int32_t offset; // of the lexeme in the source
+    uint32_t kind : 8; // token_type
+    uint32_t value : 24; // number for numbersym, atom for identsym
+} token_t;
+
+//one entry of the symbol lookup trace --bench-symbols replays
+typedef struct
+{
+    int op; // SYMBOL_DECLARE, SYMBOL_LOOKUP or SYMBOL_POP
+    int arg; // atom, or the table size to pop back to
+} symbol_event_t;
+
 //struct for instructions to be stored in text arr & ELF
 typedef struct
 {
@@ -32,8 +74,124 @@ typedef struct
     int M;
 } text_t;
 
+//struct for register ISA instructions (see reg_op in pl0image.h)
+typedef struct
+{
+    int op;
+    int a;
+    int b;
+    int c;
+} reg_t;
+
+//peephole rule: rewrites the instructions starting at text[i] in place, deleted ones get op 0
+typedef struct
+{
+    char* name;
+    int length; // instructions the rule has to see at once
+    int (*apply)(int i); // returns 1 if it rewrote something
+    int applied; // statistics
+    int removed;
+} peephole_rule_t;
+
+//optimization pass, runPasses runs the enabled ones in table order and times each
+typedef struct
+{
+    char* name;
+    void (*run)();
+    int enabled; // set from the options before every run
+    int ran;
+    int before; // instructions going in and coming out
+    int after;
+    double wall; // seconds
+    double cpu;
+} opt_pass_t;
+
+//IR node: a value or an effect of the stack code, operands are node indices
+typedef struct
+{
+    int kind; // IR_CONST .. IR_OTHER
+    int op; // the instruction the node stands for
+    int L;
+    int M;
+    int a; // operands, -1 if there is none
+    int b;
+    int block;
+    int vn; // value number: first node known to hold the same value
+    int known; // 1 if the value is a compile time constant
+    int value;
+    int reuse; // 1 to load the value its vn node kept in a temp instead of computing it again
+    int temp; // frame slot the value is kept in for later nodes, 0 if none
+    int hoist; // loop index + 1 whose preheader computes the value, 0 if none
+    int slot; // frame slot the value is loaded from inside the loops, 0 if none
+} ir_node_t;
+
+//basic block, its nodes are contiguous in irNodes
+typedef struct
+{
+    int start; // first instruction in text[]
+    int firstNode;
+    int nodeCount;
+    int preds; // control flow edges in, a call target counts as two
+    int pred; // the only predecessor when preds is 1
+    int proc; // 0 for main, procTable index + 1, -1 if unknown and -2 if shared
+    int newStart; // first instruction after lowering
+    int numbered;
+    int headOf; // loop index + 1 of the loop whose condition the block is, 0 if none
+    int latchOf; // loop index + 1 of the loop whose jump back the block ends with, 0 if none
+} ir_block_t;
+
+//while loop: its blocks are head .. latch, lowered as preheader, JMP to the test, body, test
+typedef struct
+{
+    int head; // the condition, its JPC leaves the loop
+    int latch; // ends in the JMP back to head
+    int proc;
+    int entryJump; // after lowering, the JMP from the preheader to the test
+    int test; // after lowering, first instruction of the condition
+} ir_loop_t;
+
+//multiplication of an induction variable by a loop invariant factor, kept in a temp that each
+//step of the variable adds step * factor to
+typedef struct
+{
+    int loop;
+    int store; // node that steps the variable
+    int factor;
+    int step;
+    int slot;
+} ir_reduction_t;
+
+//entry in the value table, keyed like an IR node; later entries shadow earlier ones
+typedef struct
+{
+    int kind;
+    int op;
+    int L;
+    int M;
+    int a;
+    int b;
+    int vn;
+    int next; // entry below it in the same bucket, -1 at the bottom
+} ir_value_t;
+
+//value on the operand stack while translating to registers: an immediate or the register holding it
+typedef struct
+{
+    int isImm;
+    int val; // immediate value or register number
+} vreg_t;
+
+//block of arena memory, allocations are bumped out of data and all chunks are freed together
+typedef struct arena_chunk
+{
+    struct arena_chunk* next; // chunk filled before this one
+    size_t size; // bytes in data
+    size_t used;
+    char data[];
+} arena_chunk_t;
+
 //token processing functions
-void addToTokenList(int token, char input[]);
+void addToTokenList(int token, size_t offset, int length);
 int isReservedWordOrSymbol(char word[]);
 int isSpecialSymbol(char sym);
 int isMismatched(char input[]);
@@ -41,30 +199,181 @@ int isIdentifier(char identifier[]);
 int processLexeme(char input[]);
 int isNumber(char input[]);
 int splitSymbol(char input[]);
-void lexemeProcessWrapper(char input[]);
-void commentHandling(FILE* file);
+void lexemeProcessWrapper(char input[], size_t offset);
+void commentHandling();
 void printTokenList();
-void printSourceCode(FILE *file);
+void printSourceCode();
+int loadSource(const char* fname, const char** src, size_t* length);
+int scanLexeme();
+int scanLexemeDfa();
+void initCharClasses();
+int keywordLookup(const char* word, int len);
+void emitLexeme(int state, size_t offset, int len);
+size_t identifierRun(size_t pos);
+size_t digitRun(size_t pos);
+size_t spaceRun(size_t pos);
+void benchLexer();
 
 //parser functions
-void addToSymbolTable(int kind, char* name, int val, int level, int address);
-int symbolTableCheck(char str[]);
+void addToSymbolTable(int kind, int atom, int val, int level, int address);
+int symbolTableCheck(int atom);
+void pushScope();
+void popScope();
+int internIdentifier(const char* name, int length);
 int getNextToken();
-char* getNextIdentifier();
+int tokenAtom();
+int tokenNumber();
+void benchSymbols();
 void program();
 void block();
 void error(int id);
 void emit(int op, int L, int M);
+void emitAccess(int op, int symIdx);
+int isBranch(int op);
 void constDeclaration();
 int varDeclaration();
 void procDeclaration();
 void statement();
-void condition();
-void expression();
-void term();
-void factor();
+int condition();
+int expression();
+int term();
+int factor();
+int emitOpr(int M, int constant);
+int evalOpr(int M, int a, int b, int* result);
 void printSymbolTable();
-void produceElfAndOut();
+void produceElfAndOut(pl0_result_t* result);
+void writeTextElf(FILE* file);
+void writeImage(FILE* file);
+int maxFrameDepth();
+
+//peephole functions
+void peephole();
+void markLeaders(char leader[]);
+void compactText();
+int followJumps(int target);
+int ruleStoreLoad(int i);
+int ruleJumpNext(int i);
+int ruleJumpChain(int i);
+int ruleArithIdentity(int i);
+int ruleNeqZeroBranch(int i);
+void printPeepholeStats();
+
+//dead code functions
+void eliminateDeadCode();
+void printDeadCodeReport();
+
+//pass functions
+void runPasses();
+double clockSeconds(clockid_t clock);
+
+//IR functions
+void liftIr();
+void valueNumbering();
+void optimizeLoops();
+void lowerIr();
+int buildIr();
+int irNode(int kind, int i, int a, int b);
+int irSuccessors(int b, int succ[]);
+void irAssignProcs();
+void numberBlock(int b);
+int irValue(int kind, int op, int L, int M, int a, int b, int vn, int insert);
+void irLog(int what, int index, int old);
+void irUndo(int mark);
+int findLoops();
+int irLoopShape(int head, int latch, const int* predStart, const int* predList);
+void markInvariants(int l);
+int irStoresTo(int op, int L, int M);
+void hoistInvariants(int n, int l);
+void reduceStrength(int l);
+int irProductFactor(int n, int s);
+int irSameValue(int x, int y);
+void lowerValue(int n);
+void lowerPreheader(int l);
+void lowerLoopTest(int l);
+void lowerSteps(int n);
+
+//incremental functions
+void loadProcCache();
+void storeProcCache();
+int procCacheOptions();
+int findProcEntry(const char* path, int length);
+void readCacheBytes(const char** p, const char* end, void* dst, size_t n);
+int readCacheInt(const char** p, const char* end);
+int readCacheCount(const char** p, const char* end);
+void writeCacheBytes(const void* src, int n);
+void writeCacheInt(int value);
+void addCachePiece(int inFile, int offset, int length);
+void declareProcPath(int atom);
+void openProcRecord();
+void closeProcRecord();
+void noteName(const char* name, int length, int atom, int symIdx);
+void noteDisplay(int level);
+int reuseProcedure();
+int findAtom(const char* name, int length);
+long long nanosSince(struct timespec* begin);
+uint64_t hashBytes(const char* bytes, size_t length);
+uint64_t hashSpan(const char* bytes, size_t length);
+void printIncrementalReport();
+
+//linker functions
+void addObjectReloc(int kind, int import);
+void emitImportCall(int atom);
+void writeObject(FILE* file);
+void readObjectHeader(const char* object, size_t length, object_header_t* header);
+const char* objectSection(const char* object, size_t length, int kind, size_t elemSize, int* count);
+int findExport(const char* name, int insert, int proc);
+void linkObjects(const char* const objects[], const size_t lengths[], int count);
+
+//register backend functions
+void translateToRegisters();
+void emitReg(int op, int a, int b, int c);
+int regOperand(vreg_t v, int tmp);
+int operandDepth(int start);
+void printRegListing();
+
+//native backend functions
+void writeAssembly(FILE* file);
+void asmFlush();
+void asmLoad(int n);
+void asmPushPrep();
+void asmPush();
+const char* asmFrame(int L);
+void asmReturn();
+
+//arena functions
+void* arenaAlloc(size_t bytes);
+void* arenaResize(void* old, size_t oldBytes, size_t newBytes);
+void* reserve(void* table, int* capacity, int need, size_t elemSize);
+void arenaFree();
+void printMemReport();
+
+//time report functions
+void phaseStart();
+void phaseEnd(int phase);
+void printTimeReport();
+void writeTimeReportJson(const char* fname);
+
+//library functions, pl0_init, pl0_compile, pl0_link and pl0_free_result are declared in pl0.h
+void resetCompiler();
+void applyOptions(const pl0_ctx_t* ctx);
+void finishProgram(pl0_result_t* result);
+void discardResult(pl0_result_t* result);
+
+//command line and server functions, left out with PL0_LIBRARY
+int parseOptions(int argc, const char* argv[], pl0_ctx_t* ctx, const char* files[], const char** outName, FILE* err);
+int runLinker(int argc, const char* argv[]);
+int writeOutput(const pl0_ctx_t* ctx, const char* outName, const pl0_result_t* result);
+int compileSource(pl0_ctx_t* ctx, const char* src, size_t length, FILE* out, pl0_result_t* result);
+const char* defaultOutName(int format);
+int runServer(int argc, const char* argv[]);
+void* serverWorker(void* arg);
+void serveConnection(int fd);
+char* buildResponse(int status, const char* out, size_t outSize, const char* err, size_t errSize,
+                    const char* name, const char* output, size_t outputSize, size_t* size);
+int cacheLookup(uint64_t hash, const char* key, size_t keySize, char** response, size_t* responseSize);
+void cacheStore(uint64_t hash, char* key, size_t keySize, const char* response, size_t responseSize);
+int readAll(int fd, void* buffer, size_t length);
+int writeAll(int fd, const void* buffer, size_t length);
 
 /************************************************************
 *
@@ -89,11 +398,88 @@ char* reservedWordsAndSymbols[] = {
 
 char specialSymbols[] = {'+', '-', '*', '/', '(', ')', '=', ',', '.', '<', '>', ';', ':'};
 
-int tokenArray[TOKENS_MAX]; // store tokens
-char identifierArray[TOKENS_MAX][12]; // store identifiers
-int trackerIdentifier = 0; // track current identifier
-int trackerToken = 0; // track current token
-int trackerInput = 0; //track current input
+//DFA scanner, accepts exactly the lexemes the character-pair rules of scanLexeme() split the source into
+typedef enum
+{
+    CC_OTHER, CC_SPACE, CC_ALPHA, CC_DIGIT, CC_LT, CC_GT, CC_EQ, CC_COLON, CC_SLASH, CC_STAR,
+    CC_SYMBOL, // + - ( ) , . ;
+    CC_CLASSES
+} char_class;
+
+typedef enum
+{
+    LX_START, LX_IDENT, LX_NUMBER, LX_LT, LX_NEQ, LX_NEQEQ, LX_LEQ, LX_GT, LX_GEQ, LX_COLON, LX_BECOMES,
+    LX_SLASH, LX_SYMBOL, LX_INVALID,
+    LX_EMIT, // the lexeme ends before this character
+    LX_COMMENT // "/*", skip to "*/"
+} lexer_state;
+
+_Thread_local unsigned char charClass[256]; // filled by initCharClasses from the same ctype calls the old scanner made
+
+const unsigned char lexerTransitions[LX_EMIT][CC_CLASSES] = {
+    //              OTHER       SPACE     ALPHA     DIGIT      LT       GT        EQ          COLON     SLASH     STAR        SYMBOL
+    [LX_START] =   {LX_INVALID, LX_START, LX_IDENT, LX_NUMBER, LX_LT,   LX_GT,    LX_SYMBOL,  LX_COLON, LX_SLASH, LX_SYMBOL,  LX_SYMBOL},
+    [LX_IDENT] =   {LX_EMIT,    LX_EMIT,  LX_IDENT, LX_IDENT,  LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_NUMBER] =  {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_NUMBER, LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_LT] =      {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_NEQ,   LX_LEQ,     LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_NEQ] =     {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_NEQEQ,   LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_NEQEQ] =   {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_LEQ] =     {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_GT] =      {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_GEQ,     LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_GEQ] =     {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_COLON] =   {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_BECOMES, LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_BECOMES] = {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_SLASH] =   {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_COMMENT, LX_EMIT},
+    [LX_SYMBOL] =  {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT},
+    [LX_INVALID] = {LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,   LX_EMIT, LX_EMIT,  LX_EMIT,    LX_EMIT,  LX_EMIT,  LX_EMIT,    LX_EMIT}
+};
+
+//token of each accepting state, 0 for the ones the old scanner rejects (a lone ":", "<>=" or a stray character)
+const int lexerTokens[LX_EMIT] = {
+    [LX_IDENT] = identsym, [LX_NUMBER] = numbersym, [LX_LT] = lessym, [LX_NEQ] = neqsym, [LX_LEQ] = leqsym,
+    [LX_GT] = gtrsym, [LX_GEQ] = geqsym, [LX_BECOMES] = becomessym, [LX_SLASH] = slashsym
+};
+
+//token of each single character LX_SYMBOL lexeme
+const int symbolTokens[128] = {
+    ['+'] = plussym, ['-'] = minussym, ['*'] = multsym, ['('] = lparentsym, [')'] = rparentsym,
+    ['='] = eqsym, [','] = commasym, ['.'] = periodsym, [';'] = semicolonsym
+};
+
+//reserved words by keywordHash, every slot holds at most one word so a lookup is one compare
+typedef struct
+{
+    char* word;
+    int token;
+} keyword_t;
+
+#define keywordHash(w, len) (((unsigned char)(w)[0] + 2 * (unsigned char)(w)[1] + 7 * (len)) & (KEYWORD_SLOTS - 1))
+
+const keyword_t keywordTable[KEYWORD_SLOTS] = {
+    [0] = {"then", thensym}, [1] = {"call", callsym}, [3] = {"if", ifsym}, [4] = {"const", constsym},
+    [6] = {"fi", fisym}, [10] = {"while", whilesym}, [12] = {"odd", oddsym}, [13] = {"var", varsym},
+    [15] = {"begin", beginsym}, [16] = {"do", dosym}, [19] = {"procedure", procsym}, [22] = {"end", endsym},
+    [24] = {"read", readsym}, [25] = {"eeelse", elsesym}, [30] = {"write", writesym}
+};
+
+//the whole source, mapped read-only (or read into the arena if it cannot be mapped)
+_Thread_local const char* source = NULL;
+_Thread_local size_t sourceLength = 0;
+_Thread_local size_t sourcePos = 0; // next character the scanner reads
+_Thread_local size_t lexemeOffset = 0; // start of the lexeme being tokenized, for error positions
+
+//tokens are scanned on demand, these only hold the ones the parser has not consumed yet
+_Thread_local token_t* tokens = NULL;
+_Thread_local int tokenCapacity = 0;
+_Thread_local int tokenCount = 0; // tokens waiting to be read
+_Thread_local int tokenTotal = 0; // tokens scanned so far
+_Thread_local int numberTotal = 0; // of which numbers
+_Thread_local int identifierTotal = 0; // and identifiers
+_Thread_local int trackerToken = 0; // track current token
+_Thread_local int trackerInput = 0; //track current input
+_Thread_local char* input = NULL; // current lexeme
+_Thread_local int inputCapacity = 0;
+_Thread_local int (*scanNext)() = scanLexemeDfa; // scanLexeme with --legacy-lexer
 
 /************************************************************
 *
@@ -101,876 +487,5339 @@ int trackerInput = 0; //track current input
 *
 ************************************************************/
 
-symbol_t symbol_table[MAX_SYMBOL_TABLE_SIZE]; // store symbols
-text_t text[MAX_INSTRUCTIONS]; // store instructions
-int tp = 0; // table index tracker
-int token_p; // stores current token
-int cx = 0; // tracker for next instruction
-int lev = -1;
+//interned identifiers: every distinct name gets an atom, the name is the source span of its first use
+_Thread_local int* atomOffset = NULL;
+_Thread_local int* atomLength = NULL;
+_Thread_local int* atomHead = NULL; // innermost visible symbol with this name, -1 if none
+_Thread_local int atomCount = 0;
+_Thread_local int atomCapacity = 0;
+_Thread_local int* atomSlots = NULL; // open addressing hash of the names, atom + 1 per slot, 0 if empty
+_Thread_local int atomSlotCount = 0; // power of two, kept at least twice atomCount
+
+//symbol table as columns, symbol i is symKind[i], symVal[i], ... so a lookup only touches atomHead
+//symPrevSame chains each symbol to the one with the same name it shadows, which popScope restores
+_Thread_local int* symKind = NULL; // const = 1, var = 2, proc = 3
+_Thread_local int* symVal = NULL;
+_Thread_local int* symLevel = NULL;
+_Thread_local int* symAddr = NULL;
+_Thread_local int* symAtom = NULL;
+_Thread_local int* symPrevSame = NULL;
+_Thread_local int symbolCapacity = 0;
+_Thread_local int* scopeMarks = NULL; // table size when each open block started
+_Thread_local int scopeCapacity = 0;
+_Thread_local int scopeDepth = 0;
+_Thread_local symbol_event_t* symbolEvents = NULL; // lookup trace, only recorded for --bench-symbols
+_Thread_local int symbolEventCapacity = 0;
+_Thread_local int symbolEventCount = 0;
+
+_Thread_local text_t* text = NULL; // store instructions
+_Thread_local int textCapacity = 0;
+_Thread_local int tp = 0; // table index tracker
+_Thread_local int token_p; // stores current token
+_Thread_local int cx = 0; // tracker for next instruction
+_Thread_local int lev = -1;
+_Thread_local symbol_t* procTable = NULL; // every procedure declared, kept for the image symbols
+_Thread_local int procCapacity = 0;
+_Thread_local int procCount = 0;
+_Thread_local char displayUsed[LEV_MAX + 1]; // display[level] is read by a nested block, so the block at level keeps it
+_Thread_local pl0_diagnostic_t* diagnostic = NULL; // where error() reports, in the caller's result
+_Thread_local jmp_buf errorJump; // error() unwinds to pl0_compile through this
 
-int main(int argc, const char* argv[]) {
-    const char* fname = argv[1];
-    FILE* file = fopen(fname, "r");
-    char input[INPUT_MAX];
+/************************************************************
+*
+*   REGISTER BACKEND VARIABLES
+*
+************************************************************/
 
-    ////////////////////////
-    //begin scanning process
-    ////////////////////////
-    while (fscanf(file, "%c", &input[trackerInput]) == 1) {
-        //detects if we are currently scanning in a comment
-        if (trackerInput > 0 && input[trackerInput - 1] == '/' && input[trackerInput] == '*') {
-            commentHandling(file);
-            trackerInput = 0;
-        }
-        //tokenize before whitespace or skip over it
-        else if (isspace(input[trackerInput])) {
-            if (trackerInput != 0)
-                lexemeProcessWrapper(input);
-            trackerInput = 0;
-        }
-        //if we have mismatched characters or need to split symbols we tokenize first half
-        else if (trackerInput > 0 && (isMismatched(input) || splitSymbol(input))) {
-            char temp = input[trackerInput];
-            lexemeProcessWrapper(input);
+_Thread_local reg_t* regText = NULL; // register ISA instructions
+_Thread_local int regCapacity = 0;
+_Thread_local int rx = 0; // tracker for next register instruction
+_Thread_local int* regMap = NULL; // text index -> regText index of its first instruction
 
-            //now input in mismatched character and update tracker
-            input[0] = temp;
-            trackerInput = 1;
-        }
-        //increment tracker if we dont tokenize since we're adding to input
-        else
-            trackerInput++;
-    }
-    //something left in input after end of loop
-    if (trackerInput > 0) {
-        lexemeProcessWrapper(input);
-    }
+char* regNames[] = {
+    "", "LI", "MOV", "ADD", "SUB", "MUL", "DIV", "EQL", "NEQ", "LSS", "LEQ", "GTR", "GEQ",
+    "ADDI", "SUBI", "MULI", "DIVI", "EQLI", "NEQI", "LSSI", "LEQI", "GTRI", "GEQI", "ODD",
+    "LDN", "STN", "JMP", "JZ", "BEQL", "BNEQ", "BLSS", "BLEQ", "BGTR", "BGEQ",
+    "BEQLI", "BNEQI", "BLSSI", "BLEQI", "BGTRI", "BGEQI", "CAL", "INC", "RTN", "WRITE", "READ", "HALT"
+};
 
-    ////////////////////////
-    //begin parsing process
-    ////////////////////////
-    trackerToken = 0;
-    trackerIdentifier = 0;
-    program();
+/************************************************************
+*
+*   NATIVE BACKEND VARIABLES
+*
+************************************************************/
 
-    ////////////////////////
-    //print source and output
-    ////////////////////////
-    printSourceCode(file);
-    produceElfAndOut();
+#define ASM_PAS_SIZE 500 // words of pas in pl0rt.c, the VM's ARRAY_SIZE
 
-    return 0;
-}
+_Thread_local FILE* asmFile = NULL;
+_Thread_local int asmOff = 0; // sp = r12 + asmOff
+_Thread_local int asmCached = 0; // how many of the top stack words eax (top) and ecx (below it) hold
 
 /************************************************************
 *
-*   SCANNER FUNCTIONS
+*   PEEPHOLE VARIABLES
 *
 ************************************************************/
 
-//wrapper function to process inputs into token list
-void lexemeProcessWrapper(char input[]) {
-    int token = processLexeme(input);
-    if (token != -1)
-        addToTokenList(token, input);
-    else
-        printf("error");
-}
+_Thread_local peephole_rule_t peepholeRules[] = {
+    {"store-load", 2, ruleStoreLoad, 0, 0}, // STO L M, LOD L M -> STK L M
+    {"jump-next", 1, ruleJumpNext, 0, 0}, // JMP to the next instruction
+    {"jump-chain", 1, ruleJumpChain, 0, 0}, // JMP/JPC/CAL/CLX to a JMP -> straight to its target
+    {"arith-identity", 2, ruleArithIdentity, 0, 0}, // LIT 0 ADD/SUB, LIT 1 MUL/DIV
+    {"neq-zero-branch", 3, ruleNeqZeroBranch, 0, 0} // LIT 0, NEQ, JPC -> JPC
+};
+#define PEEPHOLE_RULES (int)(sizeof(peepholeRules) / sizeof(peepholeRules[0]))
+_Thread_local int* compactIndex = NULL; // old instruction index -> new one, for compactText
+_Thread_local int compactIndexCapacity = 0;
 
-//adds given token into token list
-void addToTokenList(int token, char input[]) {
-    //token is invalid
-    if (token == -1)
-        return;
-    tokenArray[trackerToken++] = token;
-    if (token == 2) {
-        strcpy(identifierArray[trackerIdentifier++], input);
-    }
-    if (token == 3) {
-        tokenArray[trackerToken++] = atoi(input);
-    }
-}
+/************************************************************
+*
+*   DEAD CODE VARIABLES
+*
+************************************************************/
 
-//check if given input is a reserved word
-int isReservedWordOrSymbol(char word[]) {
-    if (strcmp(word, "odd") == 0)
-        return 1;
-    for (int i = 0; i < WORDS_SYMBOLS; i++)
-        if (strcmp(word, reservedWordsAndSymbols[i]) == 0)
-            return i + 4;
+_Thread_local int threadedJumps = 0; // branches moved to the end of their JMP chain
+_Thread_local int deadProcedures = 0; // procedures no call reaches
+_Thread_local int deadInstructions = 0; // instructions no path from the entry reaches, with those
+_Thread_local int deadCodeBefore = 0; // cx when the pass started
 
-    //-1 indicates that given string is NOT a reserved word
-    return -1;
-}
+/************************************************************
+*
+*   PASS VARIABLES
+*
+************************************************************/
 
-//check if given input is an identifier
-int isIdentifier(char identifier[]) {
-    int i = 0;
-    int len = 0;
-    //check if first character of given input is a letter
-    if (!isalpha(identifier[0]))
-        return -1;
-    //check the other 10 characters in input, if we find something other than a letter or number, return -1 to indicate invalid
-    while (identifier[i] != '\0') {
-        if (!isalpha(identifier[i]) && !isdigit(identifier[i]))
-            return -1;
+#define PASS_IR 0
+#define PASS_VALUE_NUMBERING 1
+#define PASS_LOOPS 2
+#define PASS_LOWER 3
+#define PASS_DEAD_CODE 4
+#define PASS_PEEPHOLE 5
+#define PASS_REGISTERS 6
+
+//the IR passes work on irNodes, text[] only changes when "lower" writes them back
+_Thread_local opt_pass_t optPasses[] = {
+    {"ir", liftIr, 0, 0, 0, 0, 0, 0}, // -O2
+    {"gvn", valueNumbering, 0, 0, 0, 0, 0, 0},
+    {"loops", optimizeLoops, 0, 0, 0, 0, 0, 0},
+    {"lower", lowerIr, 0, 0, 0, 0, 0, 0},
+    {"dead-code", eliminateDeadCode, 0, 0, 0, 0, 0, 0},
+    {"peephole", peephole, 0, 0, 0, 0, 0, 0},
+    {"registers", translateToRegisters, 0, 0, 0, 0, 0, 0} // --reg, counts register instructions out
+};
+#define OPT_PASSES (int)(sizeof(optPasses) / sizeof(optPasses[0]))
 
-        len++;
-        i++;
-    }
-    //a valid identifier can only be up to 11 characters long
-    if (len > 11)
-        return 0;
+/************************************************************
+*
+*   IR VARIABLES
+*
+************************************************************/
 
-    //if code reaches here, given input is a valid identifier
-    return identsym;
-}
+//node kinds, the values come first
+#define IR_CONST 1 // LIT
+#define IR_LOAD 2 // LOD or LDX of a frame slot
+#define IR_BINARY 3 // OPR 1 .. 11, b is -1 for ODD
+#define IR_READ 4 // SYS 0 2
+#define IR_STORE 5 // STO or STX of a
+#define IR_WRITE 6 // SYS 0 1
+#define IR_CALL 7 // CAL or CLX
+#define IR_BRANCH 8 // JPC on a
+#define IR_JUMP 9
+#define IR_OTHER 10 // INC, DEN, RTN, DRT and halt, copied as they are
+
+//what an undo log entry takes back
+#define IR_UNDO_VALUE 0
+#define IR_UNDO_VERSION 1
+#define IR_UNDO_EPOCH 2
+
+_Thread_local ir_node_t* irNodes = NULL;
+_Thread_local int irNodeCapacity = 0;
+_Thread_local int irNodeCount = 0;
+_Thread_local ir_block_t* irBlocks = NULL;
+_Thread_local int irBlockCapacity = 0;
+_Thread_local int irBlockCount = 0;
+_Thread_local int* irBlockOf = NULL; // instruction index -> its block
+_Thread_local int* irFrameInc = NULL; // per procedure, index of the INC that sizes its frame, -1 if none
+_Thread_local int* irFrameTemps = NULL; // per procedure, temps added after that frame's slots
+_Thread_local ir_value_t* irValues = NULL; // values available on the path to the block being numbered
+_Thread_local int irValueCapacity = 0;
+_Thread_local int irValueCount = 0;
+_Thread_local int* irBuckets = NULL;
+_Thread_local int irBucketMask = 0;
+_Thread_local int* irUndoLog = NULL; // what, index, old value, three ints per change
+_Thread_local int irUndoCapacity = 0;
+_Thread_local int irUndoCount = 0;
+_Thread_local int* irVersion = NULL; // per slot offset M, [2M] bumped by each STO and [2M + 1] by each STX of it
+_Thread_local int irEpoch = 0; // bumped by every call, which may store to any slot
+_Thread_local int irClock = 0; // source of fresh versions and epochs
+_Thread_local int irReused = 0; // values loaded from a temp instead of computed again
+_Thread_local int irFolded = 0; // values found to be constants
+_Thread_local int irBuilt = 0; // 1 once liftIr has the program in irNodes
+_Thread_local ir_loop_t* irLoops = NULL; // outer loops before the loops in them
+_Thread_local int irLoopCapacity = 0;
+_Thread_local int irLoopCount = 0;
+_Thread_local ir_reduction_t* irReductions = NULL;
+_Thread_local int irReductionCapacity = 0;
+_Thread_local int irReductionCount = 0;
+_Thread_local char* irInvariant = NULL; // per node, 1 if its value is the same on every trip of the loop at hand
+_Thread_local int* irLoopStores = NULL; // store nodes of the loop at hand
+_Thread_local int irLoopStoreCapacity = 0;
+_Thread_local int irLoopStoreCount = 0;
+_Thread_local int irLoopCalls = 0; // 1 if the loop at hand calls a procedure
+_Thread_local char* irEveryTrip = NULL; // per block, 1 if each trip of the loop at hand runs it
+_Thread_local int irHoisted = 0; // values computed once before their loop
+_Thread_local int irReduced = 0; // temps stepping along with an induction variable instead of a MUL
 
-//check if given input is a special symbol
-int isSpecialSymbol(char sym) {
-    for (int i = 0; i < 13; i++)
-        if (sym == specialSymbols[i])
-            return 1;
-    return 0;
-}
+/************************************************************
+*
+*   INCREMENTAL VARIABLES
+*
+************************************************************/
 
-//check if given input is a valid number
-int isNumber(char input[]) {
-    int i = 0;
-    int len = 0;
+#define INCREMENTAL_MAGIC "PL0I"
+#define INCREMENTAL_VERSION 1
 
-    //check to see if every char inside input is a digit & keep track of # of digits
-    while (input[i] != '\0') {
-        if (!isdigit(input[i]))
-            return -1;
-        i++;
-        len++;
-    }
-    //if number of digits exceeds 5, it is too long
-    if (len > 5)
-        return 0;
+//a name a procedure looked up outside its own block, with what it found there
+typedef struct
+{
+    const char* name; // in the source or the loaded cache file
+    int length;
+    int kind; // 0 if nothing was declared under the name
+    int level;
+    int val;
+    int addr;
+} proc_ref_t;
+
+//header of one procedure's entry in the cache file, followed by
+//  the path: enclosing procedures' names and its own, joined by '.'
+//  refCount refs: kind, level, val, addr, name length and the name
+//  procCount nested procedures: 12 bytes of name, level, addr relative to its first instruction
+//  codeLength instructions, op L M, branch targets inside it relative to its first instruction
+//  relocCount relocations: instruction index, and the ref whose address M is or -1 if M is relative
+typedef struct
+{
+    int32_t size; // of the whole entry
+    int32_t pathLength;
+    int32_t spanLength; // source from the first token of its block through the ';' after it
+    int32_t level; // lev it was declared at
+    int32_t depth; // blocks nested inside its own
+    int32_t displayMask; // display entries of outer blocks it reads, a bit per level
+    int32_t descendants; // entries of its nested procedures, stored right before its own
+    int32_t refCount;
+    int32_t procCount;
+    int32_t codeLength;
+    int32_t relocCount;
+    int32_t unused;
+    uint64_t spanHash;
+    int64_t nanos; // to compile it, nested procedures included
+} proc_entry_t;
+
+//bytes of the next cache file, from the loaded one or from procCacheOut
+typedef struct
+{
+    int inFile; // 1 for entries reused as they were
+    int offset;
+    int length;
+} proc_piece_t;
 
-    return numbersym;
-}
+//procedure being compiled, what it looks up outside is collected for its entry
+typedef struct
+{
+    int mark; // symbols below it are outside the procedure
+    int serial; // atomNoted value for the names it already has
+    int start; // cx of its first instruction
+    size_t spanStart;
+    int procStart; // procTable index of its first nested procedure
+    int entryStart; // procCacheOutEntries when it started
+    int displayMask;
+    long long adjust; // nested procedures' compile time minus the time reusing them took
+    struct timespec begin;
+    proc_ref_t* refs;
+    int refCount;
+    int refCapacity;
+} proc_record_t;
+
+_Thread_local const char* procCacheFile = NULL; // contents of the cache file
+_Thread_local int procCacheFileSize = 0;
+_Thread_local int* procCacheOffsets = NULL; // of each entry in the file, in the order they were written
+_Thread_local int procCacheEntryCount = 0;
+_Thread_local int* procCacheSlots = NULL; // open addressing hash of the paths, entry + 1 per slot, 0 if empty
+_Thread_local int procCacheSlotCount = 0;
+_Thread_local char* procCacheOut = NULL; // entries for the next compile, each written when its procedure ends
+_Thread_local int procCacheOutCapacity = 0;
+_Thread_local int procCacheOutSize = 0;
+_Thread_local int procCacheOutEntries = 0;
+_Thread_local proc_piece_t* procCachePieces = NULL; // the next cache file's entries, in order
+_Thread_local int procCachePieceCount = 0;
+_Thread_local int procCachePieceCapacity = 0;
+_Thread_local proc_record_t procRecords[LEV_MAX + 2]; // by the level of the procedure's block
+_Thread_local int* atomNoted[LEV_MAX + 2]; // serial of the record at each level that last noted the atom
+_Thread_local int atomNotedCapacity = 0;
+_Thread_local int noteSerial = 0;
+_Thread_local char* procPath = NULL; // path of the procedure being declared
+_Thread_local int procPathCapacity = 0;
+_Thread_local int procPathLength[LEV_MAX + 2]; // length of the path of the block at each level
+_Thread_local proc_ref_t* reuseRefs = NULL; // refs of the entry being reused
+_Thread_local int* reuseSymbols = NULL; // symbol and atom each of them resolves to now
+_Thread_local int reuseCapacity = 0;
+_Thread_local int reuseSymbolCapacity = 0;
+_Thread_local int reusedProcs = 0; // statistics
+_Thread_local long long savedNanos = 0;
+_Thread_local long long relinkNanos = 0;
+_Thread_local long long procCacheNanos = 0; // reading and writing the cache file
 
-int processLexeme(char input[]) {
-    //make char array a valid string for strcmp
-    input[trackerInput] = '\0';
+/************************************************************
+*
+*   LINKER VARIABLES
+*
+************************************************************/
 
-    //assume that -1 indicates invalid token
-    int token = isReservedWordOrSymbol(input);
+//with --compile-only, what the object needs besides the code
+_Thread_local object_reloc_t* objectRelocs = NULL; // in the order of their instructions
+_Thread_local int objectRelocCount = 0;
+_Thread_local int objectRelocCapacity = 0;
+_Thread_local int* objectImports = NULL; // atom of each name called but not declared
+_Thread_local int importCount = 0;
+_Thread_local int importCapacity = 0;
 
-    if (token != -1)
-        return token;
+//while linking
+_Thread_local int* exportSlots = NULL; // open addressing hash of the level 0 procedures' names, procTable index + 1
+_Thread_local int exportSlotCount = 0;
+_Thread_local int linkObject = 0; // object being read, for the error messages
+_Thread_local char linkName[12]; // procedure an error is about
 
-    token = isIdentifier(input);
+/************************************************************
+*
+*   ARENA VARIABLES
+*
+************************************************************/
 
-    //error occured
-    if (token == 0){
-        error(17);  //ERROR: invalid identifier or identifier too long
+//every table above lives in the arena, a grown table leaves its old copy behind until arenaFree
+_Thread_local arena_chunk_t* arena = NULL; // chunk new allocations come from
+_Thread_local size_t arenaReserved = 0; // bytes malloc'd for chunks, also the peak since nothing is freed early
+_Thread_local size_t arenaUsed = 0; // bytes handed out, including abandoned copies of grown tables
+_Thread_local int arenaChunks = 0;
+_Thread_local int arenaAllocs = 0;
+_Thread_local int tableGrows = 0;
+_Thread_local int tableGrowsInPlace = 0; // growths that extended the newest allocation without copying
 
-    }
-    if (token != -1)
-        return token;
+/************************************************************
+*
+*   TIME REPORT VARIABLES
+*
+************************************************************/
 
-    token = isNumber(input);
+const char* phaseNames[PHASES] = {"scan", "parse", "optimize", "output"};
+_Thread_local double phaseWall[PHASES]; // seconds
+_Thread_local double phaseCpu[PHASES];
+_Thread_local struct timespec phaseWallStart;
+_Thread_local struct timespec phaseCpuStart;
+_Thread_local int symbolInserts = 0; // counted all the time, they are only printed by --time-report
+_Thread_local int symbolLookups = 0;
+_Thread_local int maxLevel = 0; // deepest block() nesting
+_Thread_local int exprDepth = 0; // expression() calls currently open
+_Thread_local int maxExprDepth = 0;
+_Thread_local int parsedInstructions = 0; // cx when the parser finished, before the peephole pass
+_Thread_local int parsedProcs = 0; // procCount when the parser finished, before dead code removal
+_Thread_local long outputBytes = 0; // size of the file produceElfAndOut wrote
 
-    //error occured
-    if (token == 0)
-        error(18);  //ERROR: invalid number or number too long
+/************************************************************
+*
+*   SERVER VARIABLES
+*
+************************************************************/
 
-    if (token != -1)
-        return token;
+#ifndef PL0_LIBRARY
+#define SERVER_BACKLOG 128 // connections the listening socket queues
+#define SERVER_QUEUE 1024 // accepted connections waiting for a worker
+#define SERVER_CACHE 256 // responses kept by default
 
-    //if code reaches here, input failed all checks and is not valid symbol
-    error(19);  //ERROR: invalid symbol
-    return -1;
-}
+//finished response, kept under the request that produced it
+typedef struct
+{
+    uint64_t hash;
+    char* key; // the whole request, compared on a hash match
+    size_t keySize;
+    char* response; // server_response_t and its payload, ready to send
+    size_t responseSize;
+    long long lastUsed;
+} cache_entry_t;
+
+//accepted connections, a ring the listening thread fills and the workers drain
+int serverQueue[SERVER_QUEUE];
+int serverQueueHead = 0;
+int serverQueueCount = 0;
+pthread_mutex_t serverLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t serverNotEmpty = PTHREAD_COND_INITIALIZER;
+pthread_cond_t serverNotFull = PTHREAD_COND_INITIALIZER;
+
+//recently compiled requests, the least recently used one makes room for a new one
+cache_entry_t* cache = NULL;
+int cacheCapacity = SERVER_CACHE;
+int cacheCount = 0;
+long long cacheClock = 0;
+pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
-int isMismatched(char input[]) {
-    //all none mismatched cases
-    if ((isalpha(input[trackerInput]) && isalpha(input[trackerInput - 1]))
-        || (isdigit(input[trackerInput]) && isdigit(input[trackerInput - 1]))
-        || (isalpha(input[trackerInput]) && isdigit(input[trackerInput - 1]) && isalpha(input[0]))
-        || (isdigit(input[trackerInput]) && isalpha(input[trackerInput - 1]))
-        || (isSpecialSymbol(input[trackerInput]) && isSpecialSymbol(input[trackerInput - 1])))
-        return 0;
-    return 1;
-}
+/************************************************************
+*
+*   OPTIONS
+*
+************************************************************/
 
-//checks if symbols need to be split
-int splitSymbol(char input[]) {
-    //not dealing with two symbols so we exit
-    if (!isSpecialSymbol(input[trackerInput]) || !isSpecialSymbol(input[trackerInput - 1]))
-        return 0;
+//copied from the pl0_ctx_t at the start of every pl0_compile
+_Thread_local int textElf = 0; // 1 to export the old "op L M" text format instead of a binary image
+_Thread_local int nativeAsm = 0; // 1 to write x86-64 assembly for pl0rt.c instead of an image
+_Thread_local int objectOutput = 0; // 1 to write a relocatable object instead of an image
+_Thread_local int listing = 0; // 1 to print the source and the instructions
+_Thread_local FILE* listingFile = NULL; // where the listing and the reports go
+_Thread_local int regIsa = 0; // 1 to translate the stack code to the register ISA before writing it
+_Thread_local int peepholeWindow = 3; // longest rule the peephole pass may apply, 0 turns it off
+_Thread_local int peepholeStats = 0; // 1 to print how many instructions each rule removed
+_Thread_local int deadCode = 1; // 1 to thread jumps and drop the code the entry never reaches
+_Thread_local int deadCodeReport = 0; // 1 to print what that saved
+_Thread_local int optLevel = 1; // 2 adds value numbering over the IR
+_Thread_local int foldConstants = 1; // 0 to emit every operation and branch as written, for debugging
+_Thread_local int useDisplay = 0; // 1 to reach frames two or more levels out through the VM's display
+_Thread_local int memReport = 0; // 1 to print the arena's peak size and allocation counts
+_Thread_local int lexerBench = 0; // 1 to time both scanners over the source instead of compiling it
+_Thread_local int symbolBench = 0; // 1 to time symbol lookups on the program's own lookup trace
+_Thread_local int timeReport = 0; // 1 to print the time and counts of each compiler phase
+_Thread_local const char* timeReportJson = NULL; // file to write the same report to as JSON
+_Thread_local const char* incrementalCache = NULL; // file of procedure code kept between compiles, NULL for none
+_Thread_local int incrementalReport = 0; // 1 to print how many procedures were reused
+
+#ifndef PL0_LIBRARY
+//command line wrapper around pl0_compile, or the compile server with --server
+int main(int argc, const char* argv[]) {
+    const char* files[argc];
+    const char* outName = NULL;
+    const char* src;
+    size_t srcLength;
+    pl0_ctx_t ctx;
+    pl0_result_t result;
+    int status;
+
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+        return runServer(argc, argv);
+    if (argc > 1 && strcmp(argv[1], "--link") == 0)
+        return runLinker(argc, argv);
+    int fileCount = parseOptions(argc, argv, &ctx, files, &outName, stderr);
+    if (fileCount == 0) {
+        printf("usage: %s [--text] [--reg] [--asm] [--compile-only] [--no-peephole] [--peephole-window n] [--peephole-stats] [-O0|-O1|-O2] [--no-dce] [--dce-report] [--no-fold] [--display] [--mem-report] [--legacy-lexer] [--bench-lexer] [--bench-symbols] [--time-report] [--time-report-json file] [--incremental cache] [-o elf] input.txt\n"
+               "       %s --link [--text] [--reg] [--asm] [--no-peephole] [--peephole-window n] [--peephole-stats] [-O0|-O1|-O2] [--no-dce] [--dce-report] [--mem-report] [--time-report] [--time-report-json file] [-o elf] program.o module.o ...\n"
+               "       %s --server [-j workers] [--cache entries] [socket]\n", argv[0], argv[0], argv[0]);
+        return 1;
+    }
+    const char* fname = files[fileCount - 1];
+    if (loadSource(fname, &src, &srcLength) != 0) {
+        printf("cannot open %s\n", fname);
+        return 1;
+    }
 
-    //only dont split if were leading to two symbol token such := >= <= <>
-    if ((input[trackerInput - 1] == '<' && input[trackerInput] == '>')
-        || (input[trackerInput - 1] == ':' && input[trackerInput] == '=')
-        || (input[trackerInput - 1] == '<' && input[trackerInput] == '=')
-        || (input[trackerInput - 1] == '>' && input[trackerInput] == '='))
-        return 0;
-    return 1;
+    status = compileSource(&ctx, src, srcLength, stdout, &result);
+    //the benchmarks and errors leave no output
+    if (result.output != NULL && writeOutput(&ctx, outName, &result) != 0)
+        return 1;
+    pl0_free_result(&result);
+    return status;
 }
 
-//handles improperly closed comments, enables program to continue tokenizing as normal
-void commentHandling(FILE* file) {
-    //tracks the input while in this function
-    int tracker = 0;
-
-    char commentInput[INPUT_MAX] = {0};
+//"compiler --link [options] program.o module.o ...": links the objects into one program, which
+//is written and listed like a compiled one
+int runLinker(int argc, const char* argv[]) {
+    const char* files[argc];
+    const char* outName = NULL;
+    pl0_ctx_t ctx;
+    pl0_result_t result;
+
+    int count = parseOptions(argc - 1, argv + 1, &ctx, files, &outName, stderr);
+    if (count == 0) {
+        printf("usage: %s --link [options] program.o module.o ... [-o elf]\n", argv[0]);
+        return 1;
+    }
+    if (ctx.format == PL0_OBJECT) {
+        fprintf(stderr, "--compile-only has no effect with --link\n");
+        ctx.format = PL0_IMAGE;
+    }
+    const char** objects = malloc(count * sizeof(char*));
+    size_t* lengths = malloc(count * sizeof(size_t));
+    if (objects == NULL || lengths == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (int k = 0; k < count; k++) {
+        if (loadSource(files[k], &objects[k], &lengths[k]) != 0) {
+            printf("cannot open %s\n", files[k]);
+            return 1;
+        }
+    }
 
-    while (fscanf(file, "%c", &commentInput[tracker]) == 1) {
-        //if its closed return and pointer will point to right after comment closing
-        if (tracker > 0 && commentInput[tracker - 1] == '*' && commentInput[tracker] == '/')
-            //return 0 if comment PROPERLY closed
-            return;
-        tracker++;
+    ctx.out = stdout;
+    if (pl0_link(&ctx, objects, lengths, count, &result) != 0) {
+        printf("Error: %s\n", result.diagnostic.message);
+        return 1;
     }
+    if (writeOutput(&ctx, outName, &result) != 0)
+        return 1;
+    pl0_free_result(&result);
+    free(objects);
+    free(lengths);
+    return 0;
 }
 
-void printTokenList() {
-    printf("\nToken List:\n");
-    int token;
-    int j = 0;
+//writes the result's output to outName, or to the format's default file
+int writeOutput(const pl0_ctx_t* ctx, const char* outName, const pl0_result_t* result) {
+    if (outName == NULL)
+        outName = defaultOutName(ctx->format);
+    FILE* file = fopen(outName, ctx->format == PL0_IMAGE || ctx->format == PL0_OBJECT ? "wb" : "w");
+    if (file == NULL) {
+        printf("cannot create %s\n", outName);
+        return 1;
+    }
+    fwrite(result->output, 1, result->outputSize, file);
+    fclose(file);
+    return 0;
+}
 
-    for (int i = 0; i < trackerToken; i++) {
-        token = tokenArray[i];
-        printf("%d ", token);
-        if (token == 2 && (i == 0 || tokenArray[i - 1] != 3))
-            printf("%s ", identifierArray[j++]);
+//fills ctx from the command line and files with the plain arguments (it has room for argc), the
+//source file is the last of them; returns how many there are
+//warnings about options that cancel out go to err
+int parseOptions(int argc, const char* argv[], pl0_ctx_t* ctx, const char* files[], const char** outName, FILE* err) {
+    int wantText = 0;
+    int wantAsm = 0;
+    int wantObject = 0;
+    int fileCount = 0;
+
+    pl0_init(ctx);
+    ctx->listing = 1;
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--text") == 0)
+            wantText = 1;
+        else if (strcmp(argv[a], "--reg") == 0)
+            ctx->regIsa = 1;
+        else if (strcmp(argv[a], "--asm") == 0)
+            wantAsm = 1;
+        else if (strcmp(argv[a], "--compile-only") == 0)
+            wantObject = 1;
+        else if (strcmp(argv[a], "--no-peephole") == 0)
+            ctx->peepholeWindow = 0;
+        else if (strcmp(argv[a], "--peephole-window") == 0 && a + 1 < argc)
+            ctx->peepholeWindow = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--peephole-stats") == 0)
+            ctx->peepholeStats = 1;
+        else if (strcmp(argv[a], "-O0") == 0 || strcmp(argv[a], "-O1") == 0 || strcmp(argv[a], "-O2") == 0) {
+            ctx->optLevel = argv[a][2] - '0';
+            ctx->foldConstants = ctx->deadCode = ctx->optLevel > 0;
+            ctx->peepholeWindow = ctx->optLevel > 0 ? 3 : 0;
+        }
+        else if (strcmp(argv[a], "--no-dce") == 0)
+            ctx->deadCode = 0;
+        else if (strcmp(argv[a], "--dce-report") == 0)
+            ctx->deadCodeReport = 1;
+        else if (strcmp(argv[a], "--no-fold") == 0)
+            ctx->foldConstants = 0;
+        else if (strcmp(argv[a], "--display") == 0)
+            ctx->useDisplay = 1;
+        else if (strcmp(argv[a], "--mem-report") == 0)
+            ctx->memReport = 1;
+        else if (strcmp(argv[a], "--legacy-lexer") == 0)
+            ctx->legacyLexer = 1;
+        else if (strcmp(argv[a], "--bench-lexer") == 0)
+            ctx->lexerBench = 1;
+        else if (strcmp(argv[a], "--bench-symbols") == 0)
+            ctx->symbolBench = 1;
+        else if (strcmp(argv[a], "--time-report") == 0)
+            ctx->timeReport = 1;
+        else if (strcmp(argv[a], "--time-report-json") == 0 && a + 1 < argc)
+            ctx->timeReportJson = argv[++a];
+        else if (strcmp(argv[a], "--incremental") == 0 && a + 1 < argc) {
+            ctx->incremental = argv[++a];
+            ctx->incrementalReport = 1;
+        }
+        else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc)
+            *outName = argv[++a];
+        else
+            files[fileCount++] = argv[a];
     }
-    puts("");
+    //the register ISA has no display, its RLDN/RSTN walk the static chain
+    if (ctx->regIsa && ctx->useDisplay) {
+        fprintf(err, "--display has no effect with --reg\n");
+        ctx->useDisplay = 0;
+    }
+    //the native backend translates the stack code
+    if (wantAsm && (ctx->regIsa || wantText)) {
+        fprintf(err, "--reg and --text have no effect with --asm\n");
+        ctx->regIsa = wantText = 0;
+    }
+    //an object is stack code for the linker, which does the rest
+    if (wantObject && (ctx->regIsa || wantAsm || wantText)) {
+        fprintf(err, "--reg, --asm and --text have no effect with --compile-only, pass them to --link\n");
+        ctx->regIsa = wantAsm = wantText = 0;
+    }
+    if (wantObject && ctx->incremental != NULL) {
+        fprintf(err, "--incremental has no effect with --compile-only\n");
+        ctx->incremental = NULL;
+        ctx->incrementalReport = 0;
+    }
+    ctx->format = wantObject ? PL0_OBJECT : wantAsm ? PL0_ASM : wantText ? PL0_TEXT : PL0_IMAGE;
+    return fileCount;
+}
+
+//compiles like the command line does, the listing and any error message go to out
+//returns the exit status, which is 0 after a compile error and 1 if memory ran out
+int compileSource(pl0_ctx_t* ctx, const char* src, size_t length, FILE* out, pl0_result_t* result) {
+    ctx->out = out;
+    if (pl0_compile(ctx, src, length, result) == 0)
+        return 0;
+    //the messages from 16 on never had a newline
+    int id = result->diagnostic.id;
+    fprintf(out, "Error: %s%s", result->diagnostic.message, id <= 15 || id >= PL0_OUT_OF_MEMORY ? "\n" : "");
+    return id == PL0_OUT_OF_MEMORY;
+}
+
+const char* defaultOutName(int format) {
+    return format == PL0_OBJECT ? "elf.o" : format == PL0_ASM ? "elf.s" : format == PL0_TEXT ? "elf.txt" : "elf.bin";
 }
+#endif
 
 /************************************************************
 *
-*   PARSER FUNCTIONS
+*   LIBRARY FUNCTIONS
 *
 ************************************************************/
 
-void emit(int op, int L, int M) {
-    if (cx > MAX_INSTRUCTIONS)
-        error(16); //ERROR: max number of instructions exceeded
-    else {
-        text[cx].op = op;
-        text[cx].L = L;
-        text[cx].M = M;
-        cx++;
-    }
+void pl0_init(pl0_ctx_t* ctx) {
+    memset(ctx, 0, sizeof(pl0_ctx_t));
+    ctx->format = PL0_IMAGE;
+    ctx->peepholeWindow = 3;
+    ctx->deadCode = 1;
+    ctx->foldConstants = 1;
+    ctx->optLevel = 1;
 }
 
-void error(int id) {
-    int idx;
-    printf("Error: ");
-    switch (id) {
-        case 1:
-            printf("program must end with period\n");
-            break;
-        case 2:
-            printf("const, var, and read keywords must be followed by identifier\n");
-            break;
-        case 3:
-            printf("symbol name has already been declared\n");
-            break;
-        case 4:
-            printf("constants must be assigned with =\n");
-            break;
-        case 5:
-            printf("constants must be assigned an integer value\n");
-            break;
-        case 6:
-            printf("constant, procedure and variable declarations must be followed by a semicolon\n");
-            break;
-        case 7:
-            //get index of most recent identifier
-            idx = trackerIdentifier - 1;
-            printf("undeclared identifier %s\n", identifierArray[idx]);
-            break;
-        case 8:
-            printf("assignment to constant or procedure is not allowed\n");
-            break;
-        case 9:
-            printf("assignment statements must use :=\n");
-            break;
-        case 10:
-            printf("begin must be followed by end\n");
-            break;
-        case 11:
-            printf("if must be followed by then\n");
-            break;
-        case 12:
-            printf("while must be followed by do\n");
-            break;
-        case 13:
-            printf("condition must contain comparison operator\n");
-            break;
-        case 14:
-            printf("right parenthesis must follow left parenthesis\n");
-            break;
-        case 15:
-            printf("arithmetic equations must contain operands, parentheses, numbers or symbols\n");
-            break;
-        case 16:
-            printf("max number of instructions exceeded");
-            break;
-        case 17:
-            printf("identifier too long");
-            break;
-        case 18:
-            printf("number too long");
-            break;
-        case 19:
-            printf("invalid symbol");
-            break;
-        case 20:
-            printf("then must be followed by fi");
-            break;
-        case 21:
-            printf("call must be followed by an identifier");
-            break;
-        case 22:
-            printf("call of a constant or variable is meaningless");
-            break;
-        case 23:
-            printf("maximum number of nested functions exceeded");
-            break;
-        case 24:
-            printf("semicolon expected");
-            break;
-        case 25:
-            printf("expression must not contain a procedure identifier");   //make input file for this
-            break;
-        case 26:
-            printf("semicolon missing after procedure declaration");
-            break;
-        case 27:
-            printf("incorrect symbol after procedure declaration");
-            break;
+//compiles length bytes of src with this thread's tables, which start empty and are freed
+//again before it returns; the result owns its memory, free it with pl0_free_result
+int pl0_compile(const pl0_ctx_t* ctx, const char* src, size_t length, pl0_result_t* result) {
+    memset(result, 0, sizeof(pl0_result_t));
+    resetCompiler();
+    diagnostic = &result->diagnostic;
+    source = src;
+    sourceLength = length;
+    applyOptions(ctx);
+
+    if (setjmp(errorJump) != 0) {
+        discardResult(result);
+        return -1;
+    }
+    //token offsets are 32 bits
+    if (length > INT32_MAX)
+        error(PL0_SOURCE_TOO_LARGE);
+    initCharClasses();
+    if (lexerBench) {
+        benchLexer();
+        arenaFree();
+        return 0;
     }
-    exit(0);
-}
-
-int getNextToken() {
-    return tokenArray[trackerToken++];
-}
 
-char* getNextIdentifier() {
-    return identifierArray[trackerIdentifier++];
-}
+    if (incrementalCache != NULL)
+        loadProcCache();
 
-void addToSymbolTable(int kind, char* name, int val, int level, int address) {
-    symbol_t temp;
-    temp.kind = kind;
-    strcpy(temp.name, name);
-    temp.val = val;
-    temp.level = level;
-    temp.addr = address;
-    temp.mark = 0;
+    //the parser pulls tokens from the scanner as it goes, so to time the two apart the
+    //report scans the whole source first
+    if (timeReport || timeReportJson != NULL) {
+        phaseStart();
+        while (scanNext())
+            ;
+        phaseEnd(PHASE_SCAN);
+    }
 
-    symbol_table[tp++] = temp;
+    ////////////////////////
+    //begin parsing process, the parser pulls tokens from the scanner as it goes
+    ////////////////////////
+    phaseStart();
+    program();
+    phaseEnd(PHASE_PARSE);
+    parsedInstructions = cx;
+    parsedProcs = procCount;
+    if (symbolBench) {
+        benchSymbols();
+        arenaFree();
+        return 0;
+    }
+    if (incrementalCache != NULL)
+        storeProcCache();
+    finishProgram(result);
+    return 0;
 }
 
-int symbolTableCheck(char str[]) {
-    for (int i = tp - 1; i >= 0; i--) {
-        if (strcmp(symbol_table[i].name, str) == 0)
-            return i;
+//links the objects like pl0_compile compiles a source: the first is the program, the procedures of
+//the others are added to it and the result is written in the context's format
+int pl0_link(const pl0_ctx_t* ctx, const char* const objects[], const size_t lengths[], int count,
+             pl0_result_t* result) {
+    memset(result, 0, sizeof(pl0_result_t));
+    resetCompiler();
+    diagnostic = &result->diagnostic;
+    applyOptions(ctx);
+    //an object's code is final, and linked objects make a program
+    objectOutput = lexerBench = symbolBench = incrementalReport = 0;
+    incrementalCache = NULL;
+    peepholeWindow = ctx->peepholeWindow;
+    deadCode = ctx->deadCode;
+    optLevel = ctx->optLevel;
+    regIsa = ctx->regIsa && !nativeAsm;
+
+    if (setjmp(errorJump) != 0) {
+        discardResult(result);
+        return -1;
     }
-    return -1;
+    if (count < 1)
+        error(PL0_BAD_OBJECT);
+    phaseStart();
+    linkObjects(objects, lengths, count);
+    phaseEnd(PHASE_PARSE);
+    parsedInstructions = cx;
+    finishProgram(result);
+    return 0;
 }
 
-void program() {
-    token_p = getNextToken();
-    block();
-    if (token_p != periodsym)
-        error(1); //ERROR: program must end with period
-    emit(9, 0, 3); //halt program
+//copies the options out of the context into this thread's globals
+void applyOptions(const pl0_ctx_t* ctx) {
+    textElf = ctx->format == PL0_TEXT;
+    nativeAsm = ctx->format == PL0_ASM;
+    objectOutput = ctx->format == PL0_OBJECT;
+    //an object keeps the parser's code, the linker optimizes and translates the whole program
+    regIsa = ctx->regIsa && !nativeAsm && !objectOutput;
+    peepholeWindow = objectOutput ? 0 : ctx->peepholeWindow;
+    deadCode = ctx->deadCode && !objectOutput;
+    optLevel = objectOutput ? 0 : ctx->optLevel;
+    foldConstants = ctx->foldConstants;
+    useDisplay = ctx->useDisplay && !regIsa;
+    scanNext = ctx->legacyLexer ? scanLexeme : scanLexemeDfa;
+    listing = ctx->listing;
+    listingFile = ctx->out != NULL ? ctx->out : stdout;
+    peepholeStats = ctx->peepholeStats;
+    deadCodeReport = ctx->deadCodeReport && deadCode;
+    memReport = ctx->memReport;
+    timeReport = ctx->timeReport;
+    timeReportJson = ctx->timeReportJson;
+    lexerBench = ctx->lexerBench;
+    symbolBench = ctx->symbolBench;
+    //the symbol benchmark replays the lookups of a whole parse, and an object's relocations are
+    //recorded as the parser emits
+    incrementalCache = symbolBench || objectOutput ? NULL : ctx->incremental;
+    incrementalReport = ctx->incrementalReport && incrementalCache != NULL;
 }
 
-void block() {
-    lev++;
-    int prev_tp = tp;
+//optimizes the parsed or linked program, writes the output and the reports and hands the
+//instruction words to the result
+void finishProgram(pl0_result_t* result) {
+    phaseStart();
+    runPasses();
+    phaseEnd(PHASE_OPTIMIZE);
 
-    if(lev > LEV_MAX) {
-        error(23);       //ERROR: maximum number of nested functions exceeded
+    ////////////////////////
+    //print source and output
+    ////////////////////////
+    phaseStart();
+    if (listing && source != NULL)
+        printSourceCode();
+    produceElfAndOut(result);
+    phaseEnd(PHASE_OUTPUT);
+    if (peepholeStats)
+        printPeepholeStats();
+    if (deadCodeReport)
+        printDeadCodeReport();
+    if (memReport)
+        printMemReport();
+    if (timeReport)
+        printTimeReport();
+    if (timeReportJson != NULL)
+        writeTimeReportJson(timeReportJson);
+    if (incrementalReport)
+        printIncrementalReport();
+
+    //the instruction words outlive the arena
+    int words = regIsa ? 4 : 3;
+    result->regIsa = regIsa;
+    result->entry = regIsa ? 0 : IMAGE_TEXT_BASE;
+    result->codeLength = regIsa ? rx : cx;
+    result->code = malloc((result->codeLength * words + 1) * sizeof(int32_t));
+    if (result->code == NULL)
+        error(PL0_OUT_OF_MEMORY);
+    for (int i = 0; i < result->codeLength; i++) {
+        int32_t* w = result->code + i * words;
+        if (regIsa) {
+            w[0] = regText[i].op;
+            w[1] = regText[i].a;
+            w[2] = regText[i].b;
+            w[3] = regText[i].c;
+        }
+        else {
+            w[0] = text[i].op;
+            w[1] = text[i].L;
+            w[2] = text[i].M;
+        }
     }
+    arenaFree();
+}
 
-    int jmpAddr = cx;
-    emit(7, 0, 0);
+//after an error: the result keeps only the diagnostic
+void discardResult(pl0_result_t* result) {
+    free(result->code);
+    free(result->output);
+    result->code = NULL;
+    result->output = NULL;
+    result->codeLength = 0;
+    result->outputSize = 0;
+    arenaFree();
+}
 
-    constDeclaration();
-    int numvars = varDeclaration();
-    procDeclaration();
+void pl0_free_result(pl0_result_t* result) {
+    free(result->code);
+    free(result->output);
+    result->code = NULL;
+    result->output = NULL;
+}
 
-    text[jmpAddr].M = cx * 3 + 10;
+//puts every table and counter back the way a fresh thread starts, for the next pl0_compile
+void resetCompiler() {
+    source = NULL;
+    sourceLength = sourcePos = lexemeOffset = 0;
+    tokens = NULL;
+    tokenCapacity = tokenCount = tokenTotal = numberTotal = identifierTotal = 0;
+    trackerToken = trackerInput = 0;
+    input = NULL;
+    inputCapacity = 0;
+
+    atomOffset = atomLength = atomHead = atomSlots = NULL;
+    atomCount = atomCapacity = atomSlotCount = 0;
+    symKind = symVal = symLevel = symAddr = symAtom = symPrevSame = NULL;
+    symbolCapacity = 0;
+    scopeMarks = NULL;
+    scopeCapacity = scopeDepth = 0;
+    symbolEvents = NULL;
+    symbolEventCapacity = symbolEventCount = 0;
+    text = NULL;
+    textCapacity = tp = token_p = cx = 0;
+    lev = -1;
+    procTable = NULL;
+    procCapacity = procCount = 0;
+    memset(displayUsed, 0, sizeof(displayUsed));
+
+    regText = NULL;
+    regCapacity = rx = 0;
+    regMap = NULL;
+    asmFile = NULL;
+    asmOff = asmCached = 0;
+    for (int r = 0; r < PEEPHOLE_RULES; r++)
+        peepholeRules[r].applied = peepholeRules[r].removed = 0;
+    compactIndex = NULL;
+    compactIndexCapacity = 0;
+    threadedJumps = deadProcedures = deadInstructions = deadCodeBefore = 0;
+    for (int p = 0; p < OPT_PASSES; p++) {
+        optPasses[p].enabled = optPasses[p].ran = optPasses[p].before = optPasses[p].after = 0;
+        optPasses[p].wall = optPasses[p].cpu = 0;
+    }
+    irNodes = NULL;
+    irNodeCapacity = irNodeCount = 0;
+    irBlocks = NULL;
+    irBlockCapacity = irBlockCount = 0;
+    irBlockOf = irFrameInc = irFrameTemps = NULL;
+    irValues = NULL;
+    irValueCapacity = irValueCount = 0;
+    irBuckets = NULL;
+    irBucketMask = 0;
+    irUndoLog = NULL;
+    irUndoCapacity = irUndoCount = 0;
+    irVersion = NULL;
+    irEpoch = irClock = irReused = irFolded = 0;
+    irBuilt = 0;
+    irLoops = NULL;
+    irLoopCapacity = irLoopCount = 0;
+    irReductions = NULL;
+    irReductionCapacity = irReductionCount = 0;
+    irInvariant = NULL;
+    irLoopStores = NULL;
+    irLoopStoreCapacity = irLoopStoreCount = irLoopCalls = 0;
+    irEveryTrip = NULL;
+    irHoisted = irReduced = 0;
+
+    arena = NULL;
+    arenaReserved = arenaUsed = 0;
+    arenaChunks = arenaAllocs = tableGrows = tableGrowsInPlace = 0;
+
+    memset(phaseWall, 0, sizeof(phaseWall));
+    memset(phaseCpu, 0, sizeof(phaseCpu));
+    symbolInserts = symbolLookups = maxLevel = exprDepth = maxExprDepth = parsedInstructions = parsedProcs = 0;
+    outputBytes = 0;
+
+    procCacheFile = NULL;
+    procCacheFileSize = 0;
+    procCacheOffsets = NULL;
+    procCacheEntryCount = 0;
+    procCacheSlots = NULL;
+    procCacheSlotCount = 0;
+    procCacheOut = NULL;
+    procCacheOutCapacity = procCacheOutSize = procCacheOutEntries = 0;
+    procCachePieces = NULL;
+    procCachePieceCount = procCachePieceCapacity = 0;
+    memset(procRecords, 0, sizeof(procRecords));
+    memset(atomNoted, 0, sizeof(atomNoted));
+    atomNotedCapacity = noteSerial = 0;
+    procPath = NULL;
+    procPathCapacity = 0;
+    memset(procPathLength, 0, sizeof(procPathLength));
+    reuseRefs = NULL;
+    reuseSymbols = NULL;
+    reuseCapacity = reuseSymbolCapacity = reusedProcs = 0;
+    savedNanos = relinkNanos = procCacheNanos = 0;
+
+    objectRelocs = NULL;
+    objectRelocCount = objectRelocCapacity = 0;
+    objectImports = NULL;
+    importCount = importCapacity = 0;
+    exportSlots = NULL;
+    exportSlotCount = linkObject = 0;
+}
 
-    emit(6, 0, numvars + 3);
+/************************************************************
+*
+*   SCANNER FUNCTIONS
+*
+************************************************************/
 
-    statement();
+//maps the source file, a file that cannot be mapped (a pipe, say) is read into the heap instead
+//either way it stays until the process exits
+int loadSource(const char* fname, const char** src, size_t* length) {
+    struct stat st;
 
-    if(lev != 0)
-        emit(2, 0, 0);
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        return -1;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            *src = map;
+            *length = st.st_size;
+            close(fd);
+            return 0;
+        }
+    }
 
-    tp = prev_tp;
-    lev--;
+    size_t capacity = 0;
+    size_t used = 0;
+    char* buffer = NULL;
+    ssize_t got;
+    do {
+        if (used + 4096 > capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 65536;
+            buffer = realloc(buffer, capacity);
+            if (buffer == NULL) {
+                close(fd);
+                return -1;
+            }
+        }
+        got = read(fd, buffer + used, capacity - used);
+        if (got > 0)
+            used += got;
+    } while (got > 0);
+    close(fd);
+    *src = buffer;
+    *length = used;
+    return got < 0 ? -1 : 0;
 }
 
-void constDeclaration() {
-    if (token_p == constsym) {
-        do {
-            token_p = getNextToken();
+//feeds source characters into the lexeme buffer until one lexeme has been tokenized
+//returns 0 once the source is used up and nothing is left to tokenize
+int scanLexeme() {
+    while (sourcePos < sourceLength) {
+        //room for this character and the terminator processLexeme adds
+        input = reserve(input, &inputCapacity, trackerInput + 2, 1);
+        input[trackerInput] = source[sourcePos++];
 
-            if (token_p != identsym)
-                error(2); //ERROR: const, var, read keywords must be followed by identifier
+        //detects if we are currently scanning in a comment
+        if (trackerInput > 0 && input[trackerInput - 1] == '/' && input[trackerInput] == '*') {
+            commentHandling();
+            trackerInput = 0;
+        }
+        //tokenize before whitespace or skip over it
+        else if (isspace(input[trackerInput])) {
+            if (trackerInput != 0) {
+                lexemeProcessWrapper(input, sourcePos - 1 - trackerInput);
+                trackerInput = 0;
+                return 1;
+            }
+        }
+        //if we have mismatched characters or need to split symbols we tokenize first half
+        else if (trackerInput > 0 && (isMismatched(input) || splitSymbol(input))) {
+            char temp = input[trackerInput];
+            lexemeProcessWrapper(input, sourcePos - 1 - trackerInput);
 
-            char* name = getNextIdentifier(); //get name of next identifier
+            //now input in mismatched character and update tracker
+            input[0] = temp;
+            trackerInput = 1;
+            return 1;
+        }
+        //increment tracker if we dont tokenize since we're adding to input
+        else
+            trackerInput++;
+    }
+    //something left in input after the end of the source
+    if (trackerInput > 0) {
+        lexemeProcessWrapper(input, sourcePos - trackerInput);
+        trackerInput = 0;
+        return 1;
+    }
+    return 0;
+}
 
-            if (symbolTableCheck(name) != -1)
-                error(3); //ERROR: symbol name already declared
+//sets up charClass with the same ctype tests isMismatched, splitSymbol and isspace use
+void initCharClasses() {
+    for (int c = 0; c < 256; c++) {
+        char ch = (char)c;
+        if (isspace(ch))
+            charClass[c] = CC_SPACE;
+        else if (isalpha(ch))
+            charClass[c] = CC_ALPHA;
+        else if (isdigit(ch))
+            charClass[c] = CC_DIGIT;
+        else if (isSpecialSymbol(ch))
+            charClass[c] = CC_SYMBOL;
+        else
+            charClass[c] = CC_OTHER;
+    }
+    charClass['<'] = CC_LT;
+    charClass['>'] = CC_GT;
+    charClass['='] = CC_EQ;
+    charClass[':'] = CC_COLON;
+    charClass['/'] = CC_SLASH;
+    charClass['*'] = CC_STAR;
+}
 
-            token_p = getNextToken();
+//table-driven replacement for scanLexeme: one transition per character, runs of identifier,
+//digit and whitespace characters are skipped a vector at a time
+int scanLexemeDfa() {
+    int state = LX_START;
+    size_t start = sourcePos;
 
-            if (token_p != eqsym)
-                error(4); //ERROR: constants must be assigned with =
+    while (sourcePos < sourceLength) {
+        int next = lexerTransitions[state][charClass[(unsigned char)source[sourcePos]]];
 
-            token_p = getNextToken();
+        if (next == LX_EMIT) {
+            emitLexeme(state, start, sourcePos - start);
+            return 1;
+        }
+        if (next == LX_COMMENT) {
+            sourcePos++;
+            commentHandling();
+            state = LX_START;
+            start = sourcePos;
+            continue;
+        }
+        sourcePos++;
+        if (next == LX_START) {
+            sourcePos = spaceRun(sourcePos);
+            start = sourcePos;
+        }
+        else if (next == LX_IDENT)
+            sourcePos = identifierRun(sourcePos);
+        else if (next == LX_NUMBER)
+            sourcePos = digitRun(sourcePos);
+        state = next;
+    }
+    if (state == LX_START)
+        return 0;
+    emitLexeme(state, start, sourcePos - start);
+    return 1;
+}
 
-            if (token_p != numbersym)
-                error(5); //ERROR: constant must be assigned an integer value
+//turns the lexeme the DFA stopped in into tokens, with the old scanner's checks and errors
+void emitLexeme(int state, size_t offset, int len) {
+    const char* start = source + offset;
+    int token = lexerTokens[state];
+
+    lexemeOffset = offset;
+    if (state == LX_IDENT) {
+        token = keywordLookup(start, len);
+        if (token == -1 && len > 11)
+            error(17);  //ERROR: invalid identifier or identifier too long
+        if (token == -1)
+            token = identsym;
+    }
+    else if (state == LX_NUMBER && len > 5)
+        error(18);  //ERROR: invalid number or number too long
+    else if (state == LX_SYMBOL)
+        token = symbolTokens[(unsigned char)start[0]];
+    else if (token == 0)
+        error(19);  //ERROR: invalid symbol
 
-            //get number value of const
-            //getNextToken() is used to get the num value, as num values are stored in the same array as the tokens for simplicity
-            int val = getNextToken();
+    addToTokenList(token, offset, len);
+}
 
-            addToSymbolTable(1, name, val, 0, 0);
+//reserved word token for word[0..len), -1 if it is not one
+int keywordLookup(const char* word, int len) {
+    if (len < 2 || len > 9)
+        return -1;
+    const keyword_t* k = &keywordTable[keywordHash(word, len)];
+    if (k->word == NULL || strncmp(k->word, word, len) != 0 || k->word[len] != '\0')
+        return -1;
+    return k->token;
+}
 
-            token_p = getNextToken();
-        }
-        while (token_p == commasym);
+//end of the run of letters and digits starting at pos
+size_t identifierRun(size_t pos) {
+#if defined(__SSE2__)
+    while (pos + 16 <= sourceLength) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(source + pos));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20)); // folds upper case onto lower case
+        __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        unsigned mask = ~_mm_movemask_epi8(_mm_or_si128(alpha, digit)) & 0xffff;
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    while (pos < sourceLength && (charClass[(unsigned char)source[pos]] == CC_ALPHA
+                                  || charClass[(unsigned char)source[pos]] == CC_DIGIT))
+        pos++;
+    return pos;
+}
 
-        if (token_p != semicolonsym)
-            error(6);   //ERROR: constant and variable declarations must be followed by a semicolon
+//end of the run of digits starting at pos
+size_t digitRun(size_t pos) {
+#if defined(__SSE2__)
+    while (pos + 16 <= sourceLength) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(source + pos));
+        __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        unsigned mask = ~_mm_movemask_epi8(digit) & 0xffff;
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif
+    while (pos < sourceLength && charClass[(unsigned char)source[pos]] == CC_DIGIT)
+        pos++;
+    return pos;
+}
 
-        token_p = getNextToken();
+//end of the run of whitespace starting at pos
+size_t spaceRun(size_t pos) {
+#if defined(__SSE2__)
+    while (pos + 16 <= sourceLength) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(source + pos));
+        __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                     _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('\t' - 1)),
+                                                   _mm_cmplt_epi8(v, _mm_set1_epi8('\r' + 1))));
+        unsigned mask = ~_mm_movemask_epi8(space) & 0xffff;
+        if (mask != 0)
+            return pos + __builtin_ctz(mask);
+        pos += 16;
     }
+#endif
+    while (pos < sourceLength && charClass[(unsigned char)source[pos]] == CC_SPACE)
+        pos++;
+    return pos;
 }
 
-int varDeclaration() {
-    //store amount of vars declared
-    int numvars = 0;
+//tokenizes the whole source with each scanner and reports their speed
+void benchLexer() {
+    int (*scanners[2])() = {scanLexeme, scanLexemeDfa};
+    char* names[2] = {"legacy", "dfa"};
+    struct timespec begin, end;
 
-    if (token_p == varsym) {
-        do {
-            numvars++;
+    for (int k = 0; k < 2; k++) {
+        int rounds = 0;
+        double seconds = 0;
 
-            token_p = getNextToken();
+        tokenTotal = 0;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        //repeat short sources until the measurement takes a while
+        do {
+            sourcePos = 0;
+            trackerInput = 0;
+            while (scanners[k]()) {
+                trackerToken = tokenCount;
+            }
+            rounds++;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        } while (seconds < 0.5);
+        fprintf(listingFile, "%-8s %10d tokens in %8.4f s  %8.2f M tokens/s  %8.1f MB/s\n", names[k], tokenTotal / rounds,
+               seconds / rounds, tokenTotal / seconds / 1e6, sourceLength * (double)rounds / seconds / 1e6);
+    }
+}
 
-            //must declare a valid identifier
-            if (token_p != identsym)
-                error(2);   //ERROR: const, var, and read keywords must be followed by identifier
+//wrapper function to process inputs into token list
+void lexemeProcessWrapper(char input[], size_t offset) {
+    lexemeOffset = offset;
+    int token = processLexeme(input);
+    if (token != -1)
+        addToTokenList(token, offset, trackerInput);
+    else
+        fprintf(listingFile, "error");
+}
 
-            char* name = getNextIdentifier();
+//adds given token into token list, the lexeme is source[offset .. offset + length)
+void addToTokenList(int token, size_t offset, int length) {
+    //token is invalid
+    if (token == -1)
+        return;
+    //start over at the front once the parser has consumed everything
+    if (trackerToken == tokenCount)
+        trackerToken = tokenCount = 0;
+
+    tokens = reserve(tokens, &tokenCapacity, tokenCount + 1, sizeof(token_t));
+    token_t* t = &tokens[tokenCount++];
+    t->offset = offset;
+    t->kind = token;
+    t->value = 0;
+    tokenTotal++;
+    if (token == identsym) {
+        t->value = internIdentifier(source + offset, length);
+        identifierTotal++;
+    }
+    if (token == numbersym) {
+        //at most 5 digits
+        int value = 0;
+        for (int i = 0; i < length; i++)
+            value = value * 10 + (source[offset + i] - '0');
+        t->value = value;
+        numberTotal++;
+    }
+}
+
+//check if given input is a reserved word
+int isReservedWordOrSymbol(char word[]) {
+    if (strcmp(word, "odd") == 0)
+        return 1;
+    for (int i = 0; i < WORDS_SYMBOLS; i++)
+        if (strcmp(word, reservedWordsAndSymbols[i]) == 0)
+            return i + 4;
+
+    //-1 indicates that given string is NOT a reserved word
+    return -1;
+}
+
+//check if given input is an identifier
+int isIdentifier(char identifier[]) {
+    int i = 0;
+    int len = 0;
+    //check if first character of given input is a letter
+    if (!isalpha(identifier[0]))
+        return -1;
+    //check the other 10 characters in input, if we find something other than a letter or number, return -1 to indicate invalid
+    while (identifier[i] != '\0') {
+        if (!isalpha(identifier[i]) && !isdigit(identifier[i]))
+            return -1;
+
+        len++;
+        i++;
+    }
+    //a valid identifier can only be up to 11 characters long
+    if (len > 11)
+        return 0;
+
+    //if code reaches here, given input is a valid identifier
+    return identsym;
+}
+
+//check if given input is a special symbol
+int isSpecialSymbol(char sym) {
+    for (int i = 0; i < 13; i++)
+        if (sym == specialSymbols[i])
+            return 1;
+    return 0;
+}
+
+//check if given input is a valid number
+int isNumber(char input[]) {
+    int i = 0;
+    int len = 0;
+
+    //check to see if every char inside input is a digit & keep track of # of digits
+    while (input[i] != '\0') {
+        if (!isdigit(input[i]))
+            return -1;
+        i++;
+        len++;
+    }
+    //if number of digits exceeds 5, it is too long
+    if (len > 5)
+        return 0;
+
+    return numbersym;
+}
+
+int processLexeme(char input[]) {
+    //make char array a valid string for strcmp
+    input[trackerInput] = '\0';
+
+    //assume that -1 indicates invalid token
+    int token = isReservedWordOrSymbol(input);
+
+    if (token != -1)
+        return token;
+
+    token = isIdentifier(input);
+
+    //error occured
+    if (token == 0){
+        error(17);  //ERROR: invalid identifier or identifier too long
+
+    }
+    if (token != -1)
+        return token;
+
+    token = isNumber(input);
+
+    //error occured
+    if (token == 0)
+        error(18);  //ERROR: invalid number or number too long
+
+    if (token != -1)
+        return token;
+
+    //if code reaches here, input failed all checks and is not valid symbol
+    error(19);  //ERROR: invalid symbol
+    return -1;
+}
+
+int isMismatched(char input[]) {
+    //all none mismatched cases
+    if ((isalpha(input[trackerInput]) && isalpha(input[trackerInput - 1]))
+        || (isdigit(input[trackerInput]) && isdigit(input[trackerInput - 1]))
+        || (isalpha(input[trackerInput]) && isdigit(input[trackerInput - 1]) && isalpha(input[0]))
+        || (isdigit(input[trackerInput]) && isalpha(input[trackerInput - 1]))
+        || (isSpecialSymbol(input[trackerInput]) && isSpecialSymbol(input[trackerInput - 1])))
+        return 0;
+    return 1;
+}
+
+//checks if symbols need to be split
+int splitSymbol(char input[]) {
+    //not dealing with two symbols so we exit
+    if (!isSpecialSymbol(input[trackerInput]) || !isSpecialSymbol(input[trackerInput - 1]))
+        return 0;
+
+    //only dont split if were leading to two symbol token such := >= <= <>
+    if ((input[trackerInput - 1] == '<' && input[trackerInput] == '>')
+        || (input[trackerInput - 1] == ':' && input[trackerInput] == '=')
+        || (input[trackerInput - 1] == '<' && input[trackerInput] == '=')
+        || (input[trackerInput - 1] == '>' && input[trackerInput] == '='))
+        return 0;
+    return 1;
+}
+
+//handles improperly closed comments, enables program to continue tokenizing as normal
+void commentHandling() {
+    //only the previous character matters, so comments can be any length
+    char prev = 0;
+    char c;
+
+    while (sourcePos < sourceLength) {
+        c = source[sourcePos++];
+        //if its closed return and pointer will point to right after comment closing
+        if (prev == '*' && c == '/')
+            //return 0 if comment PROPERLY closed
+            return;
+        prev = c;
+    }
+}
+
+void printTokenList() {
+    fprintf(listingFile, "\nToken List:\n");
+    for (int i = 0; i < tokenCount; i++) {
+        fprintf(listingFile, "%d ", tokens[i].kind);
+        if (tokens[i].kind == identsym)
+            fprintf(listingFile, "%.*s ", atomLength[tokens[i].value], source + tokens[i].offset);
+        if (tokens[i].kind == numbersym)
+            fprintf(listingFile, "%d ", tokens[i].value);
+    }
+    puts("");
+}
+
+/************************************************************
+*
+*   PARSER FUNCTIONS
+*
+************************************************************/
+
+void emit(int op, int L, int M) {
+    //text grows without bound, but every pc (cx * 3 + 10) has to fit in an int
+    if (cx >= (INT_MAX - 10) / 3)
+        error(16); //ERROR: max number of instructions exceeded
+    else {
+        //code the parser took back (a constant condition's) may have had relocations
+        while (objectRelocCount > 0 && objectRelocs[objectRelocCount - 1].index >= (uint32_t)cx)
+            objectRelocCount--;
+        text = reserve(text, &textCapacity, cx + 1, sizeof(text_t));
+        text[cx].op = op;
+        text[cx].L = L;
+        text[cx].M = M;
+        cx++;
+    }
+}
+
+//LOD, STO or CAL of a symbol, with --display a frame two or more levels out is addressed by its
+//absolute level (LDX, STX, CLX) and the block that owns it is told to keep display[level] up to date
+void emitAccess(int op, int symIdx) {
+    int level = symLevel[symIdx];
+
+    if (useDisplay && lev - level >= 2) {
+        displayUsed[level] = 1;
+        if (incrementalCache != NULL)
+            noteDisplay(level);
+        emit(op == 3 ? 11 : op == 4 ? 12 : 13, level, symAddr[symIdx]);
+    }
+    else
+        emit(op, lev - level, symAddr[symIdx]);
+    //every module's level 0 variables share the main frame once linked
+    if (objectOutput && level == 0 && op != 5)
+        addObjectReloc(RELOC_DATA, 0);
+}
+
+//instructions whose M is an absolute pc: CAL, JMP, JPC and CLX
+int isBranch(int op) {
+    return op == 5 || op == 7 || op == 8 || op == 13;
+}
+
+//records the error in the diagnostic and unwinds to pl0_compile
+void error(int id) {
+    const char* message = "";
+    size_t offset;
+    int idx;
+
+    switch (id) {
+        case 1:
+            message = "program must end with period";
+            break;
+        case 2:
+            message = "const, var, and read keywords must be followed by identifier";
+            break;
+        case 3:
+            message = "symbol name has already been declared";
+            break;
+        case 4:
+            message = "constants must be assigned with =";
+            break;
+        case 5:
+            message = "constants must be assigned an integer value";
+            break;
+        case 6:
+            message = "constant, procedure and variable declarations must be followed by a semicolon";
+            break;
+        case 7:
+            //the identifier the parser just read
+            idx = tokenAtom();
+            snprintf(diagnostic->message, sizeof(diagnostic->message), "undeclared identifier %.*s",
+                     atomLength[idx], source + atomOffset[idx]);
+            break;
+        case 8:
+            message = "assignment to constant or procedure is not allowed";
+            break;
+        case 9:
+            message = "assignment statements must use :=";
+            break;
+        case 10:
+            message = "begin must be followed by end";
+            break;
+        case 11:
+            message = "if must be followed by then";
+            break;
+        case 12:
+            message = "while must be followed by do";
+            break;
+        case 13:
+            message = "condition must contain comparison operator";
+            break;
+        case 14:
+            message = "right parenthesis must follow left parenthesis";
+            break;
+        case 15:
+            message = "arithmetic equations must contain operands, parentheses, numbers or symbols";
+            break;
+        case 16:
+            message = "max number of instructions exceeded";
+            break;
+        case 17:
+            message = "identifier too long";
+            break;
+        case 18:
+            message = "number too long";
+            break;
+        case 19:
+            message = "invalid symbol";
+            break;
+        case 20:
+            message = "then must be followed by fi";
+            break;
+        case 21:
+            message = "call must be followed by an identifier";
+            break;
+        case 22:
+            message = "call of a constant or variable is meaningless";
+            break;
+        case 23:
+            message = "maximum number of nested functions exceeded";
+            break;
+        case 24:
+            message = "semicolon expected";
+            break;
+        case 25:
+            message = "expression must not contain a procedure identifier";   //make input file for this
+            break;
+        case 26:
+            message = "semicolon missing after procedure declaration";
+            break;
+        case 27:
+            message = "incorrect symbol after procedure declaration";
+            break;
+        case 28:
+            message = "too many distinct identifiers";
+            break;
+        case PL0_OUT_OF_MEMORY:
+            message = "out of memory";
+            break;
+        case PL0_SOURCE_TOO_LARGE:
+            message = "source larger than 2 GiB";
+            break;
+        case PL0_BAD_OBJECT:
+            snprintf(diagnostic->message, sizeof(diagnostic->message), "object %d is not a PL/0 object or is damaged",
+                     linkObject + 1);
+            break;
+        case PL0_UNDEFINED_PROCEDURE:
+            snprintf(diagnostic->message, sizeof(diagnostic->message), "undefined procedure %s in object %d",
+                     linkName, linkObject + 1);
+            break;
+        case PL0_DUPLICATE_PROCEDURE:
+            snprintf(diagnostic->message, sizeof(diagnostic->message), "procedure %s in object %d is already defined",
+                     linkName, linkObject + 1);
+            break;
+        case PL0_DISPLAY_OBJECT:
+            snprintf(diagnostic->message, sizeof(diagnostic->message),
+                     "object %d was compiled with --display, which --reg cannot translate", linkObject + 1);
+            break;
+    }
+    diagnostic->id = id;
+    if (id != 7 && id < PL0_BAD_OBJECT)
+        snprintf(diagnostic->message, sizeof(diagnostic->message), "%s", message);
+
+    //the scanner's errors are about the lexeme it is at, the parser's about the token it just read
+    offset = id == 17 || id == 18 || id == 19 || id == 28 ? lexemeOffset
+        : trackerToken > 0 ? (size_t)tokens[trackerToken - 1].offset : sourceLength;
+    if (id < PL0_OUT_OF_MEMORY && source != NULL && offset <= sourceLength) {
+        diagnostic->offset = offset;
+        diagnostic->line = 1;
+        diagnostic->column = 1;
+        for (size_t i = 0; i < offset; i++) {
+            if (source[i] == '\n') {
+                diagnostic->line++;
+                diagnostic->column = 1;
+            }
+            else
+                diagnostic->column++;
+        }
+    }
+    longjmp(errorJump, 1);
+}
+
+//scans just far enough to have the next token, past the last one the parser sees 0, which no rule accepts
+int getNextToken() {
+    while (trackerToken >= tokenCount) {
+        if (!scanNext())
+            return 0;
+    }
+    return tokens[trackerToken++].kind;
+}
+
+//the identifier of an identsym token getNextToken already returned
+//atom of the identsym getNextToken just returned
+int tokenAtom() {
+    return tokens[trackerToken - 1].value;
+}
+
+//value of the numbersym getNextToken just returned
+int tokenNumber() {
+    return tokens[trackerToken - 1].value;
+}
+
+/************************************************************
+*
+*   SYMBOL TABLE FUNCTIONS
+*
+************************************************************/
+
+//returns the atom for the name at name[0 .. length), a span of the source, adding it the first time it is seen
+int internIdentifier(const char* name, int length) {
+    unsigned hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    //keep the hash at most half full
+    if (2 * (atomCount + 1) > atomSlotCount) {
+        int slotCount = atomSlotCount > 0 ? atomSlotCount * 2 : 256;
+        int* slots = arenaAlloc(slotCount * sizeof(int));
+        memset(slots, 0, slotCount * sizeof(int));
+        for (int i = 0; i < atomSlotCount; i++) {
+            if (atomSlots[i] == 0)
+                continue;
+            int atom = atomSlots[i] - 1;
+            unsigned h = 2166136261u;
+            for (int k = 0; k < atomLength[atom]; k++)
+                h = (h ^ (unsigned char)source[atomOffset[atom] + k]) * 16777619u;
+            while (slots[h & (slotCount - 1)] != 0)
+                h++;
+            slots[h & (slotCount - 1)] = atomSlots[i];
+        }
+        atomSlots = slots;
+        atomSlotCount = slotCount;
+    }
+
+    for (unsigned h = hash;; h++) {
+        int* slot = &atomSlots[h & (atomSlotCount - 1)];
+        if (*slot == 0) {
+            if (atomCount == MAX_ATOMS)
+                error(28);
+            int** columns[] = {&atomOffset, &atomLength, &atomHead};
+            int capacity = atomCapacity;
+            for (int c = 0; c < 3; c++) {
+                capacity = atomCapacity;
+                *columns[c] = reserve(*columns[c], &capacity, atomCount + 1, sizeof(int));
+            }
+            atomCapacity = capacity;
+            atomOffset[atomCount] = name - source;
+            atomLength[atomCount] = length;
+            atomHead[atomCount] = -1;
+            *slot = ++atomCount;
+            return atomCount - 1;
+        }
+        int atom = *slot - 1;
+        if (atomLength[atom] == length && memcmp(source + atomOffset[atom], name, length) == 0)
+            return atom;
+    }
+}
+
+void addToSymbolTable(int kind, int atom, int val, int level, int address) {
+    if (tp + 1 > symbolCapacity) {
+        int** columns[] = {&symKind, &symVal, &symLevel, &symAddr, &symAtom, &symPrevSame};
+        int capacity = symbolCapacity;
+        for (int c = 0; c < (int)(sizeof(columns) / sizeof(columns[0])); c++) {
+            capacity = symbolCapacity;
+            *columns[c] = reserve(*columns[c], &capacity, tp + 1, sizeof(int));
+        }
+        symbolCapacity = capacity;
+    }
+    symKind[tp] = kind;
+    symVal[tp] = val;
+    symLevel[tp] = level;
+    symAddr[tp] = address;
+    symAtom[tp] = atom;
+    symPrevSame[tp] = atomHead[atom];
+    atomHead[atom] = tp++;
+    symbolInserts++;
+
+    if (symbolBench) {
+        symbolEvents = reserve(symbolEvents, &symbolEventCapacity, symbolEventCount + 1, sizeof(symbol_event_t));
+        symbolEvents[symbolEventCount++] = (symbol_event_t){SYMBOL_DECLARE, atom};
+    }
+}
+
+//innermost visible symbol named atom, -1 if there is none
+int symbolTableCheck(int atom) {
+    if (symbolBench) {
+        symbolEvents = reserve(symbolEvents, &symbolEventCapacity, symbolEventCount + 1, sizeof(symbol_event_t));
+        symbolEvents[symbolEventCount++] = (symbol_event_t){SYMBOL_LOOKUP, atom};
+    }
+    symbolLookups++;
+    if (incrementalCache != NULL && lev > 0)
+        noteName(source + atomOffset[atom], atomLength[atom], atom, atomHead[atom]);
+    return atomHead[atom];
+}
+
+//a block's symbols go out of scope together when it ends
+void pushScope() {
+    scopeMarks = reserve(scopeMarks, &scopeCapacity, scopeDepth + 1, sizeof(int));
+    scopeMarks[scopeDepth++] = tp;
+}
+
+void popScope() {
+    int mark = scopeMarks[--scopeDepth];
+    while (tp > mark) {
+        tp--;
+        atomHead[symAtom[tp]] = symPrevSame[tp];
+    }
+    if (symbolBench) {
+        symbolEvents = reserve(symbolEvents, &symbolEventCapacity, symbolEventCount + 1, sizeof(symbol_event_t));
+        symbolEvents[symbolEventCount++] = (symbol_event_t){SYMBOL_POP, mark};
+    }
+}
+
+//replays the parse's declarations, lookups and scope pops against the hashed table and
+//against the old backwards strcmp scan over a flat array of names
+void benchSymbols() {
+    char (*names)[12] = arenaAlloc((symbolCapacity + 1) * sizeof(names[0]));
+    char (*atomNames)[12] = arenaAlloc((atomCount + 1) * sizeof(atomNames[0]));
+    int* head = arenaAlloc((atomCount + 1) * sizeof(int));
+    int* prevSame = arenaAlloc((symbolCapacity + 1) * sizeof(int));
+    int* atoms = arenaAlloc((symbolCapacity + 1) * sizeof(int));
+    struct timespec begin, end;
+    long long lookups = 0;
+    long long check = 0; // keeps the lookups from being optimized away
+
+    int declared = 0;
+    //the old table kept NUL terminated copies of the names
+    for (int a = 0; a < atomCount; a++) {
+        memcpy(atomNames[a], source + atomOffset[a], atomLength[a]);
+        atomNames[a][atomLength[a]] = '\0';
+    }
+    for (int i = 0; i < symbolEventCount; i++) {
+        lookups += symbolEvents[i].op == SYMBOL_LOOKUP;
+        declared += symbolEvents[i].op == SYMBOL_DECLARE;
+    }
+    fprintf(listingFile, "%d symbols declared, %lld lookups, %d distinct names\n", declared, lookups, atomCount);
+
+    for (int k = 0; k < 2; k++) {
+        int rounds = 0;
+        double seconds = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        do {
+            int n = 0;
+            for (int a = 0; a < atomCount; a++)
+                head[a] = -1;
+            for (int i = 0; i < symbolEventCount; i++) {
+                int arg = symbolEvents[i].arg;
+                switch (symbolEvents[i].op) {
+                case SYMBOL_DECLARE:
+                    if (k == 0)
+                        strcpy(names[n], atomNames[arg]);
+                    atoms[n] = arg;
+                    prevSame[n] = head[arg];
+                    head[arg] = n++;
+                    break;
+                case SYMBOL_LOOKUP:
+                    if (k == 0) {
+                        int found = -1;
+                        for (int j = n - 1; j >= 0; j--) {
+                            if (strcmp(names[j], atomNames[arg]) == 0) {
+                                found = j;
+                                break;
+                            }
+                        }
+                        check += found;
+                    }
+                    else
+                        check += head[arg];
+                    break;
+                case SYMBOL_POP:
+                    while (n > arg) {
+                        n--;
+                        head[atoms[n]] = prevSame[n];
+                    }
+                    break;
+                }
+            }
+            rounds++;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        } while (seconds < 0.5);
+        fprintf(listingFile, "%-8s %10.4f s per parse  %8.1f ns per lookup\n", k == 0 ? "linear" : "hashed",
+               seconds / rounds, lookups > 0 ? seconds / rounds / lookups * 1e9 : 0);
+    }
+    if (check == 42)
+        fprintf(listingFile, "\n");
+}
+
+void program() {
+    token_p = getNextToken();
+    block();
+    if (token_p != periodsym)
+        error(1); //ERROR: program must end with period
+    emit(9, 0, 3); //halt program
+}
+
+void block() {
+    lev++;
+    pushScope();
+
+    if(lev > LEV_MAX) {
+        error(23);       //ERROR: maximum number of nested functions exceeded
+    }
+    if (lev > maxLevel)
+        maxLevel = lev;
+
+    int jmpAddr = cx;
+    emit(7, 0, 0);
+
+    constDeclaration();
+    int numvars = varDeclaration();
+    displayUsed[lev] = 0;
+    procDeclaration();
+
+    text[jmpAddr].M = cx * 3 + 10;
+
+    //a nested block reached this frame through the display: save the caller's entry in an extra
+    //word after the variables and point the display here for the duration of the call
+    int displaySlot = 0;
+    if (lev != 0 && displayUsed[lev])
+        displaySlot = numvars + 3;
+
+    emit(6, 0, numvars + 3 + (displaySlot != 0));
+    if (displaySlot)
+        emit(14, lev, displaySlot); //emit DEN
+
+    statement();
+
+    if(lev != 0) {
+        if (displaySlot)
+            emit(15, lev, displaySlot); //emit DRT
+        else
+            emit(2, 0, 0);
+    }
+
+    popScope();
+    lev--;
+}
+
+void constDeclaration() {
+    if (token_p == constsym) {
+        do {
+            token_p = getNextToken();
+
+            if (token_p != identsym)
+                error(2); //ERROR: const, var, read keywords must be followed by identifier
+
+            int name = tokenAtom(); //get name of next identifier
+
+            if (symbolTableCheck(name) != -1)
+                error(3); //ERROR: symbol name already declared
+
+            token_p = getNextToken();
+
+            if (token_p != eqsym)
+                error(4); //ERROR: constants must be assigned with =
+
+            token_p = getNextToken();
+
+            if (token_p != numbersym)
+                error(5); //ERROR: constant must be assigned an integer value
+
+            //get number value of const
+            int val = tokenNumber();
+
+            addToSymbolTable(1, name, val, 0, 0);
+
+            token_p = getNextToken();
+        }
+        while (token_p == commasym);
+
+        if (token_p != semicolonsym)
+            error(6);   //ERROR: constant and variable declarations must be followed by a semicolon
+
+        token_p = getNextToken();
+    }
+}
+
+int varDeclaration() {
+    //store amount of vars declared
+    int numvars = 0;
+
+    if (token_p == varsym) {
+        do {
+            numvars++;
+
+            token_p = getNextToken();
+
+            //must declare a valid identifier
+            if (token_p != identsym)
+                error(2);   //ERROR: const, var, and read keywords must be followed by identifier
+
+            int name = tokenAtom();
 
             //identifier cannot be declared twice in same scope
-            if (symbolTableCheck(name) != -1 && symbol_table[symbolTableCheck(name)].level == lev)
+            if (symbolTableCheck(name) != -1 && symLevel[symbolTableCheck(name)] == lev)
                 error(3);   //ERROR: symbol name has already been declared
 
-            addToSymbolTable(2, name, 0, lev, numvars + 2);
+            addToSymbolTable(2, name, 0, lev, numvars + 2);
+
+            token_p = getNextToken();
+        }
+        while (token_p == commasym);
+
+        //must end with semicolon
+        if (token_p != semicolonsym)
+            error(6);   //ERROR: constant and variable declarations must be followed by a semicolon
+
+        token_p = getNextToken();
+    }
+    return numvars;
+}
+
+void procDeclaration(){
+    while(token_p == procsym) {
+        token_p = getNextToken();
+
+        if (token_p != identsym) {
+            error(27);          //ERROR: incorrect symbol after procedure declaration
+        }
+        int name = tokenAtom();
+
+        if (symbolTableCheck(name) != -1)
+            error(3);   //ERROR: symbol name has already been declared
+
+        addToSymbolTable(3, name, 0, lev, cx * 3 + 10);
+        procTable = reserve(procTable, &procCapacity, procCount + 1, sizeof(symbol_t));
+        procTable[procCount].kind = 3;
+        memcpy(procTable[procCount].name, source + atomOffset[name], atomLength[name]);
+        procTable[procCount].name[atomLength[name]] = '\0';
+        procTable[procCount].val = 0;
+        procTable[procCount].level = lev;
+        procTable[procCount].addr = cx * 3 + 10;
+        procTable[procCount++].mark = 0;
+        if (incrementalCache != NULL)
+            declareProcPath(name);
+
+        token_p = getNextToken();
+
+        if(token_p != semicolonsym) {
+            error(26);          //ERROR: semicolon missing after procedure declaration
+        }
+
+        token_p = getNextToken();
+
+        //with --incremental an unchanged block is copied from the last compile
+        int reused = incrementalCache != NULL && reuseProcedure();
+        if (!reused && incrementalCache != NULL)
+            openProcRecord();
+        if (!reused)
+            block();
+
+        if(token_p != semicolonsym) {
+            error(24);          //ERROR: semicolon or comma missing
+        }
+        if (!reused && incrementalCache != NULL)
+            closeProcRecord();
+
+        token_p = getNextToken();
+    }
+}
+
+void statement() {
+    if (token_p == identsym) {
+        //get name of the next identifier & check if it exists in sym table
+        int name = tokenAtom();
+        int symIdx = symbolTableCheck(name);
+
+        if (symIdx == -1)
+            error(7); //ERROR: undeclared identifier
+
+        //if token is not a var
+        if (symKind[symIdx] != 2)
+            error(8);   //ERROR: assignment to constant or procedure is not allowed
+
+        token_p = getNextToken();
+
+        if (token_p != becomessym)
+            error(9);   //ERROR: assignment statements must use :=
+
+        token_p = getNextToken();
+
+        expression();
+        emitAccess(4, symIdx); //emit STO
+        return;
+    }
+    if(token_p == callsym){
+        token_p = getNextToken();
+
+        if(token_p != identsym)
+            error(21); //ERROR: call must be followed by an identifier
+
+        int name = tokenAtom();
+        int symIdx = symbolTableCheck(name);
+
+        if (symIdx == -1 && objectOutput)
+            emitImportCall(name);
+        else if(symIdx == -1)
+            error(7); //ERROR: undeclared identifier
+        else if(symKind[symIdx] == 3)  {
+            emitAccess(5, symIdx); //emit CAL
+        }
+        else{
+            error(22);    //ERROR: call of a constant or variable is meaningless
+        }
+
+        token_p = getNextToken();
+
+        return;
+    }
+    if (token_p == beginsym) {
+        do {
+            token_p = getNextToken();
+            statement();
+        }while (token_p == semicolonsym);
+
+        if (token_p != endsym)
+            error(10); //ERROR: "begin" must be followed by "end"
+
+        token_p = getNextToken();
+        return;
+    }
+    if (token_p == ifsym) {
+
+        token_p = getNextToken();
+
+        int condIdx = cx;
+        int jpcIdx = -1;
+        int alive = 1;
+
+        //a constant condition needs no test, and a false one no body either
+        if (condition()) {
+            alive = text[condIdx].M != 0;
+            cx = condIdx;
+        }
+        else {
+            jpcIdx = cx; //set jpcIdx to current code index
+
+            emit(8, 0, 0); //emit JPC
+        }
+
+        if (token_p != thensym)
+            error(11); //ERROR: "if" must be followed by "then"
+
+        token_p = getNextToken();
+
+        statement();
+        if (!alive)
+            cx = condIdx;
+        else if (jpcIdx != -1)
+            text[jpcIdx].M = cx * 3 + 10;
+
+        if(token_p != fisym)
+            error(20);  //ERROR: fi must follow then
+
+        token_p = getNextToken();
+
+        return;
+    }
+    if (token_p == whilesym) {
+        token_p = getNextToken();
+
+        int loopIdx = cx;
+        int jpcIdx = -1;
+        int alive = 1;
+
+        int constant = condition();
+
+        if (token_p != dosym)
+            error(12);  //ERROR: "while" must be followed by "do"
+
+        token_p = getNextToken();
+
+        //a constant true condition loops without a test, a false one drops the loop
+        if (constant) {
+            alive = text[loopIdx].M != 0;
+            cx = loopIdx;
+        }
+        else {
+            jpcIdx = cx;
+            emit(8, 0, 0);  //emit JPC
+        }
+
+        statement();
+
+        if (!alive) {
+            cx = loopIdx;
+            return;
+        }
+
+        emit(7, 0, loopIdx * 3 + 10);    //emit JMP
+
+        if (jpcIdx != -1)
+            text[jpcIdx].M = cx * 3 + 10;
+        return;
+    }
+    if (token_p == readsym) {
+        token_p = getNextToken();
+
+        if (token_p != identsym)
+            error(2); //ERROR: const, var, and read keywords must be followed by identifier
+
+        int name = tokenAtom();
+
+        int symIdx = symbolTableCheck(name);
+
+        if (symIdx == -1)
+            error(7); //ERROR: undeclared identifier
+
+        if (symKind[symIdx] != 2)
+            error(8); //ERROR: only variable values may be altered
+
+        token_p = getNextToken();
+        emit(9, 0, 2); //emit READ
+        emitAccess(4, symIdx); //emit STO
+        return;
+    }
+    if (token_p == writesym) {
+        token_p = getNextToken();
+        expression();
+        emit(9, 0, 1); //emit WRITE
+        return;
+    }
+}
+
+//returns 1 if the condition is a compile time constant, left as a single LIT
+int condition() {
+    int constant;
+    int right;
+
+    if (token_p == oddsym) {
+        token_p = getNextToken();
+        constant = expression();
+        constant = emitOpr(11, constant); //emit ODD
+    }
+    else {
+        constant = expression();
+        if (token_p == eqsym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(5, constant && right); //emit EQL
+        }
+        else if (token_p == neqsym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(6, constant && right); //emit NEQ
+        }
+        else if (token_p == lessym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(7, constant && right); //emit LSS
+        }
+        else if (token_p == leqsym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(8, constant && right); //emit LEQ
+        }
+        else if (token_p == gtrsym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(9, constant && right); //emit GTR
+        }
+        else if (token_p == geqsym) {
+            token_p = getNextToken();
+            right = expression();
+            constant = emitOpr(10, constant && right); //emit GEQ
+        }
+        else
+            error(13); //ERROR: condition must contain comparison operator
+    }
+    return constant;
+}
+
+//returns 1 if the expression is a compile time constant, left as a single LIT
+int expression() {
+    if (++exprDepth > maxExprDepth)
+        maxExprDepth = exprDepth;
+    int constant = term();
+    int right;
+
+    //stay in loop while we do addition or subtraction
+    while (token_p == plussym || token_p == minussym) {
+        if (token_p == plussym) {
+            token_p = getNextToken();
+
+            right = term();
+            constant = emitOpr(1, constant && right); //ADD
+        }
+        else {
+            token_p = getNextToken();
+
+            right = term();
+            constant = emitOpr(2, constant && right); //SUB
+        }
+    }
+    exprDepth--;
+    return constant;
+}
+
+//returns 1 if the term is a compile time constant, left as a single LIT
+int term() {
+    int constant = factor();
+    int right;
+
+    //stay in loop while we do division or multiplication
+    while (token_p == multsym || token_p == slashsym) {
+        if (token_p == multsym) {
+            token_p = getNextToken();
+
+            right = factor();
+            constant = emitOpr(3, constant && right);  //emit MUL
+        }
+        else if (token_p == slashsym) {
+            token_p = getNextToken();
+
+            right = factor();
+            constant = emitOpr(4, constant && right);  //emit DIV
+        }
+    }
+    return constant;
+}
+
+//emits OPR M, or folds it into the LITs of its operands when they are all constants
+//returns 1 if the result is a constant
+int emitOpr(int M, int constant) {
+    int result;
+
+    if (!foldConstants || !constant) {
+        emit(2, 0, M);
+        return 0;
+    }
+    if (M == 11) {
+        evalOpr(M, text[cx - 1].M, 0, &text[cx - 1].M);
+        return 1;
+    }
+    if (!evalOpr(M, text[cx - 2].M, text[cx - 1].M, &result)) {
+        emit(2, 0, M);
+        return 0;
+    }
+    cx--;
+    text[cx - 1].M = result;
+    return 1;
+}
+
+//value of OPR M on a and b (b is ignored by ODD), returns 0 if it has to stay in the code
+//arithmetic wraps like the VM's, division by zero and INT_MIN / -1 are left to trap at run time
+int evalOpr(int M, int a, int b, int* result) {
+    switch (M) {
+    case 1:
+        *result = (int)((unsigned)a + (unsigned)b);
+        break;
+    case 2:
+        *result = (int)((unsigned)a - (unsigned)b);
+        break;
+    case 3:
+        *result = (int)((unsigned)a * (unsigned)b);
+        break;
+    case 4:
+        if (b == 0 || (a == INT_MIN && b == -1))
+            return 0;
+        *result = a / b;
+        break;
+    case 5:
+        *result = a == b;
+        break;
+    case 6:
+        *result = a != b;
+        break;
+    case 7:
+        *result = a < b;
+        break;
+    case 8:
+        *result = a <= b;
+        break;
+    case 9:
+        *result = a > b;
+        break;
+    case 10:
+        *result = a >= b;
+        break;
+    case 11:
+        *result = a % 2 != 0;
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+//returns 1 if the factor is a compile time constant, left as a single LIT
+int factor() {
+    int constant = 0;
+
+    if (token_p == identsym) {
+        int name = tokenAtom();
+        int symIdx = symbolTableCheck(name);
+
+        //identifier hasnt been declared
+        if (symIdx == -1)
+            error(7);   //ERROR: undeclared identifier
+
+        //either constant or variable, NO procedures
+        if (symKind[symIdx] == 1) {                   //ERROR IF IT IS PROCEDURE
+            emit(1, 0, symVal[symIdx]);   //emit LIT
+            constant = 1;
+        }
+        else if(symKind[symIdx] == 3)
+            error(25);  //ERROR: expression must not contain a procedure identifier
+        else
+            emitAccess(3, symIdx);  //emit LOD
+
+        token_p = getNextToken();
+    }
+    else if (token_p == numbersym) {
+        emit(1, 0, tokenNumber());    //emit LIT
+        constant = 1;
+        token_p = getNextToken();
+    }
+    else if (token_p == lparentsym) {
+        token_p = getNextToken();
+        constant = expression();
+        if (token_p != rparentsym)
+            error(14);  //ERROR: right parenthesis must follow left parenthesis
+        token_p = getNextToken();
+    }
+    else
+        error(15);  //ERROR: arithmetic equations must contain operands, parentheses, numbers or symbols
+    return constant;
+}
+
+void printSymbolTable() {
+    fprintf(listingFile, "\nKind | Name        | Value | Level | Address | Mark\n"
+        "---------------------------------------------------\n");
+    for (int i = 0; i < tp; i++) {
+        fprintf(listingFile, "%4d |%12.*s |%6d |%6d |%8d |%4d\n", symKind[i], atomLength[symAtom[i]], source + atomOffset[symAtom[i]],
+               symVal[i], symLevel[i], symAddr[i], 0);
+    }
+}
+
+//writes the image (or text or assembly) into the result, then prints the instruction listing
+void produceElfAndOut(pl0_result_t* result) {
+    FILE* file = open_memstream(&result->output, &result->outputSize);
+    if (file == NULL)
+        error(PL0_OUT_OF_MEMORY);
+    if (objectOutput)
+        writeObject(file);
+    else if (nativeAsm)
+        writeAssembly(file);
+    else if (textElf)
+        writeTextElf(file);
+    else
+        writeImage(file);
+    outputBytes = ftell(file);
+    fclose(file);
+
+    if (!listing)
+        return;
+    if (regIsa) {
+        printRegListing();
+        return;
+    }
+    for (int i = 0; i < cx; i++) {
+        int op = text[i].op;
+        switch (op) {
+        case 1:
+            fprintf(listingFile, "%s", "LIT");
+            break;
+        case 2:
+            switch (text[i].M) {
+            case 0:
+                fprintf(listingFile, "%s", "RTN");
+                break;
+            case 1:
+                fprintf(listingFile, "%s", "ADD");
+                break;
+            case 2:
+                fprintf(listingFile, "%s", "SUB");
+                break;
+            case 3:
+                fprintf(listingFile, "%s", "MUL");
+                break;
+            case 4:
+                fprintf(listingFile, "%s", "DIV");
+                break;
+            case 5:
+                fprintf(listingFile, "%s", "EQL");
+                break;
+            case 6:
+                fprintf(listingFile, "%s", "NEQ");
+                break;
+            case 7:
+                fprintf(listingFile, "%s", "LSS");
+                break;
+            case 8:
+                fprintf(listingFile, "%s", "LEQ");
+                break;
+            case 9:
+                fprintf(listingFile, "%s", "GTR");
+                break;
+            case 10:
+                fprintf(listingFile, "%s", "GEQ");
+                break;
+            case 11:
+                fprintf(listingFile, "%s", "ODD");
+            }
+            break;
+        case 3:
+            fprintf(listingFile, "%s", "LOD");
+            break;
+        case 4:
+            fprintf(listingFile, "%s", "STO");
+            break;
+        case 5:
+            fprintf(listingFile, "%s", "CAL");
+            break;
+        case 6:
+            fprintf(listingFile, "%s", "INC");
+            break;
+        case 7:
+            fprintf(listingFile, "%s", "JMP");
+            break;
+        case 8:
+            fprintf(listingFile, "%s", "JPC");
+            break;
+        case 9:
+            fprintf(listingFile, "SYS");
+            break;
+        case 10:
+            fprintf(listingFile, "%s", "STK");
+            break;
+        case 11:
+            fprintf(listingFile, "%s", "LDX");
+            break;
+        case 12:
+            fprintf(listingFile, "%s", "STX");
+            break;
+        case 13:
+            fprintf(listingFile, "%s", "CLX");
+            break;
+        case 14:
+            fprintf(listingFile, "%s", "DEN");
+            break;
+        case 15:
+            fprintf(listingFile, "%s", "DRT");
+            break;
+        }
+        fprintf(listingFile, " %d %d\n", text[i].L, text[i].M);
+    }
+}
+
+//one "op L M" line per instruction, register code starts with a "reg" line and has four columns
+void writeTextElf(FILE* file) {
+    if (regIsa) {
+        fprintf(file, "reg\n");
+        for (int i = 0; i < rx; i++)
+            fprintf(file, "%d %d %d %d\n", regText[i].op, regText[i].a, regText[i].b, regText[i].c);
+        return;
+    }
+    for (int i = 0; i < cx; i++) {
+        fprintf(file, "%d %d %d\n", text[i].op, text[i].L, text[i].M);
+    }
+}
+
+//binary image: header, section table, code, procedure symbols (see pl0image.h)
+void writeImage(FILE* file) {
+    image_header_t header;
+    image_section_t sections[2];
+    image_symbol_t sym;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, 4);
+    header.version = IMAGE_VERSION;
+    header.sectionCount = 2;
+    header.entry = regIsa ? 0 : IMAGE_TEXT_BASE;
+    header.codeLength = regIsa ? rx : cx;
+    header.maxStack = maxFrameDepth();
+    header.flags = regIsa ? IMAGE_FLAG_REGISTER : 0;
+
+    sections[0].kind = SECTION_CODE;
+    sections[0].offset = sizeof(header) + sizeof(sections);
+    sections[0].size = regIsa ? rx * 4 * sizeof(int32_t) : cx * 3 * sizeof(int32_t);
+    sections[1].kind = SECTION_SYMBOLS;
+    sections[1].offset = sections[0].offset + sections[0].size;
+    sections[1].size = procCount * sizeof(image_symbol_t);
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(sections, sizeof(sections), 1, file);
+    for (int i = 0; regIsa && i < rx; i++) {
+        int32_t words[4] = {regText[i].op, regText[i].a, regText[i].b, regText[i].c};
+        fwrite(words, sizeof(words), 1, file);
+    }
+    for (int i = 0; !regIsa && i < cx; i++) {
+        int32_t words[3] = {text[i].op, text[i].L, text[i].M};
+        fwrite(words, sizeof(words), 1, file);
+    }
+    for (int i = 0; i < procCount; i++) {
+        memset(&sym, 0, sizeof(sym));
+        sym.addr = regIsa ? regMap[(procTable[i].addr - 10) / 3] : procTable[i].addr;
+        sym.level = procTable[i].level;
+        strcpy(sym.name, procTable[i].name);
+        fwrite(&sym, sizeof(sym), 1, file);
+    }
+}
+
+//deepest single activation record: the INC'd locals plus the operand stack on top of them
+//every block's statement code runs from its INC to its RTN (or the halt) without interleaving
+int maxFrameDepth() {
+    int depth = 0;
+    int max = 0;
+
+    //register frames already include their temps
+    if (regIsa) {
+        for (int i = 0; i < rx; i++)
+            if (regText[i].op == RINC && regText[i].a > max)
+                max = regText[i].a;
+        return max;
+    }
+    for (int i = 0; i < cx; i++) {
+        switch (text[i].op) {
+        case 1: //LIT
+        case 3: //LOD
+        case 11: //LDX
+            depth++;
+            break;
+        case 2: //OPR, ODD works in place and RTN ends the frame
+            if (text[i].M == 0)
+                depth = 0;
+            else if (text[i].M != 11)
+                depth--;
+            break;
+        case 15: //DRT
+            depth = 0;
+            break;
+        case 4: //STO
+        case 8: //JPC
+        case 12: //STX
+            depth--;
+            break;
+        case 6: //INC
+            depth = text[i].M;
+            break;
+        case 9: //SYS write pops, read pushes
+            if (text[i].M == 1)
+                depth--;
+            else if (text[i].M == 2)
+                depth++;
+            break;
+        }
+        if (depth > max)
+            max = depth;
+    }
+    return max;
+}
+
+/************************************************************
+*
+*   PEEPHOLE FUNCTIONS
+*
+************************************************************/
+
+//runs the rules that fit in the window until nothing changes, then squeezes out deleted instructions
+//a rule never looks past the first instruction of its pattern if a jump lands in the middle of it
+void peephole() {
+    char* leader = arenaAlloc(cx + 1);
+    int changed = 1;
+
+    while (changed) {
+        changed = 0;
+        markLeaders(leader);
+        for (int i = 0; i < cx; i++) {
+            for (int r = 0; r < PEEPHOLE_RULES; r++) {
+                peephole_rule_t* rule = &peepholeRules[r];
+                int inside = 0;
+
+                if (rule->length > peepholeWindow || i + rule->length > cx || text[i].op == 0)
+                    continue;
+                for (int k = 1; k < rule->length; k++)
+                    if (leader[i + k] || text[i + k].op == 0)
+                        inside = 1;
+                if (inside)
+                    continue;
+
+                int before = 0;
+                for (int k = 0; k < rule->length; k++)
+                    before += text[i + k].op != 0;
+                if (rule->apply(i)) {
+                    int after = 0;
+                    for (int k = 0; k < rule->length; k++)
+                        after += text[i + k].op != 0;
+                    rule->applied++;
+                    rule->removed += before - after;
+                    changed = 1;
+                }
+            }
+        }
+        compactText();
+    }
+}
+
+//marks every instruction a JMP, JPC, CAL or CLX can land on
+void markLeaders(char leader[]) {
+    memset(leader, 0, cx + 1);
+    for (int i = 0; i < cx; i++)
+        if (isBranch(text[i].op))
+            leader[(text[i].M - 10) / 3] = 1;
+}
+
+//removes instructions with op 0 and re-patches every absolute jump and call target
+//a target that was deleted moves to the next instruction that survived
+void compactText() {
+    int* newIndex;
+    int n = 0;
+
+    compactIndex = reserve(compactIndex, &compactIndexCapacity, cx + 1, sizeof(int));
+    newIndex = compactIndex;
+
+    for (int i = 0; i < cx; i++) {
+        newIndex[i] = n;
+        if (text[i].op != 0)
+            n++;
+    }
+    newIndex[cx] = n;
+    if (n == cx)
+        return;
+
+    for (int i = 0; i < cx; i++) {
+        if (text[i].op == 0)
+            continue;
+        if (isBranch(text[i].op))
+            text[i].M = newIndex[(text[i].M - 10) / 3] * 3 + 10;
+        text[newIndex[i]] = text[i];
+    }
+    for (int i = 0; i < procCount; i++)
+        procTable[i].addr = newIndex[(procTable[i].addr - 10) / 3] * 3 + 10;
+    cx = n;
+}
+
+//final destination of a jump to target, through any chain of JMPs
+int followJumps(int target) {
+    int steps = 0;
+    while (steps++ < cx) {
+        int i = (target - 10) / 3;
+        if (i >= cx || text[i].op != 7 || text[i].M == target)
+            break;
+        target = text[i].M;
+    }
+    return target;
+}
+
+//STO L M followed by LOD L M: store without popping
+int ruleStoreLoad(int i) {
+    if (text[i].op != 4 || text[i + 1].op != 3 || text[i].L != text[i + 1].L || text[i].M != text[i + 1].M)
+        return 0;
+    text[i].op = 10;
+    text[i + 1].op = 0;
+    return 1;
+}
+
+//JMP to the instruction right after it, block() emits one for every block without procedures
+int ruleJumpNext(int i) {
+    if (text[i].op != 7 || text[i].M != (i + 1) * 3 + 10)
+        return 0;
+    text[i].op = 0;
+    return 1;
+}
+
+//JMP, JPC, CAL or CLX whose target is a JMP
+int ruleJumpChain(int i) {
+    if (!isBranch(text[i].op))
+        return 0;
+    int target = followJumps(text[i].M);
+    if (target == text[i].M)
+        return 0;
+    text[i].M = target;
+    return 1;
+}
+
+//x + 0, x - 0, x * 1 and x / 1
+int ruleArithIdentity(int i) {
+    if (text[i].op != 1 || text[i + 1].op != 2)
+        return 0;
+    if (!(text[i].M == 0 && (text[i + 1].M == 1 || text[i + 1].M == 2))
+        && !(text[i].M == 1 && (text[i + 1].M == 3 || text[i + 1].M == 4)))
+        return 0;
+    text[i].op = 0;
+    text[i + 1].op = 0;
+    return 1;
+}
+
+//"x <> 0" is zero exactly when x is, so the JPC can test x directly
+int ruleNeqZeroBranch(int i) {
+    if (text[i].op != 1 || text[i].M != 0 || text[i + 1].op != 2 || text[i + 1].M != 6 || text[i + 2].op != 8)
+        return 0;
+    text[i].op = 0;
+    text[i + 1].op = 0;
+    return 1;
+}
+
+void printPeepholeStats() {
+    int total = 0;
+    fprintf(listingFile, "\nPeephole statistics (window %d):\n", peepholeWindow);
+    for (int r = 0; r < PEEPHOLE_RULES; r++) {
+        fprintf(listingFile, "%-16s applied %6d  removed %6d\n", peepholeRules[r].name, peepholeRules[r].applied,
+               peepholeRules[r].removed);
+        total += peepholeRules[r].removed;
+    }
+    fprintf(listingFile, "%-16s                 removed %6d\n", "total", total);
+}
+
+/************************************************************
+*
+*   DEAD CODE FUNCTIONS
+*
+************************************************************/
+
+//whole program pass: threads every branch to the end of its JMP chain, starts each procedure at
+//its first real instruction and deletes what no path from the entry reaches; that takes the
+//leading JMP of every block and every procedure no reachable CAL or CLX names
+void eliminateDeadCode() {
+    char* reached = arenaAlloc(cx + 1);
+    int* work = arenaAlloc((cx + 1) * sizeof(int));
+    int count = 0;
+    int kept = 0;
+
+    deadCodeBefore = cx;
+    for (int i = 0; i < cx; i++) {
+        if (!isBranch(text[i].op))
+            continue;
+        int target = followJumps(text[i].M);
+        if (target != text[i].M) {
+            text[i].M = target;
+            threadedJumps++;
+        }
+    }
+    for (int i = 0; i < procCount; i++)
+        procTable[i].addr = followJumps(procTable[i].addr);
+
+    //the image starts at text[0], calls come back to the instruction after them
+    memset(reached, 0, cx + 1);
+    reached[0] = 1;
+    work[count++] = 0;
+    while (count > 0) {
+        int i = work[--count];
+        int op = text[i].op;
+        int next[2];
+        int n = 0;
+
+        //JMP, RTN, DRT and halt never fall through
+        if (op != 7 && op != 15 && !(op == 2 && text[i].M == 0) && !(op == 9 && text[i].M == 3))
+            next[n++] = i + 1;
+        if (isBranch(op))
+            next[n++] = (text[i].M - 10) / 3;
+        for (int k = 0; k < n; k++) {
+            if (next[k] >= 0 && next[k] < cx && !reached[next[k]]) {
+                reached[next[k]] = 1;
+                work[count++] = next[k];
+            }
+        }
+    }
+
+    //a procedure nothing calls leaves the image symbols too
+    for (int i = 0; i < procCount; i++) {
+        int entry = (procTable[i].addr - 10) / 3;
+        if (entry >= 0 && entry < cx && reached[entry])
+            procTable[kept++] = procTable[i];
+        else
+            deadProcedures++;
+    }
+    procCount = kept;
+    for (int i = 0; i < cx; i++)
+        if (!reached[i])
+            text[i].op = 0;
+    compactText();
+    deadInstructions = deadCodeBefore - cx;
+}
+
+void printDeadCodeReport() {
+    fprintf(listingFile, "\nDead code elimination:\n");
+    fprintf(listingFile, "jumps threaded       %6d\n", threadedJumps);
+    fprintf(listingFile, "procedures removed   %6d\n", deadProcedures);
+    fprintf(listingFile, "instructions removed %6d of %d\n", deadInstructions, deadCodeBefore);
+    fprintf(listingFile, "bytes saved          %6ld\n", (long)deadInstructions * 3 * (long)sizeof(int32_t));
+}
+
+/************************************************************
+*
+*   PASS FUNCTIONS
+*
+************************************************************/
+
+//runs the optimization passes the options ask for, in the order of optPasses, timing each
+void runPasses() {
+    optPasses[PASS_IR].enabled = optLevel >= 2;
+    optPasses[PASS_VALUE_NUMBERING].enabled = optLevel >= 2;
+    optPasses[PASS_LOOPS].enabled = optLevel >= 2;
+    optPasses[PASS_LOWER].enabled = optLevel >= 2;
+    optPasses[PASS_DEAD_CODE].enabled = deadCode;
+    optPasses[PASS_PEEPHOLE].enabled = peepholeWindow > 0;
+    optPasses[PASS_REGISTERS].enabled = regIsa;
+
+    for (int p = 0; p < OPT_PASSES; p++) {
+        opt_pass_t* pass = &optPasses[p];
+        if (!pass->enabled)
+            continue;
+        double wall = clockSeconds(CLOCK_MONOTONIC);
+        double cpu = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+        pass->before = cx;
+        pass->run();
+        pass->after = p == PASS_REGISTERS ? rx : cx;
+        pass->wall += clockSeconds(CLOCK_MONOTONIC) - wall;
+        pass->cpu += clockSeconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+        pass->ran = 1;
+    }
+}
+
+double clockSeconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/************************************************************
+*
+*   IR FUNCTIONS
+*
+************************************************************/
+
+//-O2 pass: lifts text[] into basic blocks of IR nodes for the passes up to "lower"
+//code the IR does not model (a value left on the stack across a block or a statement) is left alone
+void liftIr() {
+    irBuilt = buildIr();
+    if (irBuilt)
+        irAssignProcs();
+}
+
+//-O2 pass: numbers the values along each extended basic block; a value computed again on the
+//same path is loaded from a frame temp the first computation left it in, loads of a slot since
+//stored or a constant become the value, and operations on constants are folded
+void valueNumbering() {
+    if (!irBuilt)
+        return;
+
+    //the value table is undone to the parent block's state before each block, so it only
+    //ever holds values of the blocks that dominate the one being numbered
+    int* stack = arenaAlloc((irBlockCount + 1) * sizeof(int));
+    int* marks = arenaAlloc((irBlockCount + 1) * sizeof(int));
+    int* childStart = arenaAlloc((irBlockCount + 2) * sizeof(int));
+    int* children = arenaAlloc((irBlockCount + 1) * sizeof(int));
+    int slots = 16;
+    int top = 0;
+
+    memset(childStart, 0, (irBlockCount + 2) * sizeof(int));
+    for (int b = 0; b < irBlockCount; b++)
+        if (irBlocks[b].preds == 1)
+            childStart[irBlocks[b].pred + 1]++;
+    for (int b = 0; b < irBlockCount; b++)
+        childStart[b + 1] += childStart[b];
+    for (int b = 0; b < irBlockCount; b++)
+        marks[b] = childStart[b];
+    for (int b = 0; b < irBlockCount; b++)
+        if (irBlocks[b].preds == 1)
+            children[marks[irBlocks[b].pred]++] = b;
+
+    while (slots < 2 * irNodeCount)
+        slots *= 2;
+    irBuckets = arenaAlloc(slots * sizeof(int));
+    memset(irBuckets, -1, slots * sizeof(int));
+    irBucketMask = slots - 1;
+    int maxM = 0;
+    for (int n = 0; n < irNodeCount; n++)
+        if ((irNodes[n].kind == IR_LOAD || irNodes[n].kind == IR_STORE) && irNodes[n].M > maxM)
+            maxM = irNodes[n].M;
+    irVersion = arenaAlloc(2 * (maxM + 1) * sizeof(int));
+    memset(irVersion, 0, 2 * (maxM + 1) * sizeof(int));
+
+    //blocks with one predecessor hang off it, every other block starts with an empty table, and
+    //so does a loop of single predecessor blocks nothing else reaches
+    for (int root = 0; root < 2 * irBlockCount; root++) {
+        int b = root % irBlockCount;
+        if (irBlocks[b].numbered || (root < irBlockCount && irBlocks[b].preds == 1))
+            continue;
+        irUndo(0);
+        stack[top] = b;
+        marks[top++] = 0;
+        while (top > 0) {
+            int b = stack[--top];
+            irUndo(marks[top]);
+            numberBlock(b);
+            for (int c = childStart[b]; c < childStart[b + 1]; c++) {
+                if (irBlocks[children[c]].numbered)
+                    continue;
+                stack[top] = children[c];
+                marks[top++] = irUndoCount;
+            }
+        }
+    }
+
+    //a reused value gets a slot past the end of its procedure's frame
+    for (int n = 0; n < irNodeCount; n++) {
+        if (irNodes[n].temp == 0)
+            continue;
+        int proc = irBlocks[irNodes[n].block].proc;
+        irNodes[n].temp = text[irFrameInc[proc]].M + irFrameTemps[proc]++;
+    }
+}
+
+//splits text[] into blocks and each block into nodes, a statement's expression becoming a tree
+//under the node that consumes it; returns 0 if the stack code does not have that shape
+int buildIr() {
+    char* leader = arenaAlloc(cx + 1);
+    int* stack = arenaAlloc((cx + 1) * sizeof(int));
+    int depth = 0;
+
+    for (int i = 0; i < cx; i++) {
+        if (isBranch(text[i].op) && (text[i].M < 10 || (text[i].M - 10) % 3 != 0 || (text[i].M - 10) / 3 >= cx))
+            return 0;
+    }
+    for (int i = 0; i < procCount; i++) {
+        if (procTable[i].addr < 10 || (procTable[i].addr - 10) % 3 != 0 || (procTable[i].addr - 10) / 3 >= cx)
+            return 0;
+    }
+    markLeaders(leader);
+    leader[0] = 1;
+    for (int i = 0; i < procCount; i++)
+        leader[(procTable[i].addr - 10) / 3] = 1;
+    for (int i = 0; i < cx; i++) {
+        int op = text[i].op;
+        if (op == 7 || op == 8 || op == 15 || (op == 2 && text[i].M == 0) || (op == 9 && text[i].M == 3))
+            leader[i + 1] = 1;
+    }
+
+    //one node per instruction at most, growing the table on the way would copy it over and over
+    irBlockOf = arenaAlloc((cx + 1) * sizeof(int));
+    irNodes = reserve(irNodes, &irNodeCapacity, cx + 1, sizeof(ir_node_t));
+    irNodeCount = irBlockCount = 0;
+    for (int i = 0; i < cx; i++) {
+        int op = text[i].op;
+        int M = text[i].M;
+
+        if (leader[i]) {
+            if (depth != 0)
+                return 0;
+            irBlocks = reserve(irBlocks, &irBlockCapacity, irBlockCount + 1, sizeof(ir_block_t));
+            memset(&irBlocks[irBlockCount], 0, sizeof(ir_block_t));
+            irBlocks[irBlockCount].start = i;
+            irBlocks[irBlockCount].firstNode = irNodeCount;
+            irBlocks[irBlockCount++].proc = -1;
+        }
+        irBlockOf[i] = irBlockCount - 1;
+
+        //a node that ends a statement takes exactly the values on the stack
+        switch (op) {
+        case 1: //LIT
+            stack[depth++] = irNode(IR_CONST, i, -1, -1);
+            break;
+        case 2: //OPR
+            if (M == 0) {
+                if (depth != 0)
+                    return 0;
+                irNode(IR_OTHER, i, -1, -1);
+            }
+            else if (M == 11 && depth >= 1)
+                stack[depth - 1] = irNode(IR_BINARY, i, stack[depth - 1], -1);
+            else if (M >= 1 && M <= 10 && depth >= 2) {
+                depth--;
+                stack[depth - 1] = irNode(IR_BINARY, i, stack[depth - 1], stack[depth]);
+            }
+            else
+                return 0;
+            break;
+        case 3: //LOD
+        case 11: //LDX
+            stack[depth++] = irNode(IR_LOAD, i, -1, -1);
+            break;
+        case 4: //STO
+        case 12: //STX
+        case 8: //JPC
+            if (depth != 1)
+                return 0;
+            irNode(op == 8 ? IR_BRANCH : IR_STORE, i, stack[--depth], -1);
+            break;
+        case 9: //SYS
+            if (M == 2)
+                stack[depth++] = irNode(IR_READ, i, -1, -1);
+            else if (M == 1 && depth == 1)
+                irNode(IR_WRITE, i, stack[--depth], -1);
+            else if (M == 3 && depth == 0)
+                irNode(IR_OTHER, i, -1, -1);
+            else
+                return 0;
+            break;
+        case 5: //CAL
+        case 13: //CLX
+        case 7: //JMP
+        case 6: //INC
+        case 14: //DEN
+        case 15: //DRT
+            if (depth != 0)
+                return 0;
+            irNode(op == 7 ? IR_JUMP : op == 5 || op == 13 ? IR_CALL : IR_OTHER, i, -1, -1);
+            break;
+        default: //STK and anything else only the peephole pass makes
+            return 0;
+        }
+        irBlocks[irBlockCount - 1].nodeCount = irNodeCount - irBlocks[irBlockCount - 1].firstNode;
+    }
+    if (depth != 0)
+        return 0;
+
+    //control flow edges, a call target has callers the edges do not show
+    for (int b = 0; b < irBlockCount; b++) {
+        int succ[2];
+        int n = irSuccessors(b, succ);
+        for (int k = 0; k < n; k++) {
+            irBlocks[succ[k]].preds++;
+            irBlocks[succ[k]].pred = b;
+        }
+    }
+    irBlocks[0].preds += 2;
+    for (int i = 0; i < cx; i++)
+        if (text[i].op == 5 || text[i].op == 13)
+            irBlocks[irBlockOf[(text[i].M - 10) / 3]].preds += 2;
+    for (int i = 0; i < procCount; i++)
+        irBlocks[irBlockOf[(procTable[i].addr - 10) / 3]].preds += 2;
+    return 1;
+}
+
+//adds a node for text[i]
+int irNode(int kind, int i, int a, int b) {
+    irNodes = reserve(irNodes, &irNodeCapacity, irNodeCount + 1, sizeof(ir_node_t));
+    ir_node_t* node = &irNodes[irNodeCount];
+    memset(node, 0, sizeof(ir_node_t));
+    node->kind = kind;
+    node->op = text[i].op;
+    node->L = text[i].L;
+    node->M = text[i].M;
+    node->a = a;
+    node->b = b;
+    node->block = irBlockCount - 1;
+    node->vn = irNodeCount;
+    return irNodeCount++;
+}
+
+//blocks control can go to from the end of block b, calls come back so they are not counted
+int irSuccessors(int b, int succ[]) {
+    ir_node_t* last = &irNodes[irBlocks[b].firstNode + irBlocks[b].nodeCount - 1];
+    int n = 0;
+
+    if (irBlocks[b].nodeCount == 0)
+        return 0;
+    if (last->kind == IR_JUMP || last->kind == IR_BRANCH)
+        succ[n++] = irBlockOf[(last->M - 10) / 3];
+    if (last->kind == IR_JUMP || (last->kind == IR_OTHER && last->op != 6 && last->op != 14))
+        return n;
+    if (b + 1 < irBlockCount)
+        succ[n++] = b + 1;
+    return n;
+}
+
+//marks each block with the procedure whose code it is and finds the INC of each frame
+//a block two procedures reach (only code no one calls could be) keeps no temps
+void irAssignProcs() {
+    int* work = arenaAlloc((2 * irBlockCount + 1) * sizeof(int));
+
+    irFrameInc = arenaAlloc((procCount + 1) * sizeof(int));
+    irFrameTemps = arenaAlloc((procCount + 1) * sizeof(int));
+    for (int proc = 0; proc <= procCount; proc++) {
+        int entry = proc == 0 ? 0 : (procTable[proc - 1].addr - 10) / 3;
+        int inc = (followJumps(entry * 3 + 10) - 10) / 3;
+        int count = 0;
+
+        irFrameInc[proc] = inc < cx && text[inc].op == 6 ? inc : -1;
+        irFrameTemps[proc] = 0;
+        work[count++] = irBlockOf[entry];
+        while (count > 0) {
+            int b = work[--count];
+            int succ[2];
+            if (irBlocks[b].proc == proc || irBlocks[b].proc == -2)
+                continue;
+            irBlocks[b].proc = irBlocks[b].proc == -1 ? proc : -2;
+            int n = irSuccessors(b, succ);
+            for (int k = 0; k < n; k++)
+                work[count++] = succ[k];
+        }
+    }
+}
+
+//numbers the values of block b on top of what its dominators left in the table
+void numberBlock(int b) {
+    ir_block_t* block = &irBlocks[b];
+    int temps = block->proc >= 0 && irFrameInc[block->proc] >= 0;
+
+    block->numbered = 1;
+    for (int n = block->firstNode; n < block->firstNode + block->nodeCount; n++) {
+        ir_node_t* node = &irNodes[n];
+        int va = node->a >= 0 ? irNodes[node->a].vn : -1;
+        int vb = node->b >= 0 ? irNodes[node->b].vn : -1;
+        int result;
+
+        switch (node->kind) {
+        case IR_CONST:
+            node->known = foldConstants;
+            node->value = node->M;
+            node->vn = irValue(IR_CONST, 0, 0, node->M, 0, 0, n, 1);
+            break;
+        case IR_LOAD:
+            //LOD is killed by STX of the offset, LDX by STO, see IR_STORE
+            node->vn = irValue(IR_LOAD, node->op, node->L, node->M, irVersion[2 * node->M + (node->op == 3)], irEpoch, n, 1);
+            node->known = irNodes[node->vn].known;
+            node->value = irNodes[node->vn].value;
+            irFolded += node->known;
+            break;
+        case IR_BINARY:
+            if (irNodes[va].known && (vb < 0 || irNodes[vb].known)
+                && evalOpr(node->M, irNodes[va].value, vb < 0 ? 0 : irNodes[vb].value, &result)) {
+                node->known = 1;
+                node->value = result;
+                node->vn = irValue(IR_CONST, 0, 0, result, 0, 0, n, 1);
+                irFolded++;
+                break;
+            }
+            //ADD, MUL, EQL and NEQ do not care about the order of their operands
+            if ((node->M == 1 || node->M == 3 || node->M == 5 || node->M == 6) && va > vb) {
+                int swap = va;
+                va = vb;
+                vb = swap;
+            }
+            node->vn = irValue(IR_BINARY, 0, 0, node->M, va, vb, n, 1);
+            if (node->vn != n && temps) {
+                node->reuse = 1;
+                irNodes[node->vn].temp = 1;
+                irReused++;
+            }
+            else
+                node->vn = n;
+            break;
+        case IR_STORE:
+            //a later load of the slot is the value, the new entry shadows the old one; within a
+            //procedure two LODs (or two LDXs) with another L are other frames, but a LOD and an
+            //LDX of the same offset may be the same word
+            if (node->op == 4) {
+                irValue(IR_LOAD, 3, node->L, node->M, irVersion[2 * node->M + 1], irEpoch, va, 0);
+                irLog(IR_UNDO_VERSION, 2 * node->M, irVersion[2 * node->M]);
+                irVersion[2 * node->M] = ++irClock;
+            }
+            else {
+                irValue(IR_LOAD, 11, node->L, node->M, irVersion[2 * node->M], irEpoch, va, 0);
+                irLog(IR_UNDO_VERSION, 2 * node->M + 1, irVersion[2 * node->M + 1]);
+                irVersion[2 * node->M + 1] = ++irClock;
+            }
+            break;
+        case IR_CALL:
+        case IR_OTHER:
+            //a call may store anywhere, and DEN points the display somewhere else
+            if (node->kind == IR_CALL || node->op == 14) {
+                irLog(IR_UNDO_EPOCH, 0, irEpoch);
+                irEpoch = ++irClock;
+            }
+            break;
+        }
+    }
+}
+
+//value number of the value keyed by kind .. b, vn if there is none yet
+//insert 0 adds the key without looking, so it shadows any entry with the same key
+int irValue(int kind, int op, int L, int M, int a, int b, int vn, int insert) {
+    uint64_t h = (uint64_t)kind * 0x9E3779B97F4A7C15ULL;
+    h = (h ^ (uint32_t)op) * 0x100000001B3ULL;
+    h = (h ^ (uint32_t)L) * 0x100000001B3ULL;
+    h = (h ^ (uint32_t)M) * 0x100000001B3ULL;
+    h = (h ^ (uint32_t)a) * 0x100000001B3ULL;
+    h = (h ^ (uint32_t)b) * 0x100000001B3ULL;
+    int bucket = (int)((h ^ (h >> 29)) & (uint64_t)irBucketMask);
+
+    for (int e = insert ? irBuckets[bucket] : -1; e >= 0; e = irValues[e].next) {
+        ir_value_t* v = &irValues[e];
+        if (v->kind == kind && v->op == op && v->L == L && v->M == M && v->a == a && v->b == b)
+            return v->vn;
+    }
+    irValues = reserve(irValues, &irValueCapacity, irValueCount + 1, sizeof(ir_value_t));
+    irValues[irValueCount] = (ir_value_t){kind, op, L, M, a, b, vn, irBuckets[bucket]};
+    irLog(IR_UNDO_VALUE, bucket, irBuckets[bucket]);
+    irBuckets[bucket] = irValueCount++;
+    return vn;
+}
+
+void irLog(int what, int index, int old) {
+    irUndoLog = reserve(irUndoLog, &irUndoCapacity, irUndoCount + 3, sizeof(int));
+    irUndoLog[irUndoCount++] = what;
+    irUndoLog[irUndoCount++] = index;
+    irUndoLog[irUndoCount++] = old;
+}
+
+//takes the value table, the versions and the epoch back to where they were at mark
+void irUndo(int mark) {
+    while (irUndoCount > mark) {
+        int old = irUndoLog[--irUndoCount];
+        int index = irUndoLog[--irUndoCount];
+        int what = irUndoLog[--irUndoCount];
+        if (what == IR_UNDO_VALUE) {
+            irBuckets[index] = old;
+            irValueCount--;
+        }
+        else if (what == IR_UNDO_VERSION)
+            irVersion[index] = old;
+        else
+            irEpoch = old;
+    }
+}
+
+//-O2 pass: rewrites the while loops the IR has: the condition moves below the body so that a
+//trip ends in one JPC back instead of a JPC and a JMP, values the loop does not change are
+//computed once before it, and an induction variable times a loop invariant factor is kept in a
+//temp each step of the variable adds to; the changes are made when "lower" writes the code
+void optimizeLoops() {
+    if (!irBuilt || findLoops() == 0)
+        return;
+    irInvariant = arenaAlloc(irNodeCount);
+    irEveryTrip = arenaAlloc(irBlockCount);
+    for (int l = 0; l < irLoopCount; l++) {
+        ir_loop_t* loop = &irLoops[l];
+        int end = irBlocks[loop->latch].firstNode + irBlocks[loop->latch].nodeCount;
+        if (loop->proc < 0 || irFrameInc[loop->proc] < 0)
+            continue;
+        markInvariants(l);
+        for (int n = irBlocks[loop->head].firstNode; n < end; n++) {
+            ir_node_t* node = &irNodes[n];
+            if (node->kind < IR_STORE || node->a < 0)
+                continue;
+            //a loop's condition has to stay a comparison to be turned around
+            if (node->kind == IR_BRANCH && irBlocks[node->block].headOf) {
+                hoistInvariants(irNodes[node->a].a, l);
+                hoistInvariants(irNodes[node->a].b, l);
+            }
+            else
+                hoistInvariants(node->a, l);
+        }
+        reduceStrength(l);
+    }
+}
+
+//fills irLoops with the loops whose shape irLoopShape accepts, outer loops first, and returns
+//their number
+int findLoops() {
+    int* predStart = arenaAlloc((irBlockCount + 2) * sizeof(int));
+    int* predList = arenaAlloc((2 * irBlockCount + 1) * sizeof(int));
+    int* fill = arenaAlloc((irBlockCount + 1) * sizeof(int));
+    int succ[2];
+
+    memset(predStart, 0, (irBlockCount + 2) * sizeof(int));
+    for (int b = 0; b < irBlockCount; b++) {
+        int n = irSuccessors(b, succ);
+        for (int k = 0; k < n; k++)
+            predStart[succ[k] + 1]++;
+    }
+    for (int b = 0; b < irBlockCount; b++) {
+        predStart[b + 1] += predStart[b];
+        fill[b] = predStart[b];
+    }
+    for (int b = 0; b < irBlockCount; b++) {
+        int n = irSuccessors(b, succ);
+        for (int k = 0; k < n; k++)
+            predList[fill[succ[k]]++] = b;
+    }
+
+    //the latch is the block after the head's loop that jumps back to it
+    irLoopCount = 0;
+    for (int head = 0; head < irBlockCount; head++) {
+        for (int p = predStart[head]; p < predStart[head + 1]; p++) {
+            int latch = predList[p];
+            ir_block_t* block = &irBlocks[latch];
+            if (latch <= head || irNodes[block->firstNode + block->nodeCount - 1].kind != IR_JUMP
+                || !irLoopShape(head, latch, predStart, predList))
+                continue;
+            irLoops = reserve(irLoops, &irLoopCapacity, irLoopCount + 1, sizeof(ir_loop_t));
+            irLoops[irLoopCount] = (ir_loop_t){head, latch, irBlocks[head].proc, 0, 0};
+            irBlocks[head].headOf = irBlocks[latch].latchOf = ++irLoopCount;
+            break;
+        }
+    }
+    return irLoopCount;
+}
+
+//1 if blocks head .. latch are a loop the pass can rewrite: head computes a comparison and its
+//JPC leaves to latch + 1, nothing enters the loop other than at head, and nothing inside it but
+//latch jumps back to head
+int irLoopShape(int head, int latch, const int* predStart, const int* predList) {
+    ir_block_t* block = &irBlocks[head];
+    ir_node_t* branch = &irNodes[block->firstNode + block->nodeCount - 1];
+
+    if (branch->kind != IR_BRANCH || irBlockOf[(branch->M - 10) / 3] != latch + 1)
+        return 0;
+    ir_node_t* cond = &irNodes[branch->a];
+    if (cond->kind != IR_BINARY || cond->M < 5 || cond->M > 10 || cond->known || cond->reuse || cond->temp > 0)
+        return 0;
+    for (int n = block->firstNode; n < block->firstNode + block->nodeCount - 1; n++)
+        if (irNodes[n].kind >= IR_STORE)
+            return 0;
+    for (int p = predStart[head]; p < predStart[head + 1]; p++)
+        if (predList[p] > head && predList[p] < latch)
+            return 0;
+    for (int b = head + 1; b <= latch; b++) {
+        //a call target or procedure entry has more predecessors than edges
+        if (irBlocks[b].proc != block->proc || irBlocks[b].preds != predStart[b + 1] - predStart[b])
+            return 0;
+        for (int p = predStart[b]; p < predStart[b + 1]; p++)
+            if (predList[p] < head || predList[p] > latch)
+                return 0;
+    }
+    return 1;
+}
+
+//sets irInvariant for the nodes of loop l: constants, loads of slots nothing in the loop may
+//store to, and operations other than DIV (which may trap) on invariant values
+void markInvariants(int l) {
+    int first = irBlocks[irLoops[l].head].firstNode;
+    int end = irBlocks[irLoops[l].latch].firstNode + irBlocks[irLoops[l].latch].nodeCount;
+
+    irLoopStoreCount = irLoopCalls = 0;
+    for (int n = first; n < end; n++) {
+        if (irNodes[n].kind == IR_STORE) {
+            irLoopStores = reserve(irLoopStores, &irLoopStoreCapacity, irLoopStoreCount + 1, sizeof(int));
+            irLoopStores[irLoopStoreCount++] = n;
+        }
+        else if (irNodes[n].kind == IR_CALL)
+            irLoopCalls = 1;
+    }
+    for (int n = first; n < end; n++) {
+        ir_node_t* node = &irNodes[n];
+        switch (node->kind) {
+        case IR_CONST:
+            irInvariant[n] = 1;
+            break;
+        case IR_LOAD:
+            irInvariant[n] = node->known || (!irLoopCalls && !irStoresTo(node->op, node->L, node->M));
+            break;
+        case IR_BINARY:
+            irInvariant[n] = node->known || (!node->reuse && node->M != 4 && irInvariant[node->a]
+                                             && (node->b < 0 || irInvariant[node->b]));
+            break;
+        default:
+            irInvariant[n] = 0;
+        }
+    }
+}
+
+//number of stores in irLoopStores, the loop markInvariants last went over, that may write the
+//slot LOD (op 3) or LDX (op 11) L M reads, by value numbering's rule: LODs with another L are
+//other frames, and so are LDXs
+int irStoresTo(int op, int L, int M) {
+    int count = 0;
+
+    for (int s = 0; s < irLoopStoreCount; s++) {
+        ir_node_t* store = &irNodes[irLoopStores[s]];
+        if (store->M == M && (store->L == L || (op == 3) != (store->op == 4)))
+            count++;
+    }
+    return count;
+}
+
+//moves the largest invariant parts of the tree under node n in front of loop l: operations
+//and loads that walk the static chain, a single LIT or LOD 0 costs as much as loading a temp
+void hoistInvariants(int n, int l) {
+    ir_node_t* node = &irNodes[n];
+    int proc = irLoops[l].proc;
+
+    if (node->known || node->reuse || node->slot > 0)
+        return;
+    if (irInvariant[n] && (node->kind == IR_BINARY || (node->op == 3 && node->L > 0))) {
+        //the same tree hoisted before, on another path through the loop, is already in a slot
+        for (int k = irBlocks[irLoops[l].head].firstNode; k < n; k++) {
+            if (irNodes[k].hoist == l + 1 && irSameValue(k, n)) {
+                node->slot = irNodes[k].slot;
+                node->temp = node->temp > 0 ? node->slot : 0;
+                return;
+            }
+        }
+        node->hoist = l + 1;
+        node->slot = node->temp > 0 ? node->temp : text[irFrameInc[proc]].M + irFrameTemps[proc]++;
+        irHoisted++;
+        return;
+    }
+    if (node->kind == IR_BINARY) {
+        hoistInvariants(node->a, l);
+        if (node->b >= 0)
+            hoistInvariants(node->b, l);
+    }
+}
+
+//finds the induction variables of loop l, slots its latch adds a constant to and the loop
+//stores nowhere else, and their products with invariant factors; the products with the same
+//factor share a temp when they save the four instructions of its step: each saves two where
+//it runs, which a branch of the loop may skip, so those count half
+void reduceStrength(int l) {
+    ir_block_t* latch = &irBlocks[irLoops[l].latch];
+    int first = irBlocks[irLoops[l].head].firstNode;
+    int end = latch->firstNode + latch->nodeCount;
+    int proc = irLoops[l].proc;
+    int reach = 0;
+
+    if (irLoopCalls)
+        return;
+    //a block runs on every trip unless a branch before it jumps past it
+    for (int b = irLoops[l].head + 1; b <= irLoops[l].latch; b++) {
+        int succ[2];
+        irEveryTrip[b] = reach <= b;
+        for (int k = irSuccessors(b, succ) - 1; k >= 0; k--)
+            reach = succ[k] > reach ? succ[k] : reach;
+    }
+    irEveryTrip[irLoops[l].head] = 1;
+    for (int s = latch->firstNode; s < end; s++) {
+        ir_node_t* store = &irNodes[s];
+        if (store->kind != IR_STORE || store->op != 4 || irStoresTo(3, store->L, store->M) != 1)
+            continue;
+        ir_node_t* sum = &irNodes[store->a];
+        if (sum->kind != IR_BINARY || sum->known || sum->reuse || sum->slot > 0 || (sum->M != 1 && sum->M != 2))
+            continue;
+        int var = sum->M == 1 && irNodes[sum->a].known ? sum->b : sum->a;
+        int add = var == sum->a ? sum->b : sum->a;
+        ir_node_t* load = &irNodes[var];
+        if (!irNodes[add].known || load->kind != IR_LOAD || load->op != 3 || load->L != store->L
+            || load->M != store->M || load->known)
+            continue;
+        int step = sum->M == 1 ? irNodes[add].value : (int)(0u - (uint32_t)irNodes[add].value);
+
+        for (int m = first; m < end; m++) {
+            int factor = irProductFactor(m, s);
+            int uses = 0;
+            if (factor < 0)
+                continue;
+            for (int k = m; k < end; k++)
+                if (irSameValue(irProductFactor(k, s), factor))
+                    uses += irEveryTrip[irNodes[k].block] ? 2 : 1;
+            if (uses < 4)
+                continue;
+            int slot = text[irFrameInc[proc]].M + irFrameTemps[proc]++;
+            //a product reused on its path is read from the slot too
+            for (int k = end - 1; k >= m; k--) {
+                if (irSameValue(irProductFactor(k, s), factor)) {
+                    irNodes[k].slot = slot;
+                    irNodes[k].temp = irNodes[k].temp > 0 ? slot : 0;
+                }
+            }
+            irReductions = reserve(irReductions, &irReductionCapacity, irReductionCount + 1, sizeof(ir_reduction_t));
+            irReductions[irReductionCount++] = (ir_reduction_t){l, s, factor, step, slot};
+            irReduced++;
+        }
+    }
+}
+
+//the factor node n multiplies the slot store s writes by, if n is such a product not yet
+//replaced and the factor is invariant, otherwise -1
+int irProductFactor(int n, int s) {
+    ir_node_t* node = &irNodes[n];
+    ir_node_t* store = &irNodes[s];
+
+    if (node->kind != IR_BINARY || node->M != 3 || node->known || node->reuse || node->slot > 0)
+        return -1;
+    for (int k = 0; k < 2; k++) {
+        ir_node_t* load = &irNodes[k == 0 ? node->a : node->b];
+        int factor = k == 0 ? node->b : node->a;
+        if (load->kind == IR_LOAD && load->op == 3 && load->L == store->L && load->M == store->M && !load->known
+            && irInvariant[factor])
+            return factor;
+    }
+    return -1;
+}
+
+//1 if invariant nodes x and y have the same value on every trip: equal constants, one value
+//number, or the same loads combined the same way; x may be -1
+int irSameValue(int x, int y) {
+    ir_node_t* a;
+    ir_node_t* b;
+
+    if (x < 0)
+        return 0;
+    a = &irNodes[x];
+    b = &irNodes[y];
+    if (a->known || b->known)
+        return a->known && b->known && a->value == b->value;
+    if (a->vn == b->vn)
+        return 1;
+    if (a->kind != b->kind || a->op != b->op || a->L != b->L || a->M != b->M)
+        return 0;
+    if (a->kind == IR_LOAD)
+        return 1;
+    return a->kind == IR_BINARY && irSameValue(a->a, b->a) && (a->b < 0 ? b->b < 0 : b->b >= 0 && irSameValue(a->b, b->b));
+}
+
+//-O2 pass: writes the blocks back to text[] in their old order and re-patches the branches and
+//procedures; a loop's head becomes its preheader and a JMP to the condition, which follows the latch
+void lowerIr() {
+    int length = cx;
 
-            token_p = getNextToken();
+    if (!irBuilt)
+        return;
+    for (int proc = 0; proc <= procCount; proc++) {
+        if (irFrameInc[proc] >= 0 && irFrameTemps[proc] > 0)
+            irNodes[irBlocks[irBlockOf[irFrameInc[proc]]].firstNode].M += irFrameTemps[proc];
+    }
+
+    //the old text stays in the arena, the new one is rarely longer
+    text = NULL;
+    textCapacity = cx = 0;
+    text = reserve(text, &textCapacity, length + 1, sizeof(text_t));
+    for (int b = 0; b < irBlockCount; b++) {
+        ir_block_t* block = &irBlocks[b];
+        int end = block->firstNode + block->nodeCount;
+        block->newStart = cx;
+        if (block->headOf) {
+            lowerPreheader(block->headOf - 1);
+            irLoops[block->headOf - 1].entryJump = cx;
+            emit(7, 0, 10);
+            continue;
         }
-        while (token_p == commasym);
+        for (int n = block->firstNode; n < (block->latchOf ? end - 1 : end); n++) {
+            ir_node_t* node = &irNodes[n];
+            if (node->kind < IR_STORE)
+                continue;
+            if (node->a >= 0 && !(node->kind == IR_BRANCH && irNodes[node->a].known))
+                lowerValue(node->a);
+            //a constant condition either always falls through or always jumps
+            if (node->kind == IR_BRANCH && irNodes[node->a].known) {
+                if (irNodes[node->a].value == 0)
+                    emit(7, 0, node->M);
+            }
+            else
+                emit(node->op, node->L, node->M);
+            if (node->kind == IR_STORE)
+                lowerSteps(n);
+        }
+        if (block->latchOf) {
+            irLoops[block->latchOf - 1].test = cx;
+            lowerLoopTest(block->latchOf - 1);
+        }
+    }
+    for (int i = 0; i < cx; i++)
+        if (isBranch(text[i].op))
+            text[i].M = irBlocks[irBlockOf[(text[i].M - 10) / 3]].newStart * 3 + 10;
+    for (int i = 0; i < procCount; i++)
+        procTable[i].addr = irBlocks[irBlockOf[(procTable[i].addr - 10) / 3]].newStart * 3 + 10;
+    for (int l = 0; l < irLoopCount; l++)
+        text[irLoops[l].entryJump].M = irLoops[l].test * 3 + 10;
+}
 
-        //must end with semicolon
-        if (token_p != semicolonsym)
-            error(6);   //ERROR: constant and variable declarations must be followed by a semicolon
+//emits the code that pushes node n's value
+void lowerValue(int n) {
+    ir_node_t* node = &irNodes[n];
 
-        token_p = getNextToken();
+    if (node->known) {
+        emit(1, 0, node->value);
+        return;
+    }
+    if (node->reuse) {
+        emit(3, 0, irNodes[node->vn].temp);
+        return;
+    }
+    //computed before the loop, or a product kept up to date by the induction variable's steps
+    if (node->slot > 0)
+        emit(3, 0, node->slot);
+    else {
+        if (node->a >= 0)
+            lowerValue(node->a);
+        if (node->b >= 0)
+            lowerValue(node->b);
+        emit(node->op, node->L, node->M);
+    }
+    //STO then LOD, which the peephole pass turns into STK
+    if (node->temp > 0 && node->temp != node->slot) {
+        emit(4, 0, node->temp);
+        emit(3, 0, node->temp);
     }
-    return numvars;
 }
 
-void procDeclaration(){
-    while(token_p == procsym) {
-        token_p = getNextToken();
+//code run once on the way into loop l: its hoisted values, then the first value of each product
+//of an induction variable
+void lowerPreheader(int l) {
+    int first = irBlocks[irLoops[l].head].firstNode;
+    int end = irBlocks[irLoops[l].latch].firstNode + irBlocks[irLoops[l].latch].nodeCount;
+
+    for (int n = first; n < end; n++) {
+        ir_node_t* node = &irNodes[n];
+        if (node->hoist != l + 1)
+            continue;
+        if (node->a >= 0)
+            lowerValue(node->a);
+        if (node->b >= 0)
+            lowerValue(node->b);
+        emit(node->op, node->L, node->M);
+        emit(4, 0, node->slot);
+    }
+    for (int r = 0; r < irReductionCount; r++) {
+        ir_reduction_t* reduction = &irReductions[r];
+        if (reduction->loop != l)
+            continue;
+        emit(3, irNodes[reduction->store].L, irNodes[reduction->store].M);
+        lowerValue(reduction->factor);
+        emit(2, 0, 3);
+        emit(4, 0, reduction->slot);
+    }
+}
 
-        if (token_p != identsym) {
-            error(27);          //ERROR: incorrect symbol after procedure declaration
+//the condition of loop l turned around: its JPC jumps back to the body while the condition holds
+void lowerLoopTest(int l) {
+    ir_block_t* head = &irBlocks[irLoops[l].head];
+    ir_node_t* branch = &irNodes[head->firstNode + head->nodeCount - 1];
+    ir_node_t* cond = &irNodes[branch->a];
+    //EQL, NEQ, LSS, LEQ, GTR, GEQ to its negation
+    static const int negated[] = {0, 0, 0, 0, 0, 6, 5, 10, 9, 8, 7};
+
+    lowerValue(cond->a);
+    lowerValue(cond->b);
+    emit(2, 0, negated[cond->M]);
+    emit(8, 0, irBlocks[irLoops[l].head + 1].start * 3 + 10);
+}
+
+//after store n, adds step * factor to the products of the variable it steps
+void lowerSteps(int n) {
+    for (int r = 0; r < irReductionCount; r++) {
+        ir_reduction_t* reduction = &irReductions[r];
+        if (reduction->store != n)
+            continue;
+        emit(3, 0, reduction->slot);
+        if (irNodes[reduction->factor].known)
+            emit(1, 0, (int)((uint32_t)reduction->step * (uint32_t)irNodes[reduction->factor].value));
+        else {
+            lowerValue(reduction->factor);
+            if (reduction->step != 1 && reduction->step != -1) {
+                emit(1, 0, reduction->step);
+                emit(2, 0, 3); //MUL
+            }
         }
-        char *name = getNextIdentifier();
+        //SUB when the variable counts down by 1, ADD otherwise
+        emit(2, 0, reduction->step == -1 && !irNodes[reduction->factor].known ? 2 : 1);
+        emit(4, 0, reduction->slot);
+    }
+}
 
-        if (symbolTableCheck(name) != -1)
-            error(3);   //ERROR: symbol name has already been declared
+/************************************************************
+*
+*   INCREMENTAL FUNCTIONS
+*
+************************************************************/
 
-        addToSymbolTable(3, name, 0, lev, cx * 3 + 10);
+//reads the cache file the last compile left and indexes its entries by path; a missing or
+//damaged file, or one written by another version or with other code generation options,
+//leaves the cache empty
+void loadProcCache() {
+    struct timespec begin;
+    proc_entry_t entry;
+    char magic[4];
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    FILE* file = fopen(incrementalCache, "rb");
+    if (file == NULL)
+        return;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        size = ftell(file);
+    if (size <= 0 || size >= INT_MAX || fseek(file, 0, SEEK_SET) != 0) {
+        fclose(file);
+        return;
+    }
+    char* contents = arenaAlloc(size);
+    size_t got = fread(contents, 1, size, file);
+    fclose(file);
+    if (got != (size_t)size)
+        return;
 
-        token_p = getNextToken();
+    const char* p = contents;
+    const char* end = contents + size;
+    readCacheBytes(&p, end, magic, 4);
+    if (memcmp(magic, INCREMENTAL_MAGIC, 4) != 0 || readCacheInt(&p, end) != INCREMENTAL_VERSION
+        || readCacheInt(&p, end) != procCacheOptions())
+        return;
+    int count = readCacheCount(&p, end);
+    int* offsets = arenaAlloc((count + 1) * sizeof(int));
+    int codeLength = 0;
+    for (int e = 0; e < count && p != NULL; e++) {
+        offsets[e] = p - contents;
+        readCacheBytes(&p, end, &entry, sizeof(entry));
+        if (entry.level == 0 && entry.codeLength > 0 && entry.codeLength < INT_MAX / 2 - codeLength)
+            codeLength += entry.codeLength;
+        if (p == NULL || entry.size < (int)sizeof(entry) || entry.size - (int)sizeof(entry) > end - p
+            || entry.pathLength < 0 || entry.pathLength > entry.size - (int)sizeof(entry)
+            || entry.descendants < 0 || entry.descendants > e)
+            p = NULL;
+        else
+            p += entry.size - sizeof(entry);
+    }
+    if (p == NULL)
+        return;
 
-        if(token_p != semicolonsym) {
-            error(26);          //ERROR: semicolon missing after procedure declaration
-        }
+    //keep the hash at most half full
+    int slotCount = 16;
+    while (slotCount < 2 * count)
+        slotCount *= 2;
+    procCacheSlots = arenaAlloc(slotCount * sizeof(int));
+    memset(procCacheSlots, 0, slotCount * sizeof(int));
+    procCacheSlotCount = slotCount;
+    procCacheFile = contents;
+    procCacheFileSize = size;
+    procCacheOffsets = offsets;
+    procCacheEntryCount = count;
+    for (int e = 0; e < count; e++) {
+        memcpy(&entry, contents + offsets[e], sizeof(entry));
+        uint64_t h = hashBytes(contents + offsets[e] + sizeof(entry), entry.pathLength);
+        while (procCacheSlots[h & (slotCount - 1)] != 0)
+            h++;
+        procCacheSlots[h & (slotCount - 1)] = e + 1;
+    }
+    //the program is likely as long as last time, room for it saves growing the code a step at a time
+    text = reserve(text, &textCapacity, codeLength + 16, sizeof(text_t));
+    procCacheNanos += nanosSince(&begin);
+}
 
-        token_p = getNextToken();
+//writes this compile's entries for the next one, through a new file that replaces the old one
+//so that a compile reading the cache at the same time never sees half of it
+void storeProcCache() {
+    struct timespec begin;
+    int header[3] = {INCREMENTAL_VERSION, procCacheOptions(), procCacheOutEntries};
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    //nothing changed if every procedure was reused in the same order
+    int entriesStart = 4 + sizeof(header);
+    if (procCacheFile != NULL && memcmp(procCacheFile + 4, header, sizeof(header)) == 0
+        && (procCacheFileSize == entriesStart ? procCachePieceCount == 0
+            : procCachePieceCount == 1 && procCachePieces[0].inFile && procCachePieces[0].offset == entriesStart
+              && procCachePieces[0].length == procCacheFileSize - entriesStart)) {
+        procCacheNanos += nanosSince(&begin);
+        return;
+    }
+    char* temp = arenaAlloc(strlen(incrementalCache) + 8);
+    sprintf(temp, "%s.XXXXXX", incrementalCache);
+    int fd = mkstemp(temp);
+    FILE* file = fd < 0 ? NULL : fdopen(fd, "wb");
+    int failed = file == NULL;
+    if (file != NULL) {
+        failed |= fwrite(INCREMENTAL_MAGIC, 4, 1, file) != 1;
+        failed |= fwrite(header, sizeof(header), 1, file) != 1;
+        for (int i = 0; i < procCachePieceCount; i++) {
+            proc_piece_t* piece = &procCachePieces[i];
+            const char* bytes = piece->inFile ? procCacheFile : procCacheOut;
+            failed |= fwrite(bytes + piece->offset, piece->length, 1, file) != 1;
+        }
+        failed |= fclose(file) != 0;
+    }
+    else if (fd >= 0)
+        close(fd);
+    if (failed || rename(temp, incrementalCache) != 0) {
+        if (fd >= 0)
+            unlink(temp);
+        fprintf(listingFile, "cannot create %s\n", incrementalCache);
+    }
+    procCacheNanos += nanosSince(&begin);
+}
 
-        block();
+//the options the cached code depends on, the others only change what is done with it afterwards
+int procCacheOptions() {
+    return useDisplay | foldConstants << 1;
+}
 
-        if(token_p != semicolonsym) {
-            error(24);          //ERROR: semicolon or comma missing
-        }
+//entry for the procedure at path, -1 if the last compile left none
+int findProcEntry(const char* path, int length) {
+    proc_entry_t entry;
 
-        token_p = getNextToken();
+    if (procCacheSlotCount == 0)
+        return -1;
+    for (uint64_t h = hashBytes(path, length);; h++) {
+        int slot = procCacheSlots[h & (procCacheSlotCount - 1)];
+        if (slot == 0)
+            return -1;
+        const char* e = procCacheFile + procCacheOffsets[slot - 1];
+        memcpy(&entry, e, sizeof(entry));
+        if (entry.pathLength == length && memcmp(e + sizeof(entry), path, length) == 0)
+            return slot - 1;
     }
 }
 
-void statement() {
-    if (token_p == identsym) {
-        //get name of the next identifier & check if it exists in sym table
-        char* name = getNextIdentifier();
-        int symIdx = symbolTableCheck(name);
-
-        if (symIdx == -1)
-            error(7); //ERROR: undeclared identifier
+//copies n bytes out of the cache file into dst, or skips them if dst is NULL
+//a read past the end sets *p to NULL, every read after that gets zeros
+void readCacheBytes(const char** p, const char* end, void* dst, size_t n) {
+    if (*p == NULL || (size_t)(end - *p) < n) {
+        *p = NULL;
+        if (dst != NULL)
+            memset(dst, 0, n);
+        return;
+    }
+    if (dst != NULL)
+        memcpy(dst, *p, n);
+    *p += n;
+}
 
-        //if token is not a var
-        if (symbol_table[symIdx].kind != 2)
-            error(8);   //ERROR: assignment to constant or procedure is not allowed
+int readCacheInt(const char** p, const char* end) {
+    int value;
+    readCacheBytes(p, end, &value, sizeof(value));
+    return value;
+}
 
-        token_p = getNextToken();
+//a length or a count, which can be no larger than what is left of the file
+int readCacheCount(const char** p, const char* end) {
+    int count = readCacheInt(p, end);
+    if (*p == NULL || count < 0 || count > end - *p) {
+        *p = NULL;
+        return 0;
+    }
+    return count;
+}
 
-        if (token_p != becomessym)
-            error(9);   //ERROR: assignment statements must use :=
+void writeCacheBytes(const void* src, int n) {
+    procCacheOut = reserve(procCacheOut, &procCacheOutCapacity, procCacheOutSize + n, 1);
+    memcpy(procCacheOut + procCacheOutSize, src, n);
+    procCacheOutSize += n;
+}
 
-        token_p = getNextToken();
+void writeCacheInt(int value) {
+    writeCacheBytes(&value, sizeof(value));
+}
 
-        expression();
-        emit(4, lev - symbol_table[symIdx].level, symbol_table[symIdx].addr); //emit STO
+//appends length bytes at offset in the loaded file or in procCacheOut to the next cache file
+void addCachePiece(int inFile, int offset, int length) {
+    proc_piece_t* last = procCachePieceCount > 0 ? &procCachePieces[procCachePieceCount - 1] : NULL;
+    if (last != NULL && last->inFile == inFile && last->offset + last->length == offset) {
+        last->length += length;
         return;
     }
-    if(token_p == callsym){
-        token_p = getNextToken();
+    procCachePieces = reserve(procCachePieces, &procCachePieceCapacity, procCachePieceCount + 1, sizeof(proc_piece_t));
+    procCachePieces[procCachePieceCount++] = (proc_piece_t){inFile, offset, length};
+}
 
-        if(token_p != identsym)
-            error(21); //ERROR: call must be followed by an identifier
+//the path of the procedure named atom that is being declared: its parents' names and its own
+void declareProcPath(int atom) {
+    int prefix = procPathLength[lev];
+    int length = prefix + (prefix > 0) + atomLength[atom];
 
-        char* name = getNextIdentifier();
-        int symIdx = symbolTableCheck(name);
+    procPath = reserve(procPath, &procPathCapacity, length, 1);
+    if (prefix > 0)
+        procPath[prefix] = '.';
+    memcpy(procPath + length - atomLength[atom], source + atomOffset[atom], atomLength[atom]);
+    procPathLength[lev + 1] = length;
+}
 
-        if(symIdx == -1)
-            error(7); //ERROR: undeclared identifier
-        else if(symbol_table[symIdx].kind == 3)  {
-            emit(5, lev - symbol_table[symIdx].level, symbol_table[symIdx].addr); //emit CAL
+//starts collecting the entry of the procedure whose block is about to be compiled
+void openProcRecord() {
+    proc_record_t* r = &procRecords[lev + 1];
+
+    r->mark = tp;
+    r->serial = ++noteSerial;
+    r->start = cx;
+    r->spanStart = tokens[trackerToken - 1].offset;
+    r->procStart = procCount;
+    r->entryStart = procCacheOutEntries;
+    r->displayMask = 0;
+    r->adjust = 0;
+    r->refCount = 0;
+    clock_gettime(CLOCK_MONOTONIC, &r->begin);
+}
+
+//writes the entry of the procedure whose block just ended, token_p is the ';' after it
+//a procedure that branches out of itself other than by calling one it looked up gets no entry
+void closeProcRecord() {
+    proc_record_t* r = &procRecords[lev + 1];
+    proc_entry_t entry = {0};
+    int startPc = r->start * 3 + 10;
+    int endPc = cx * 3 + 10;
+    int entryOffset = procCacheOutSize;
+
+    entry.pathLength = procPathLength[lev + 1];
+    entry.spanLength = tokens[trackerToken - 1].offset + 1 - r->spanStart;
+    entry.spanHash = hashSpan(source + r->spanStart, entry.spanLength);
+    entry.level = lev;
+    for (int i = r->procStart; i < procCount; i++)
+        if (procTable[i].level - lev > entry.depth)
+            entry.depth = procTable[i].level - lev;
+    entry.displayMask = r->displayMask;
+    entry.descendants = procCacheOutEntries - r->entryStart;
+    entry.refCount = r->refCount;
+    entry.procCount = procCount - r->procStart;
+    entry.codeLength = cx - r->start;
+    entry.nanos = nanosSince(&r->begin) + r->adjust;
+
+    //the header is filled in at the end
+    writeCacheBytes(&entry, sizeof(entry));
+    writeCacheBytes(procPath, entry.pathLength);
+    for (int k = 0; k < r->refCount; k++) {
+        int ref[5] = {r->refs[k].kind, r->refs[k].level, r->refs[k].val, r->refs[k].addr, r->refs[k].length};
+        writeCacheBytes(ref, sizeof(ref));
+        writeCacheBytes(r->refs[k].name, r->refs[k].length);
+    }
+    for (int i = r->procStart; i < procCount; i++) {
+        writeCacheBytes(procTable[i].name, sizeof(procTable[i].name));
+        writeCacheInt(procTable[i].level);
+        writeCacheInt(procTable[i].addr - startPc);
+    }
+    int codeOffset = procCacheOutSize;
+    writeCacheBytes(text + r->start, entry.codeLength * sizeof(text_t));
+    for (int i = r->start; i < cx; i++) {
+        if (!isBranch(text[i].op))
+            continue;
+        int M = text[i].M;
+        int ref = -1;
+        if (M >= startPc && M < endPc) {
+            M -= startPc;
+            memcpy(procCacheOut + codeOffset + (i - r->start) * sizeof(text_t) + offsetof(text_t, M), &M, sizeof(M));
         }
-        else{
-            error(22);    //ERROR: call of a constant or variable is meaningless
+        else {
+            for (int k = 0; k < r->refCount && (text[i].op == 5 || text[i].op == 13); k++) {
+                if (r->refs[k].kind == 3 && r->refs[k].addr == M) {
+                    ref = k;
+                    break;
+                }
+            }
+            if (ref == -1) {
+                procCacheOutSize = entryOffset;
+                return;
+            }
+        }
+        writeCacheInt(i - r->start);
+        writeCacheInt(ref);
+        entry.relocCount++;
+    }
+    entry.size = procCacheOutSize - entryOffset;
+    memcpy(procCacheOut + entryOffset, &entry, sizeof(entry));
+    addCachePiece(0, entryOffset, entry.size);
+    procCacheOutEntries++;
+}
+
+//a lookup of name (atom, or -1 if the source has no such identifier) that found symIdx:
+//every procedure being compiled that the symbol is outside of, or all of them if there is no
+//symbol, depends on it, and its entry lists each name once
+void noteName(const char* name, int length, int atom, int symIdx) {
+    if (atom != -1 && atomNotedCapacity < atomCount) {
+        int old = atomNotedCapacity;
+        int capacity = old;
+        for (int d = 1; d <= LEV_MAX + 1; d++) {
+            capacity = old;
+            atomNoted[d] = reserve(atomNoted[d], &capacity, atomCount, sizeof(int));
+            memset(atomNoted[d] + old, 0, (capacity - old) * sizeof(int));
+        }
+        atomNotedCapacity = capacity;
+    }
+    for (int d = lev; d >= 1 && symIdx < procRecords[d].mark; d--) {
+        proc_record_t* r = &procRecords[d];
+        if (atom != -1) {
+            if (atomNoted[d][atom] == r->serial)
+                continue;
+            atomNoted[d][atom] = r->serial;
         }
+        r->refs = reserve(r->refs, &r->refCapacity, r->refCount + 1, sizeof(proc_ref_t));
+        proc_ref_t* ref = &r->refs[r->refCount++];
+        ref->name = name;
+        ref->length = length;
+        ref->kind = symIdx == -1 ? 0 : symKind[symIdx];
+        ref->level = symIdx == -1 ? 0 : symLevel[symIdx];
+        ref->val = symIdx == -1 ? 0 : symVal[symIdx];
+        ref->addr = symIdx == -1 ? 0 : symAddr[symIdx];
+    }
+}
+
+//display[level] is read, so every procedure being compiled inside that level depends on it
+void noteDisplay(int level) {
+    for (int d = lev; d > level; d--)
+        procRecords[d].displayMask |= 1 << level;
+}
+
+//copies the code the cache file has for the procedure just declared instead of compiling its
+//block, if the block's source and everything it looked up outside are unchanged
+//returns 0 if the block has to be compiled, token_p is the block's first token either way
+int reuseProcedure() {
+    struct timespec begin;
+    proc_entry_t entry;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int e = findProcEntry(procPath, procPathLength[lev + 1]);
+    if (e == -1 || token_p == 0)
+        return 0;
+    const char* p = procCacheFile + procCacheOffsets[e];
+    const char* end = p;
+    memcpy(&entry, p, sizeof(entry));
+    end += entry.size;
+    p += sizeof(entry) + entry.pathLength;
+    size_t start = tokens[trackerToken - 1].offset;
+    if (entry.level != lev || entry.spanLength <= 0 || (size_t)entry.spanLength > sourceLength - start
+        || hashSpan(source + start, entry.spanLength) != entry.spanHash)
+        return 0;
+
+    if (entry.refCount < 0 || entry.refCount > end - p)
+        return 0;
+    reuseRefs = reserve(reuseRefs, &reuseCapacity, entry.refCount, sizeof(proc_ref_t));
+    reuseSymbols = reserve(reuseSymbols, &reuseSymbolCapacity, 2 * entry.refCount, sizeof(int));
+    for (int k = 0; k < entry.refCount; k++) {
+        proc_ref_t* ref = &reuseRefs[k];
+        ref->kind = readCacheInt(&p, end);
+        ref->level = readCacheInt(&p, end);
+        ref->val = readCacheInt(&p, end);
+        ref->addr = readCacheInt(&p, end);
+        ref->length = readCacheCount(&p, end);
+        ref->name = p;
+        readCacheBytes(&p, end, NULL, ref->length);
+        if (p == NULL)
+            return 0;
+        int atom = findAtom(ref->name, ref->length);
+        int s = atom == -1 ? -1 : atomHead[atom];
+        if (s == -1 ? ref->kind != 0
+            : symKind[s] != ref->kind || symLevel[s] != ref->level || symVal[s] != ref->val
+              || (ref->kind != 3 && symAddr[s] != ref->addr))
+            return 0;
+        reuseSymbols[2 * k] = s;
+        reuseSymbols[2 * k + 1] = atom;
+    }
+    const char* procs = p;
+    readCacheBytes(&p, end, NULL, (size_t)entry.procCount * (sizeof(procTable->name) + 2 * sizeof(int)));
+    const char* code = p;
+    readCacheBytes(&p, end, NULL, (size_t)entry.codeLength * sizeof(text_t));
+    const char* relocs = p;
+    readCacheBytes(&p, end, NULL, (size_t)entry.relocCount * 2 * sizeof(int));
+    if (p == NULL || entry.procCount < 0 || entry.codeLength < 0 || entry.relocCount < 0)
+        return 0;
+    for (int k = 0; k < entry.relocCount; k++) {
+        int reloc[2];
+        memcpy(reloc, relocs + k * sizeof(reloc), sizeof(reloc));
+        if (reloc[0] < 0 || reloc[0] >= entry.codeLength || reloc[1] < -1 || reloc[1] >= entry.refCount
+            || (reloc[1] != -1 && reuseRefs[reloc[1]].kind != 3))
+            return 0;
+        int M;
+        memcpy(&M, code + reloc[0] * sizeof(text_t) + offsetof(text_t, M), sizeof(M));
+        if (reloc[1] == -1 && (M < 0 || M >= entry.codeLength * 3))
+            return 0;
+    }
+    if (cx + entry.codeLength > (INT_MAX - 10) / 3)
+        error(16); //ERROR: max number of instructions exceeded
 
+    //the procedures around it depend on what it depends on
+    for (int k = 0; k < entry.refCount; k++)
+        noteName(reuseRefs[k].name, reuseRefs[k].length, reuseSymbols[2 * k + 1], reuseSymbols[2 * k]);
+    for (int level = 0; level <= LEV_MAX; level++) {
+        if (entry.displayMask & 1 << level) {
+            displayUsed[level] = 1;
+            noteDisplay(level);
+        }
+    }
+    if (lev + 1 + entry.depth > maxLevel)
+        maxLevel = lev + 1 + entry.depth;
+
+    int base = cx * 3 + 10;
+    procTable = reserve(procTable, &procCapacity, procCount + entry.procCount, sizeof(symbol_t));
+    for (int i = 0; i < entry.procCount; i++) {
+        symbol_t* proc = &procTable[procCount++];
+        memset(proc, 0, sizeof(symbol_t));
+        proc->kind = 3;
+        memcpy(proc->name, procs, sizeof(proc->name));
+        proc->name[sizeof(proc->name) - 1] = '\0';
+        memcpy(&proc->level, procs + sizeof(proc->name), sizeof(int));
+        memcpy(&proc->addr, procs + sizeof(proc->name) + sizeof(int), sizeof(int));
+        proc->addr += base;
+        procs += sizeof(proc->name) + 2 * sizeof(int);
+    }
+    text = reserve(text, &textCapacity, cx + entry.codeLength, sizeof(text_t));
+    memcpy(text + cx, code, entry.codeLength * sizeof(text_t));
+    for (int k = 0; k < entry.relocCount; k++) {
+        int reloc[2];
+        memcpy(reloc, relocs + k * sizeof(reloc), sizeof(reloc));
+        text_t* t = &text[cx + reloc[0]];
+        t->M = reloc[1] == -1 ? t->M + base : symAddr[reuseSymbols[2 * reloc[1]]];
+    }
+    cx += entry.codeLength;
+
+    //carry on at the ';' after the block, past any of the block's tokens already scanned
+    size_t semicolon = start + entry.spanLength - 1;
+    if (semicolon > start) {
+        while (trackerToken < tokenCount && (size_t)tokens[trackerToken].offset < semicolon)
+            trackerToken++;
+        if (trackerToken == tokenCount) {
+            sourcePos = semicolon;
+            trackerInput = 0;
+        }
         token_p = getNextToken();
+    }
 
-        return;
+    //its nested procedures' entries come with it
+    int first = procCacheOffsets[e - entry.descendants];
+    addCachePiece(1, first, procCacheOffsets[e] + entry.size - first);
+    procCacheOutEntries += entry.descendants + 1;
+    reusedProcs += entry.descendants + 1;
+    long long spent = nanosSince(&begin);
+    savedNanos += entry.nanos;
+    relinkNanos += spent;
+    if (lev > 0)
+        procRecords[lev].adjust += entry.nanos - spent;
+    return 1;
+}
+
+//atom of the name if an identifier in the source has it, -1 if none has yet
+int findAtom(const char* name, int length) {
+    unsigned hash = 2166136261u; // FNV-1a, as internIdentifier
+    for (int i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+
+    if (atomSlotCount == 0)
+        return -1;
+    for (unsigned h = hash;; h++) {
+        int slot = atomSlots[h & (atomSlotCount - 1)];
+        if (slot == 0)
+            return -1;
+        int atom = slot - 1;
+        if (atomLength[atom] == length && memcmp(source + atomOffset[atom], name, length) == 0)
+            return atom;
     }
-    if (token_p == beginsym) {
-        do {
-            token_p = getNextToken();
-            statement();
-        }while (token_p == semicolonsym);
+}
 
-        if (token_p != endsym)
-            error(10); //ERROR: "begin" must be followed by "end"
+long long nanosSince(struct timespec* begin) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1000000000LL + (now.tv_nsec - begin->tv_nsec);
+}
 
-        token_p = getNextToken();
-        return;
+//64 bit FNV-1a
+uint64_t hashBytes(const char* bytes, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 1099511628211ULL;
     }
-    if (token_p == ifsym) {
+    return hash;
+}
 
-        token_p = getNextToken();
+//hash of a procedure's source, eight bytes a step since it runs over most of the program
+uint64_t hashSpan(const char* bytes, size_t length) {
+    uint64_t hash = length;
+    uint64_t word;
+
+    for (; length >= 8; bytes += 8, length -= 8) {
+        memcpy(&word, bytes, 8);
+        hash ^= word * 0x9E3779B97F4A7C15ULL;
+        hash = (hash << 27 | hash >> 37) * 0xC2B2AE3D27D4EB4FULL;
+    }
+    word = 0;
+    memcpy(&word, bytes, length);
+    hash ^= word * 0x9E3779B97F4A7C15ULL;
+    hash = (hash << 27 | hash >> 37) * 0xC2B2AE3D27D4EB4FULL;
+    return hash ^ hash >> 29;
+}
 
-        condition();
+void printIncrementalReport() {
+    fprintf(listingFile, "\nIncremental report:\n");
+    //the dead code pass may have dropped procedures since, reused ones among them
+    fprintf(listingFile, "  %-22s%d of %d, %d compiled\n", "procedures reused", reusedProcs, parsedProcs,
+            parsedProcs - reusedProcs);
+    fprintf(listingFile, "  %-22s%.3f ms, relinking them took %.3f ms\n", "compile time saved",
+            (savedNanos - relinkNanos) / 1e6, relinkNanos / 1e6);
+    fprintf(listingFile, "  %-22s%.3f ms to read and write %s\n", "cache file", procCacheNanos / 1e6, incrementalCache);
+}
 
-        int jpcIdx = cx; //set jpcIdx to current code index
+/************************************************************
+*
+*   LINKER FUNCTIONS
+*
+************************************************************/
 
-        emit(8, 0, 0); //emit JPC
+//relocation of the instruction just emitted, for the object
+void addObjectReloc(int kind, int import) {
+    objectRelocs = reserve(objectRelocs, &objectRelocCapacity, objectRelocCount + 1, sizeof(object_reloc_t));
+    objectRelocs[objectRelocCount++] = (object_reloc_t){cx - 1, kind, import};
+}
 
-        if (token_p != thensym)
-            error(11); //ERROR: "if" must be followed by "then"
+//call of a name the module does not declare, the linker takes it from the object that exports it
+//the procedure is called like one declared at level 0, with the main frame as its static link
+void emitImportCall(int atom) {
+    int import = 0;
+
+    //a module calls few other modules' procedures, a scan finds them
+    while (import < importCount && objectImports[import] != atom)
+        import++;
+    if (import == importCount) {
+        objectImports = reserve(objectImports, &importCapacity, importCount + 1, sizeof(int));
+        objectImports[importCount++] = atom;
+    }
+    if (useDisplay && lev >= 2)
+        emit(13, 0, 0); //emit CLX
+    else
+        emit(5, lev, 0); //emit CAL
+    addObjectReloc(RELOC_IMPORT, import);
+}
 
-        token_p = getNextToken();
+//relocatable object: header, section table, code, procedure symbols, relocations, imports (see pl0object.h)
+void writeObject(FILE* file) {
+    object_header_t header;
+    image_section_t sections[4];
+    image_symbol_t sym;
+    object_import_t import;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, OBJECT_MAGIC, 4);
+    header.version = OBJECT_VERSION;
+    header.sectionCount = 4;
+    header.codeLength = cx;
+    header.mainStart = (text[0].M - 10) / 3;
+    header.globals = text[header.mainStart].M - 3;
+
+    sections[0].kind = SECTION_CODE;
+    sections[0].offset = sizeof(header) + sizeof(sections);
+    sections[0].size = cx * 3 * sizeof(int32_t);
+    sections[1].kind = SECTION_SYMBOLS;
+    sections[1].offset = sections[0].offset + sections[0].size;
+    sections[1].size = procCount * sizeof(image_symbol_t);
+    sections[2].kind = SECTION_RELOCS;
+    sections[2].offset = sections[1].offset + sections[1].size;
+    sections[2].size = objectRelocCount * sizeof(object_reloc_t);
+    sections[3].kind = SECTION_IMPORTS;
+    sections[3].offset = sections[2].offset + sections[2].size;
+    sections[3].size = importCount * sizeof(object_import_t);
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(sections, sizeof(sections), 1, file);
+    for (int i = 0; i < cx; i++) {
+        int32_t words[3] = {text[i].op, text[i].L, text[i].M};
+        fwrite(words, sizeof(words), 1, file);
+    }
+    for (int i = 0; i < procCount; i++) {
+        memset(&sym, 0, sizeof(sym));
+        sym.addr = procTable[i].addr;
+        sym.level = procTable[i].level;
+        strcpy(sym.name, procTable[i].name);
+        fwrite(&sym, sizeof(sym), 1, file);
+    }
+    fwrite(objectRelocs, sizeof(object_reloc_t), objectRelocCount, file);
+    for (int i = 0; i < importCount; i++) {
+        memset(&import, 0, sizeof(import));
+        memcpy(import.name, source + atomOffset[objectImports[i]], atomLength[objectImports[i]]);
+        fwrite(&import, sizeof(import), 1, file);
+    }
+}
 
-        statement();
-        text[jpcIdx].M = cx * 3 + 10;
+//copies the header of object k, which has to be one this compiler wrote
+void readObjectHeader(const char* object, size_t length, object_header_t* header) {
+    if (length < sizeof(object_header_t))
+        error(PL0_BAD_OBJECT);
+    memcpy(header, object, sizeof(object_header_t));
+    if (memcmp(header->magic, OBJECT_MAGIC, 4) != 0 || header->version != OBJECT_VERSION
+        || header->sectionCount > (length - sizeof(object_header_t)) / sizeof(image_section_t))
+        error(PL0_BAD_OBJECT);
+}
 
-        if(token_p != fisym)
-            error(20);  //ERROR: fi must follow then
+//contents of the object's section of kind, in whole records of elemSize; a missing section is empty
+const char* objectSection(const char* object, size_t length, int kind, size_t elemSize, int* count) {
+    object_header_t header;
+    image_section_t section;
+
+    memcpy(&header, object, sizeof(header));
+    *count = 0;
+    for (int s = 0; s < header.sectionCount; s++) {
+        memcpy(&section, object + sizeof(header) + s * sizeof(section), sizeof(section));
+        if (section.kind != (uint32_t)kind)
+            continue;
+        if (section.offset > length || section.size > length - section.offset || section.offset % 4 != 0
+            || section.size % elemSize != 0 || section.size / elemSize > INT_MAX / 3)
+            error(PL0_BAD_OBJECT);
+        *count = section.size / elemSize;
+        return object + section.offset;
+    }
+    return object;
+}
 
-        token_p = getNextToken();
+//procTable index of the level 0 procedure named name, -1 if no object exports it
+//with insert, adds procedure proc under its name instead and returns -1, or the one already there
+int findExport(const char* name, int insert, int proc) {
+    size_t length = strlen(name);
+
+    for (uint64_t h = hashBytes(name, length);; h++) {
+        int* slot = &exportSlots[h & (exportSlotCount - 1)];
+        if (*slot == 0) {
+            if (insert)
+                *slot = proc + 1;
+            return -1;
+        }
+        if (strcmp(procTable[*slot - 1].name, name) == 0)
+            return *slot - 1;
+    }
+}
+
+//merges the objects into text and procTable: all of the first, the procedures of the others after
+//it, with their branches moved along, their level 0 variables added to the main frame and the
+//calls of their imports pointed at the procedures the other objects export
+void linkObjects(const char* const objects[], const size_t lengths[], int count) {
+    object_header_t header;
+    image_symbol_t sym;
+    object_reloc_t reloc;
+    object_import_t import;
+    int n;
+    int* first = arenaAlloc(count * sizeof(int)); // first instruction kept of each object
+    int* last = arenaAlloc(count * sizeof(int)); // and the one after the last
+    int* mainStart = arenaAlloc(count * sizeof(int));
+    int* base = arenaAlloc(count * sizeof(int)); // where its first instruction goes in text, minus first
+    int* data = arenaAlloc(count * sizeof(int)); // added to the addresses of its level 0 variables
+    int globals = 0;
+    int symbols = 0;
+
+    //lay the objects out, the main block of the others never runs
+    for (int k = 0; k < count; k++) {
+        linkObject = k;
+        readObjectHeader(objects[k], lengths[k], &header);
+        const int32_t* code = (const int32_t*)objectSection(objects[k], lengths[k], SECTION_CODE, 3 * sizeof(int32_t), &n);
+        if (n == 0 || (uint32_t)n != header.codeLength || header.mainStart >= header.codeLength
+            || code[0] != 7 || code[3 * header.mainStart] != 6 || header.globals > INT_MAX / 2 - (uint32_t)globals)
+            error(PL0_BAD_OBJECT);
+        first[k] = k == 0 ? 0 : 1;
+        last[k] = k == 0 ? n : (int)header.mainStart;
+        mainStart[k] = header.mainStart;
+        if (last[k] - first[k] > (INT_MAX - 10) / 3 - cx)
+            error(16); //ERROR: max number of instructions exceeded
+        base[k] = cx - first[k];
+        cx += last[k] - first[k];
+        data[k] = k == 0 ? 0 : globals;
+        globals += header.globals;
+        objectSection(objects[k], lengths[k], SECTION_SYMBOLS, sizeof(image_symbol_t), &n);
+        symbols += n;
+    }
+
+    //the procedures, each object's level 0 ones under their names
+    int slotCount = 16;
+    while (slotCount < 2 * symbols)
+        slotCount *= 2;
+    exportSlots = arenaAlloc(slotCount * sizeof(int));
+    memset(exportSlots, 0, slotCount * sizeof(int));
+    exportSlotCount = slotCount;
+    procTable = reserve(procTable, &procCapacity, symbols, sizeof(symbol_t));
+    for (int k = 0; k < count; k++) {
+        linkObject = k;
+        const char* symbol = objectSection(objects[k], lengths[k], SECTION_SYMBOLS, sizeof(image_symbol_t), &n);
+        for (int i = 0; i < n; i++) {
+            memcpy(&sym, symbol + i * sizeof(sym), sizeof(sym));
+            symbol_t* proc = &procTable[procCount];
+            memset(proc, 0, sizeof(symbol_t));
+            proc->kind = 3;
+            memcpy(proc->name, sym.name, sizeof(proc->name));
+            proc->level = sym.level;
+            proc->addr = sym.addr + 3 * base[k];
+            int index = (sym.addr - 10) / 3;
+            if (proc->name[sizeof(proc->name) - 1] != '\0' || sym.addr < 10 || (sym.addr - 10) % 3 != 0
+                || index < 1 || index >= mainStart[k] || sym.level < 0 || sym.level > LEV_MAX)
+                error(PL0_BAD_OBJECT);
+            if (sym.level == 0 && findExport(proc->name, 1, procCount) != -1) {
+                strcpy(linkName, proc->name);
+                error(PL0_DUPLICATE_PROCEDURE);
+            }
+            procCount++;
+        }
+    }
+
+    //the code, with every branch that is not an import moved along
+    text = reserve(text, &textCapacity, cx, sizeof(text_t));
+    for (int k = 0; k < count; k++) {
+        linkObject = k;
+        const int32_t* code = (const int32_t*)objectSection(objects[k], lengths[k], SECTION_CODE, 3 * sizeof(int32_t), &n);
+        const char* relocs = objectSection(objects[k], lengths[k], SECTION_RELOCS, sizeof(object_reloc_t), &n);
+        int relocCount = n;
+        const char* imports = objectSection(objects[k], lengths[k], SECTION_IMPORTS, sizeof(object_import_t), &n);
+        int importTotal = n;
+        int end = last[k];
+        char* imported = arenaAlloc(end);
+        memset(imported, 0, end);
+        for (int r = 0; r < relocCount; r++) {
+            memcpy(&reloc, relocs + r * sizeof(reloc), sizeof(reloc));
+            if (reloc.kind == RELOC_IMPORT && reloc.index < (uint32_t)end)
+                imported[reloc.index] = 1;
+        }
+        for (int i = first[k]; i < end; i++) {
+            text_t* t = &text[base[k] + i];
+            t->op = code[3 * i];
+            t->L = code[3 * i + 1];
+            t->M = code[3 * i + 2];
+            if (t->op < 1 || t->op > 15)
+                error(PL0_BAD_OBJECT);
+            //the register ISA has no display, a compile with --reg turns --display off
+            if (regIsa && t->op >= 11)
+                error(PL0_DISPLAY_OBJECT);
+            if (!isBranch(t->op) || imported[i])
+                continue;
+            if (t->M < 10 + 3 * first[k] || t->M >= 10 + 3 * end || (t->M - 10) % 3 != 0)
+                error(PL0_BAD_OBJECT);
+            t->M += 3 * base[k];
+        }
+        for (int r = 0; r < relocCount; r++) {
+            memcpy(&reloc, relocs + r * sizeof(reloc), sizeof(reloc));
+            //the relocations of a main block that was left out
+            if (reloc.index < (uint32_t)first[k] || reloc.index >= (uint32_t)end)
+                continue;
+            text_t* t = &text[base[k] + reloc.index];
+            if (reloc.kind == RELOC_DATA && (t->op == 3 || t->op == 4 || t->op == 11 || t->op == 12))
+                t->M += data[k];
+            else if (reloc.kind == RELOC_IMPORT && (t->op == 5 || t->op == 13) && reloc.import < (uint32_t)importTotal) {
+                memcpy(&import, imports + reloc.import * sizeof(import), sizeof(import));
+                if (import.name[sizeof(import.name) - 1] != '\0')
+                    error(PL0_BAD_OBJECT);
+                int proc = findExport(import.name, 0, 0);
+                if (proc == -1) {
+                    strcpy(linkName, import.name);
+                    error(PL0_UNDEFINED_PROCEDURE);
+                }
+                t->M = procTable[proc].addr;
+            }
+            else
+                error(PL0_BAD_OBJECT);
+        }
+    }
+
+    //the main frame holds every object's level 0 variables
+    text[mainStart[0]].M = globals + 3;
+}
+
+/************************************************************
+*
+*   REGISTER BACKEND FUNCTIONS
+*
+************************************************************/
+
+//translates text[] into three-address code over the frame's registers
+//the operand stack is simulated at compile time: constants and local variables are used in place,
+//everything else lands in the temp register for its stack depth, right after the frame's variables
+void translateToRegisters() {
+    vreg_t* vs = arenaAlloc((cx + 1) * sizeof(vreg_t));
+    char* leader = arenaAlloc(cx + 1);
+    int depth = 0;
+    int tempBase = 3;
+    int lastDef = -1; // index of the last register instruction that defined the top temp
+    vreg_t a, b;
+
+    //jump and call targets, the operand stack is empty there
+    regMap = arenaAlloc((cx + 1) * sizeof(int));
+    memset(leader, 0, cx + 1);
+    for (int i = 0; i < cx; i++)
+        if (isBranch(text[i].op))
+            leader[(text[i].M - 10) / 3] = 1;
+
+    rx = 0;
+    for (int i = 0; i < cx; i++) {
+        int op = text[i].op;
+        int L = text[i].L;
+        int M = text[i].M;
+        int t = tempBase + depth;
+
+        regMap[i] = rx;
+        //never expected from the parser, but keep values in their temps across a join
+        if (leader[i]) {
+            for (int d = 0; d < depth; d++) {
+                if (vs[d].isImm)
+                    emitReg(RLI, tempBase + d, vs[d].val, 0);
+                else if (vs[d].val != tempBase + d)
+                    emitReg(RMOV, tempBase + d, vs[d].val, 0);
+                vs[d].isImm = 0;
+                vs[d].val = tempBase + d;
+            }
+            lastDef = -1;
+        }
+
+        switch (op) {
+        case 1: //LIT
+            vs[depth].isImm = 1;
+            vs[depth++].val = M;
+            break;
+        case 3: //LOD, locals are read straight from their register
+            vs[depth].isImm = 0;
+            if (L == 0)
+                vs[depth++].val = M;
+            else {
+                emitReg(RLDN, t, L, M);
+                lastDef = rx - 1;
+                vs[depth++].val = t;
+            }
+            break;
+        case 4: //STO
+            a = vs[--depth];
+            if (L != 0)
+                emitReg(RSTN, regOperand(a, tempBase + depth), L, M);
+            //retarget the instruction that computed the temp instead of copying it
+            else if (!a.isImm && a.val >= tempBase && lastDef == rx - 1 && regText[lastDef].a == a.val)
+                regText[lastDef].a = M;
+            else if (a.isImm)
+                emitReg(RLI, M, a.val, 0);
+            else if (a.val != M)
+                emitReg(RMOV, M, a.val, 0);
+            lastDef = -1;
+            break;
+        case 10: //STK, like STO but the value stays on the stack
+            a = vs[depth - 1];
+            if (L != 0)
+                emitReg(RSTN, regOperand(a, t - 1), L, M);
+            else if (!a.isImm && a.val >= tempBase && lastDef == rx - 1 && regText[lastDef].a == a.val) {
+                regText[lastDef].a = M;
+                vs[depth - 1].val = M;
+            }
+            else if (a.isImm)
+                emitReg(RLI, M, a.val, 0);
+            else if (a.val != M)
+                emitReg(RMOV, M, a.val, 0);
+            lastDef = -1;
+            break;
+        case 2: //OPR
+            if (M == 0) {
+                emitReg(RRTN, 0, 0, 0);
+                lastDef = -1;
+                break;
+            }
+            if (M == 11) {
+                a = vs[--depth];
+                t = tempBase + depth;
+                emitReg(RODD, t, regOperand(a, t), 0);
+            }
+            else {
+                b = vs[--depth];
+                a = vs[--depth];
+                t = tempBase + depth;
+                //the immediate has to be the right operand
+                if (a.isImm && !b.isImm && (M == 1 || M == 3 || M >= 5)) {
+                    vreg_t swap = a;
+                    a = b;
+                    b = swap;
+                    //mirror LSS/LEQ/GTR/GEQ
+                    if (M >= 7)
+                        M = M <= 8 ? M + 2 : M - 2;
+                }
+                if (a.isImm) {
+                    emitReg(RLI, t, a.val, 0);
+                    a.isImm = 0;
+                    a.val = t;
+                }
+                emitReg((b.isImm ? RADDI : RADD) + M - 1, t, a.val, b.val);
+            }
+            lastDef = rx - 1;
+            vs[depth].isImm = 0;
+            vs[depth++].val = t;
+            break;
+        case 5: //CAL
+            emitReg(RCAL, 0, L, M);
+            lastDef = -1;
+            break;
+        case 6: //INC, the temps go after the variables
+            tempBase = M;
+            emitReg(RINC, M + operandDepth(i + 1), 0, 0);
+            lastDef = -1;
+            break;
+        case 7: //JMP
+            emitReg(RJMP, 0, 0, M);
+            lastDef = -1;
+            break;
+        case 8: //JPC, fuse with the compare that produced the condition
+            a = vs[--depth];
+            if (a.isImm) {
+                if (a.val == 0)
+                    emitReg(RJMP, 0, 0, M);
+            }
+            else if (lastDef == rx - 1 && regText[lastDef].a == a.val
+                     && regText[lastDef].op >= REQL && regText[lastDef].op <= RGEQ) {
+                regText[lastDef].op = RBEQL + regText[lastDef].op - REQL;
+                regText[lastDef].a = regText[lastDef].b;
+                regText[lastDef].b = regText[lastDef].c;
+                regText[lastDef].c = M;
+            }
+            else if (lastDef == rx - 1 && regText[lastDef].a == a.val
+                     && regText[lastDef].op >= REQLI && regText[lastDef].op <= RGEQI) {
+                regText[lastDef].op = RBEQLI + regText[lastDef].op - REQLI;
+                regText[lastDef].a = regText[lastDef].b;
+                regText[lastDef].b = regText[lastDef].c;
+                regText[lastDef].c = M;
+            }
+            else
+                emitReg(RJZ, a.val, 0, M);
+            lastDef = -1;
+            break;
+        case 9: //SYS
+            if (M == 1) {
+                a = vs[--depth];
+                emitReg(RWRITE, regOperand(a, tempBase + depth), 0, 0);
+                lastDef = -1;
+            }
+            else if (M == 2) {
+                emitReg(RREAD, t, 0, 0);
+                lastDef = rx - 1;
+                vs[depth].isImm = 0;
+                vs[depth++].val = t;
+            }
+            else if (M == 3) {
+                emitReg(RHALT, 0, 0, 0);
+                lastDef = -1;
+            }
+            break;
+        }
+    }
+    regMap[cx] = rx;
+
+    //branch targets were left as stack pcs
+    for (int i = 0; i < rx; i++) {
+        int op = regText[i].op;
+        if (op == RJMP || op == RJZ || op == RCAL || (op >= RBEQL && op <= RBGEQI))
+            regText[i].c = regMap[(regText[i].c - 10) / 3];
+    }
+}
+
+void emitReg(int op, int a, int b, int c) {
+    regText = reserve(regText, &regCapacity, rx + 1, sizeof(reg_t));
+    regText[rx].op = op;
+    regText[rx].a = a;
+    regText[rx].b = b;
+    regText[rx].c = c;
+    rx++;
+}
+
+//returns a register holding v, loading an immediate into tmp first
+int regOperand(vreg_t v, int tmp) {
+    if (!v.isImm)
+        return v.val;
+    emitReg(RLI, tmp, v.val, 0);
+    return tmp;
+}
+
+//deepest operand stack of the statement code that starts at text[start] and runs to the block's RTN or halt
+int operandDepth(int start) {
+    int depth = 0;
+    int max = 0;
+    for (int i = start; i < cx; i++) {
+        int op = text[i].op;
+        int M = text[i].M;
+        if ((op == 2 && M == 0) || (op == 9 && M == 3))
+            break;
+        if (op == 1 || op == 3 || (op == 9 && M == 2))
+            depth++;
+        else if ((op == 2 && M != 11) || op == 4 || op == 8 || (op == 9 && M == 1))
+            depth--;
+        if (depth > max)
+            max = depth;
+    }
+    return max;
+}
+
+void printRegListing() {
+    for (int i = 0; i < rx; i++)
+        fprintf(listingFile, "%s %d %d %d\n", regNames[regText[i].op], regText[i].a, regText[i].b, regText[i].c);
+}
+
+void printSourceCode(){
+    fprintf(listingFile, "Source Program:\n\n");
 
-        return;
-    }
-    if (token_p == whilesym) {
-        token_p = getNextToken();
+    //straight from the mapped source
+    fwrite(source, 1, sourceLength, listingFile);
 
-        int loopIdx = cx;
+    fprintf(listingFile, "\n\n");
 
-        condition();
+    fprintf(listingFile, "No errors, program is syntactically correct\n\n");
+}
 
-        if (token_p != dosym)
-            error(12);  //ERROR: "while" must be followed by "do"
 
-        token_p = getNextToken();
+/************************************************************
+*
+*   NATIVE BACKEND FUNCTIONS
+*
+************************************************************/
 
-        int jpcIdx = cx;
-        emit(8, 0, 0);  //emit JPC
+//GNU assembler for x86-64 Linux, linked with pl0rt.c which owns pas, the display and the I/O
+//pl0_run uses the registers and the top of stack cache of vm.c's JIT, with asmOff and asmCached
+//for jitOff and jitCached. Only r15 differs: it points at pl0_pcs, a table of offsets from
+//itself, and a return to a pc that is not a leader ends the run instead of getting a stub.
+void writeAssembly(FILE* file) {
+    static const char* compareOps[] = {"sete", "setne", "setl", "setle", "setg", "setge"}; // EQL .. GEQ
+    char* leader = arenaAlloc(cx + 1);
+    int end = cx * 3 + 10;
+
+    asmFile = file;
+    asmOff = 0;
+    asmCached = 0;
+
+    //blocks start at jump targets, return points and the entry, the cache is empty there
+    markLeaders(leader);
+    leader[0] = 1;
+    for (int i = 0; i < cx; i++)
+        if (text[i].op == 5 || text[i].op == 13)
+            leader[i + 1] = 1;
+
+    fprintf(file, "\t.text\n\t.globl pl0_run\n\t.type pl0_run, @function\n");
+    fprintf(file, "//int pl0_run(int* pas, int* display), returns 1 if pc leaves the text\n");
+    fprintf(file, "pl0_run:\n");
+    fprintf(file, "\tpushq %%rbp\n\tpushq %%rbx\n\tpushq %%r12\n\tpushq %%r13\n\tpushq %%r14\n\tpushq %%r15\n");
+    fprintf(file, "\tsubq $8, %%rsp\n");
+    fprintf(file, "\tmovq %%rdi, %%rbx\n\tmovq %%rsi, %%r14\n\tleaq pl0_pcs(%%rip), %%r15\n");
+    fprintf(file, "\tmovq $%d, %%r12\n\tmovq $%d, %%r13\n", ASM_PAS_SIZE, ASM_PAS_SIZE - 1);
+    fprintf(file, "\tjmp .Lpc10\n");
+    fprintf(file, ".Lhalt:\n\txorl %%eax, %%eax\n");
+    fprintf(file, ".Lexit:\n\taddq $8, %%rsp\n");
+    fprintf(file, "\tpopq %%r15\n\tpopq %%r14\n\tpopq %%r13\n\tpopq %%r12\n\tpopq %%rbx\n\tpopq %%rbp\n\tret\n");
+    fprintf(file, ".Lend:\n\tmovl $1, %%eax\n\tjmp .Lexit\n");
+    //RTN leaves the return address in rax
+    fprintf(file, ".Lreturn:\n\tcmpq $%d, %%rax\n\tja .Lend\n", end);
+    fprintf(file, "\tmovslq (%%r15,%%rax,4), %%rdx\n\taddq %%r15, %%rdx\n\tjmp *%%rdx\n");
 
-        statement();
+    for (int i = 0; i < cx; i++) {
+        int op = text[i].op;
+        int L = text[i].L;
+        int M = text[i].M;
+        const char* frame;
 
-        emit(7, 0, loopIdx * 3 + 10);    //emit JMP
+        if (leader[i]) {
+            asmFlush();
+            asmCached = 0;
+        }
+        fprintf(file, ".Lpc%d:\n", i * 3 + 10);
 
-        text[jpcIdx].M = cx * 3 + 10;
-        return;
+        switch (op) {
+        case 1: //LIT
+            asmPushPrep();
+            fprintf(file, "\tmovl $%d, %%eax\n", M);
+            asmPush();
+            break;
+        case 2: //OPR
+            if (M == 0) {
+                asmReturn();
+                asmOff = asmCached = 0;
+            }
+            else if (M >= 1 && M <= 10) {
+                asmLoad(2);
+                if (M == 1)
+                    fprintf(file, "\taddl %%ecx, %%eax\n");
+                else if (M == 2)
+                    fprintf(file, "\tsubl %%eax, %%ecx\n\tmovl %%ecx, %%eax\n");
+                else if (M == 3)
+                    fprintf(file, "\timull %%ecx, %%eax\n");
+                else if (M == 4)
+                    fprintf(file, "\tmovl %%eax, %%esi\n\tmovl %%ecx, %%eax\n\tcltd\n\tidivl %%esi\n");
+                else
+                    fprintf(file, "\tcmpl %%eax, %%ecx\n\t%s %%al\n\tmovzbl %%al, %%eax\n", compareOps[M - 5]);
+                fprintf(file, "\tmovl %%eax, %d(%%rbx,%%r12,4)\n", 4 * (asmOff + 1));
+                asmOff++;
+                asmCached = 1;
+            }
+            else if (M == 11) {
+                asmLoad(1);
+                fprintf(file, "\tandl $1, %%eax\n\tmovl %%eax, %d(%%rbx,%%r12,4)\n", 4 * asmOff);
+            }
+            break;
+        case 3: //LOD
+            asmPushPrep();
+            frame = asmFrame(L);
+            fprintf(file, "\tmovl %d(%%rbx,%s,4), %%eax\n", -4 * M, frame);
+            asmPush();
+            break;
+        case 4: //STO
+        case 10: //STK
+            asmLoad(1);
+            frame = asmFrame(L);
+            fprintf(file, "\tmovl %%eax, %d(%%rbx,%s,4)\n", -4 * M, frame);
+            if (op == 4) {
+                asmOff++;
+                asmCached = 0;
+            }
+            else
+                asmCached = 1;
+            break;
+        case 5: //CAL
+        case 13: //CLX
+            asmFlush();
+            if (op == 13)
+                fprintf(file, "\tmovl %d(%%r14), %%edx\n", 4 * L);
+            else if (strcmp(asmFrame(L), "%r13") == 0)
+                fprintf(file, "\tmovl %%r13d, %%edx\n");
+            fprintf(file, "\tmovl %%edx, -4(%%rbx,%%r12,4)\n");
+            fprintf(file, "\tmovl %%r13d, -8(%%rbx,%%r12,4)\n");
+            fprintf(file, "\tmovl $%d, -12(%%rbx,%%r12,4)\n", (i + 1) * 3 + 10);
+            fprintf(file, "\tleaq -1(%%r12), %%r13\n");
+            fprintf(file, "\tjmp .Lpc%d\n", M);
+            asmCached = 0;
+            break;
+        case 6: //INC
+            asmOff -= M;
+            asmCached = 0;
+            break;
+        case 7: //JMP
+            asmFlush();
+            fprintf(file, "\tjmp .Lpc%d\n", M);
+            asmCached = 0;
+            break;
+        case 8: //JPC
+            asmLoad(1);
+            fprintf(file, "\ttestl %%eax, %%eax\n");
+            asmOff++;
+            asmFlush();
+            fprintf(file, "\tje .Lpc%d\n", M);
+            if (asmCached == 2)
+                fprintf(file, "\tmovl %%ecx, %%eax\n");
+            asmCached = asmCached == 2 ? 1 : 0;
+            break;
+        case 9: //SYS
+            if (M == 1) {
+                asmLoad(1);
+                fprintf(file, "\tmovl %%eax, %%edi\n\tcall pl0_write@PLT\n");
+                asmOff++;
+                asmCached = 0;
+            }
+            else if (M == 2) {
+                fprintf(file, "\tleaq %d(%%rbx,%%r12,4), %%rdi\n\tcall pl0_read@PLT\n", 4 * (asmOff - 1));
+                asmOff--;
+                asmCached = 0;
+            }
+            else if (M == 3) {
+                fprintf(file, "\tjmp .Lhalt\n");
+                asmOff = asmCached = 0;
+            }
+            break;
+        case 11: //LDX
+            asmPushPrep();
+            fprintf(file, "\tmovslq %d(%%r14), %%rdx\n\tmovl %d(%%rbx,%%rdx,4), %%eax\n", 4 * L, -4 * M);
+            asmPush();
+            break;
+        case 12: //STX
+            asmLoad(1);
+            fprintf(file, "\tmovslq %d(%%r14), %%rdx\n\tmovl %%eax, %d(%%rbx,%%rdx,4)\n", 4 * L, -4 * M);
+            asmOff++;
+            asmCached = 0;
+            break;
+        case 14: //DEN
+            fprintf(file, "\tmovl %d(%%r14), %%edx\n\tmovl %%edx, %d(%%rbx,%%r13,4)\n", 4 * L, -4 * M);
+            fprintf(file, "\tmovl %%r13d, %d(%%r14)\n", 4 * L);
+            asmCached = 0;
+            break;
+        case 15: //DRT
+            fprintf(file, "\tmovl %d(%%rbx,%%r13,4), %%edx\n\tmovl %%edx, %d(%%r14)\n", -4 * M, 4 * L);
+            asmReturn();
+            asmOff = asmCached = 0;
+            break;
+        }
     }
-    if (token_p == readsym) {
-        token_p = getNextToken();
+    //falling off the end, or a jump just past the last instruction
+    asmFlush();
+    fprintf(file, ".Lpc%d:\n\tjmp .Lend\n", end);
+    fprintf(file, "\t.size pl0_run, .-pl0_run\n");
+
+    //return addresses are pcs, each entry is an offset from the table
+    fprintf(file, "\t.section .rodata\n\t.align 4\npl0_pcs:\n");
+    for (int pc = 0; pc <= end; pc++) {
+        int i = (pc - 10) / 3;
+        if (pc >= 10 && (pc - 10) % 3 == 0 && i < cx && leader[i])
+            fprintf(file, "\t.long .Lpc%d-pl0_pcs\n", pc);
+        else
+            fprintf(file, "\t.long .Lend-pl0_pcs\n");
+    }
+    fprintf(file, "\t.section .note.GNU-stack,\"\",@progbits\n");
+}
 
-        if (token_p != identsym)
-            error(2); //ERROR: const, var, and read keywords must be followed by identifier
+//asmFlush .. asmFrame print what jitFlush .. jitFrame in vm.c assemble
+void asmFlush() {
+    if (asmOff != 0)
+        fprintf(asmFile, "\tleaq %d(%%r12), %%r12\n", asmOff);
+    asmOff = 0;
+}
 
-        char* name = getNextIdentifier();
+void asmLoad(int n) {
+    if (asmCached < 1)
+        fprintf(asmFile, "\tmovl %d(%%rbx,%%r12,4), %%eax\n", 4 * asmOff);
+    if (n == 2 && asmCached < 2)
+        fprintf(asmFile, "\tmovl %d(%%rbx,%%r12,4), %%ecx\n", 4 * (asmOff + 1));
+    if (asmCached < n)
+        asmCached = n;
+}
 
-        int symIdx = symbolTableCheck(name);
+void asmPushPrep() {
+    if (asmCached >= 1)
+        fprintf(asmFile, "\tmovl %%eax, %%ecx\n");
+    asmCached = asmCached >= 1 ? 2 : 1;
+}
 
-        if (symIdx == -1)
-            error(7); //ERROR: undeclared identifier
+void asmPush() {
+    fprintf(asmFile, "\tmovl %%eax, %d(%%rbx,%%r12,4)\n", 4 * (asmOff - 1));
+    asmOff--;
+}
 
-        if (symbol_table[symIdx].kind != 2)
-            error(8); //ERROR: only variable values may be altered
+//returns the register's name
+const char* asmFrame(int L) {
+    if (L <= 0)
+        return "%r13";
+    fprintf(asmFile, "\tmovslq (%%rbx,%%r13,4), %%rdx\n");
+    while (--L > 0)
+        fprintf(asmFile, "\tmovslq (%%rbx,%%rdx,4), %%rdx\n");
+    return "%rdx";
+}
 
-        token_p = getNextToken();
-        emit(9, 0, 2); //emit READ
-        emit(4, lev - symbol_table[symIdx].level, symbol_table[symIdx].addr); //emit STO
-        return;
+//RTN, .Lreturn checks the address and looks it up in pl0_pcs
+void asmReturn() {
+    fprintf(asmFile, "\tmovslq -8(%%rbx,%%r13,4), %%rax\n");
+    fprintf(asmFile, "\tleaq 1(%%r13), %%r12\n");
+    fprintf(asmFile, "\tmovslq -4(%%rbx,%%r13,4), %%r13\n");
+    fprintf(asmFile, "\tjmp .Lreturn\n");
+}
+
+/************************************************************
+*
+*   ARENA FUNCTIONS
+*
+************************************************************/
+
+//bumps bytes out of the current chunk, starting a chunk twice the size of the last one when it is full
+void* arenaAlloc(size_t bytes) {
+    bytes = (bytes + 15) & ~(size_t)15;
+    if (arena == NULL || arena->used + bytes > arena->size) {
+        size_t size = arena == NULL ? ARENA_CHUNK_MIN : arena->size * 2;
+        while (size < bytes)
+            size *= 2;
+        arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + size);
+        if (chunk == NULL)
+            error(PL0_OUT_OF_MEMORY);
+        chunk->next = arena;
+        chunk->size = size;
+        chunk->used = 0;
+        arena = chunk;
+        arenaReserved += sizeof(arena_chunk_t) + size;
+        arenaChunks++;
     }
-    if (token_p == writesym) {
-        token_p = getNextToken();
-        expression();
-        emit(9, 0, 1); //emit WRITE
-        return;
+    void* p = arena->data + arena->used;
+    arena->used += bytes;
+    arenaUsed += bytes;
+    arenaAllocs++;
+    return p;
+}
+
+//grows an allocation, in place if it is the newest one in the current chunk and there is room
+void* arenaResize(void* old, size_t oldBytes, size_t newBytes) {
+    oldBytes = (oldBytes + 15) & ~(size_t)15;
+    newBytes = (newBytes + 15) & ~(size_t)15;
+    if (old != NULL && arena != NULL && (char*)old + oldBytes == arena->data + arena->used
+        && arena->used - oldBytes + newBytes <= arena->size) {
+        arena->used += newBytes - oldBytes;
+        arenaUsed += newBytes - oldBytes;
+        tableGrowsInPlace++;
+        return old;
     }
+    void* p = arenaAlloc(newBytes);
+    if (old != NULL)
+        memcpy(p, old, oldBytes);
+    return p;
 }
 
-void condition() {
-    if (token_p == oddsym) {
-        token_p = getNextToken();
-        expression();
-        emit(2, 0, 11); //emit ODD
+//returns table with room for need elements, doubling its capacity as often as it takes
+void* reserve(void* table, int* capacity, int need, size_t elemSize) {
+    if (need <= *capacity)
+        return table;
+    int newCapacity = *capacity > 0 ? *capacity : 16;
+    while (newCapacity < need)
+        newCapacity *= 2;
+    table = arenaResize(table, *capacity * elemSize, newCapacity * elemSize);
+    if (*capacity > 0)
+        tableGrows++;
+    *capacity = newCapacity;
+    return table;
+}
+
+//frees every table at once
+void arenaFree() {
+    while (arena != NULL) {
+        arena_chunk_t* next = arena->next;
+        free(arena);
+        arena = next;
     }
-    else {
-        expression();
-        if (token_p == eqsym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 5); //emit EQL
-        }
-        else if (token_p == neqsym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 6); //emit NEQ
-        }
-        else if (token_p == lessym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 7); //emit LSS
-        }
-        else if (token_p == leqsym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 8); //emit LEQ
-        }
-        else if (token_p == gtrsym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 9); //emit GTR
-        }
-        else if (token_p == geqsym) {
-            token_p = getNextToken();
-            expression();
-            emit(2, 0, 10); //emit GEQ
-        }
-        else
-            error(13); //ERROR: condition must contain comparison operator
+}
+
+void printMemReport() {
+    struct rusage usage;
+
+    fprintf(listingFile, "\nMemory report:\n");
+    fprintf(listingFile, "  %-22s%zu bytes in %d chunks\n", "arena peak", arenaReserved, arenaChunks);
+    fprintf(listingFile, "  %-22s%zu bytes in %d allocations\n", "arena used", arenaUsed, arenaAllocs);
+    fprintf(listingFile, "  %-22s%d (%d in place)\n", "table growths", tableGrows, tableGrowsInPlace);
+    fprintf(listingFile, "  %-22s%d tokens, %d identifiers, %d instructions, %d symbol slots\n", "tables",
+           tokenTotal, identifierTotal, cx, symbolCapacity);
+    //the old layout took a token word per token plus one per number value and an atom word per
+    //identifier, and copied every distinct name into 12 bytes; now each atom is a source span
+    if (tokenTotal > 0) {
+        double before = (4.0 * (tokenTotal + numberTotal + identifierTotal) + 12.0 * atomCount) / tokenTotal;
+        double after = ((double)sizeof(token_t) * tokenTotal + 2.0 * sizeof(int) * atomCount) / tokenTotal;
+        fprintf(listingFile, "  %-22s%.1f bytes before, %.1f bytes packed, %d token queue slots\n", "per token",
+               before, after, tokenCapacity);
     }
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        fprintf(listingFile, "  %-22s%ld KiB\n", "peak resident set", usage.ru_maxrss);
 }
 
-void expression() {
-    term();
+/************************************************************
+*
+*   TIME REPORT FUNCTIONS
+*
+************************************************************/
 
-    //stay in loop while we do addition or subtraction
-    while (token_p == plussym || token_p == minussym) {
-        if (token_p == plussym) {
-            token_p = getNextToken();
+void phaseStart() {
+    clock_gettime(CLOCK_MONOTONIC, &phaseWallStart);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &phaseCpuStart);
+}
 
-            term();
-            emit(2, 0, 1); //ADD
-        }
-        else {
-            token_p = getNextToken();
+//adds the time since phaseStart to phase
+void phaseEnd(int phase) {
+    struct timespec wall;
+    struct timespec cpu;
 
-            term();
-            emit(2, 0, 2); //SUB
-        }
-    }
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    phaseWall[phase] += (wall.tv_sec - phaseWallStart.tv_sec) + (wall.tv_nsec - phaseWallStart.tv_nsec) / 1e9;
+    phaseCpu[phase] += (cpu.tv_sec - phaseCpuStart.tv_sec) + (cpu.tv_nsec - phaseCpuStart.tv_nsec) / 1e9;
 }
 
-void term() {
-    factor();
-    //stay in loop while we do division or multiplication
-    while (token_p == multsym || token_p == slashsym) {
-        if (token_p == multsym) {
-            token_p = getNextToken();
-
-            factor();
-            emit(2, 0, 3);  //emit MUL
+void printTimeReport() {
+    double wall = 0;
+    double cpu = 0;
+
+    fprintf(listingFile, "\nTime report:\n");
+    fprintf(listingFile, "  %-10s%12s%12s\n", "phase", "wall (s)", "cpu (s)");
+    for (int p = 0; p < PHASES; p++) {
+        fprintf(listingFile, "  %-10s%12.6f%12.6f  ", phaseNames[p], phaseWall[p], phaseCpu[p]);
+        wall += phaseWall[p];
+        cpu += phaseCpu[p];
+        switch (p) {
+        case PHASE_SCAN:
+            fprintf(listingFile, "%d tokens, %d identifiers\n", tokenTotal, identifierTotal);
+            break;
+        case PHASE_PARSE:
+            fprintf(listingFile, "%d symbols inserted, %d lookups, %d instructions, block depth %d, expression depth %d\n",
+                   symbolInserts, symbolLookups, parsedInstructions, maxLevel, maxExprDepth);
+            break;
+        case PHASE_OPTIMIZE:
+            fprintf(listingFile, "%d instructions left\n", regIsa ? rx : cx);
+            for (int q = 0; q < OPT_PASSES; q++) {
+                if (optPasses[q].ran)
+                    fprintf(listingFile, "    %-10s%10.6f%12.6f  %d -> %d instructions\n", optPasses[q].name,
+                            optPasses[q].wall, optPasses[q].cpu, optPasses[q].before, optPasses[q].after);
+            }
+            break;
+        case PHASE_OUTPUT:
+            fprintf(listingFile, "%ld bytes written\n", outputBytes);
+            break;
         }
-        else if (token_p == slashsym) {
-            token_p = getNextToken();
+    }
+    fprintf(listingFile, "  %-10s%12.6f%12.6f\n", "total", wall, cpu);
+}
 
-            factor();
-            emit(2, 0, 4);  //emit DIV
+//one object per phase with its times and counts, for tracking over time
+void writeTimeReportJson(const char* fname) {
+    FILE* file = fopen(fname, "w");
+    if (file == NULL) {
+        fprintf(listingFile, "cannot create %s\n", fname);
+        return;
+    }
+    fprintf(file, "{\n");
+    for (int p = 0; p < PHASES; p++) {
+        fprintf(file, "  \"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f", phaseNames[p], phaseWall[p], phaseCpu[p]);
+        switch (p) {
+        case PHASE_SCAN:
+            fprintf(file, ", \"tokens\": %d, \"identifiers\": %d},\n", tokenTotal, identifierTotal);
+            break;
+        case PHASE_PARSE:
+            fprintf(file, ", \"symbols_inserted\": %d, \"symbol_lookups\": %d, \"instructions\": %d, \"max_block_depth\": %d, \"max_expression_depth\": %d},\n",
+                    symbolInserts, symbolLookups, parsedInstructions, maxLevel, maxExprDepth);
+            break;
+        case PHASE_OPTIMIZE:
+            fprintf(file, ", \"instructions\": %d, \"passes\": {", regIsa ? rx : cx);
+            for (int q = 0, first = 1; q < OPT_PASSES; q++) {
+                if (!optPasses[q].ran)
+                    continue;
+                fprintf(file, "%s\"%s\": {\"wall_s\": %.6f, \"cpu_s\": %.6f, \"instructions_in\": %d, \"instructions_out\": %d}",
+                        first ? "" : ", ", optPasses[q].name, optPasses[q].wall, optPasses[q].cpu, optPasses[q].before,
+                        optPasses[q].after);
+                first = 0;
+            }
+            fprintf(file, "}},\n");
+            break;
+        case PHASE_OUTPUT:
+            fprintf(file, ", \"bytes\": %ld}\n", outputBytes);
+            break;
         }
     }
+    fprintf(file, "}\n");
+    fclose(file);
 }
 
-void factor() {
-
-    if (token_p == identsym) {
-        char* name = getNextIdentifier();
-        int symIdx = symbolTableCheck(name);
-
-        //identifier hasnt been declared
-        if (symIdx == -1)
-            error(7);   //ERROR: undeclared identifier
+/************************************************************
+*
+*   SERVER FUNCTIONS
+*
+************************************************************/
 
-        //either constant or variable, NO procedures
-        if (symbol_table[symIdx].kind == 1)                     //ERROR IF IT IS PROCEDURE
-            emit(1, 0, symbol_table[symIdx].val);   //emit LIT
-        else if(symbol_table[symIdx].kind == 3)
-            error(25);  //ERROR: expression must not contain a procedure identifier
+#ifndef PL0_LIBRARY
+//compiler --server [-j workers] [--cache entries] [socket], serves requests until it is killed
+int runServer(int argc, const char* argv[]) {
+    const char* path = getenv("PL0_SOCKET") != NULL ? getenv("PL0_SOCKET") : SERVER_SOCKET;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    struct sockaddr_un address;
+    pthread_t thread;
+
+    for (int a = 2; a < argc; a++) {
+        if (strcmp(argv[a], "-j") == 0 && a + 1 < argc)
+            workers = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--cache") == 0 && a + 1 < argc)
+            cacheCapacity = atoi(argv[++a]);
         else
-            emit(3, lev - symbol_table[symIdx].level, symbol_table[symIdx].addr);  //emit LOD
+            path = argv[a];
+    }
+    if (workers <= 0)
+        workers = 1;
+    if (cacheCapacity < 0)
+        cacheCapacity = 0;
+    cache = calloc(cacheCapacity + 1, sizeof(cache_entry_t));
+    if (cache == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
 
-        token_p = getNextToken();
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        return 1;
     }
-    else if (token_p == numbersym) {
-        token_p = getNextToken();
-        emit(1, 0, token_p);    //emit LIT
-        token_p = getNextToken();
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    //a socket left behind by a server that was killed is replaced
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(listener, SERVER_BACKLOG) != 0) {
+        fprintf(stderr, "cannot listen on %s\n", path);
+        return 1;
     }
-    else if (token_p == lparentsym) {
-        token_p = getNextToken();
-        expression();
-        if (token_p != rparentsym)
-            error(14);  //ERROR: right parenthesis must follow left parenthesis
-        token_p = getNextToken();
+    //a client that goes away mid-response must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+    for (int w = 0; w < workers; w++) {
+        if (pthread_create(&thread, NULL, serverWorker, NULL) != 0) {
+            fprintf(stderr, "cannot start worker %d\n", w);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "listening on %s with %d workers, caching %d results\n", path, workers, cacheCapacity);
+
+    for (;;) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_mutex_lock(&serverLock);
+        while (serverQueueCount == SERVER_QUEUE)
+            pthread_cond_wait(&serverNotFull, &serverLock);
+        serverQueue[(serverQueueHead + serverQueueCount++) % SERVER_QUEUE] = fd;
+        pthread_cond_signal(&serverNotEmpty);
+        pthread_mutex_unlock(&serverLock);
     }
-    else
-        error(15);  //ERROR: arithmetic equations must contain operands, parentheses, numbers or symbols
 }
 
-void printSymbolTable() {
-    printf("\nKind | Name        | Value | Level | Address | Mark\n"
-        "---------------------------------------------------\n");
-    for (int i = 0; i < tp; i++) {
-        printf("%4d |%12s |%6d |%6d |%8d |%4d\n", symbol_table[i].kind, symbol_table[i].name,
-               symbol_table[i].val, symbol_table[i].level, symbol_table[i].addr, symbol_table[i].mark);
+//takes connections off the queue one at a time, its compiles use this thread's tables
+void* serverWorker(void* arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&serverLock);
+        while (serverQueueCount == 0)
+            pthread_cond_wait(&serverNotEmpty, &serverLock);
+        int fd = serverQueue[serverQueueHead];
+        serverQueueHead = (serverQueueHead + 1) % SERVER_QUEUE;
+        serverQueueCount--;
+        pthread_cond_signal(&serverNotFull);
+        pthread_mutex_unlock(&serverLock);
+
+        serveConnection(fd);
+        close(fd);
     }
+    return NULL;
 }
 
-//print to stdout and create elf file
-void produceElfAndOut() {
-    FILE* file = fopen("elf.txt", "w");
-    for (int i = 0; i < cx; i++) {
-        fprintf(file, "%d %d %d\n", text[i].op, text[i].L, text[i].M);
+//reads one request, answers it from the cache or by compiling, and writes the response
+void serveConnection(int fd) {
+    server_request_t request;
+    const char* argv[SERVER_MAX_ARGS / 2 + 2];
+    int argc = 1;
+    const char* outName = NULL;
+    pl0_ctx_t ctx;
+    pl0_result_t result;
+    char* out = NULL;
+    char* err = NULL;
+    size_t outSize = 0;
+    size_t errSize = 0;
+    char* response;
+    size_t responseSize;
+
+    if (readAll(fd, &request, sizeof(request)) != 0 || memcmp(request.magic, SERVER_MAGIC, 4) != 0
+        || request.version != SERVER_VERSION || request.argsSize > SERVER_MAX_ARGS || request.sourceSize > INT32_MAX)
+        return;
+    //the key is the request as it came in, options included, so different flags never share an entry
+    size_t keySize = sizeof(request) + request.argsSize + request.sourceSize;
+    char* key = malloc(keySize + 1);
+    if (key == NULL)
+        return;
+    memcpy(key, &request, sizeof(request));
+    if (readAll(fd, key + sizeof(request), keySize - sizeof(request)) != 0) {
+        free(key);
+        return;
     }
-    for (int i = 0; i < cx; i++) {
-        int op = text[i].op;
-        switch (op) {
-        case 1:
-            printf("%s", "LIT");
-            break;
-        case 2:
-            switch (text[i].M) {
-            case 0:
-                printf("%s", "RTN");
-                break;
-            case 1:
-                printf("%s", "ADD");
-                break;
-            case 2:
-                printf("%s", "SUB");
-                break;
-            case 3:
-                printf("%s", "MUL");
-                break;
-            case 4:
-                printf("%s", "DIV");
-                break;
-            case 5:
-                printf("%s", "EQL");
-                break;
-            case 6:
-                printf("%s", "NEQ");
-                break;
-            case 7:
-                printf("%s", "LSS");
-                break;
-            case 8:
-                printf("%s", "LEQ");
-                break;
-            case 9:
-                printf("%s", "GTR");
-                break;
-            case 10:
-                printf("%s", "GEQ");
-                break;
-            case 11:
-                printf("%s", "ODD");
-            }
-            break;
-        case 3:
-            printf("%s", "LOD");
-            break;
-        case 4:
-            printf("%s", "STO");
-            break;
-        case 5:
-            printf("%s", "CAL");
-            break;
-        case 6:
-            printf("%s", "INC");
-            break;
-        case 7:
-            printf("%s", "JMP");
-            break;
-        case 8:
-            printf("%s", "JPC");
-            break;
-        case 9:
-            printf("SYS");
-            break;
+    char* args = key + sizeof(request);
+    const char* src = args + request.argsSize;
+    uint64_t hash = hashBytes(key, keySize);
+
+    //split the options, a last one without its NUL is ignored; an empty option is a bad request,
+    //without them each option takes two bytes at least and argv cannot overflow
+    argv[0] = "pl0";
+    for (size_t i = 0, start = 0; i < request.argsSize; i++) {
+        if (args[i] != '\0')
+            continue;
+        if (i == start || argc >= (int)(sizeof(argv) / sizeof(argv[0]))) {
+            free(key);
+            return;
         }
-        printf(" %d %d\n", text[i].L, text[i].M);
+        argv[argc++] = args + start;
+        start = i + 1;
+    }
+    FILE* errFile = open_memstream(&err, &errSize);
+    FILE* outFile = open_memstream(&out, &outSize);
+    if (errFile == NULL || outFile == NULL) {
+        free(key);
+        return;
+    }
+    //the source comes with the request, a file named among the options is ignored
+    const char* files[argc];
+    parseOptions(argc, argv, &ctx, files, &outName, errFile);
+    fclose(errFile);
+
+    //reports carry times and memory sizes and --incremental reads a file, so only plain compiles are cached
+    int cacheable = !ctx.timeReport && ctx.timeReportJson == NULL && !ctx.memReport && !ctx.lexerBench
+        && !ctx.symbolBench && ctx.incremental == NULL && cacheCapacity > 0;
+    if (cacheable && cacheLookup(hash, key, keySize, &response, &responseSize)) {
+        fclose(outFile);
+        free(out);
+        free(err);
+        free(key);
+        writeAll(fd, response, responseSize);
+        free(response);
+        return;
     }
-}
 
-void printSourceCode(FILE *file){
-    fseek(file, 0, SEEK_SET);
+    int status = compileSource(&ctx, src, request.sourceSize, outFile, &result);
+    fclose(outFile);
+    if (outName == NULL)
+        outName = defaultOutName(ctx.format);
+    response = buildResponse(status, out, outSize, err, errSize, result.output != NULL ? outName : "",
+                             result.output, result.outputSize, &responseSize);
+    pl0_free_result(&result);
+    free(out);
+    free(err);
+    if (response == NULL) {
+        free(key);
+        return;
+    }
+    if (cacheable)
+        cacheStore(hash, key, keySize, response, responseSize);
+    else
+        free(key);
+    writeAll(fd, response, responseSize);
+    free(response);
+}
 
-    char code;
-    printf("Source Program:\n\n");
+//server_response_t followed by its payload in one buffer
+char* buildResponse(int status, const char* out, size_t outSize, const char* err, size_t errSize,
+                    const char* name, const char* output, size_t outputSize, size_t* size) {
+    server_response_t header;
+    size_t nameSize = strlen(name);
+
+    memcpy(header.magic, SERVER_MAGIC, 4);
+    header.status = status;
+    header.cached = 0;
+    header.stdoutSize = outSize;
+    header.stderrSize = errSize;
+    header.nameSize = nameSize;
+    header.outputSize = outputSize;
+    *size = sizeof(header) + outSize + errSize + nameSize + outputSize;
+    char* response = malloc(*size);
+    if (response == NULL)
+        return NULL;
+    char* p = response;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, out, outSize);
+    p += outSize;
+    memcpy(p, err, errSize);
+    p += errSize;
+    memcpy(p, name, nameSize);
+    p += nameSize;
+    if (outputSize > 0)
+        memcpy(p, output, outputSize);
+    return response;
+}
 
-    while(fscanf(file, "%c", &code) == 1)
-        printf("%c", code);
+//copies the cached response for the request into a new buffer, marked as cached
+//returns 0 if the request has not been seen
+int cacheLookup(uint64_t hash, const char* key, size_t keySize, char** response, size_t* responseSize) {
+    int found = 0;
+
+    pthread_mutex_lock(&cacheLock);
+    for (int i = 0; i < cacheCount; i++) {
+        cache_entry_t* entry = &cache[i];
+        if (entry->hash != hash || entry->keySize != keySize || memcmp(entry->key, key, keySize) != 0)
+            continue;
+        *response = malloc(entry->responseSize);
+        if (*response != NULL) {
+            memcpy(*response, entry->response, entry->responseSize);
+            *responseSize = entry->responseSize;
+            ((server_response_t*)*response)->cached = 1;
+            entry->lastUsed = ++cacheClock;
+            found = 1;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cacheLock);
+    return found;
+}
 
-    printf("\n\n");
+//keeps a copy of the response under key, which the cache takes over
+void cacheStore(uint64_t hash, char* key, size_t keySize, const char* response, size_t responseSize) {
+    char* copy = malloc(responseSize);
+    if (copy == NULL) {
+        free(key);
+        return;
+    }
+    memcpy(copy, response, responseSize);
+
+    pthread_mutex_lock(&cacheLock);
+    int slot = cacheCount;
+    //full, or two workers compiled the same request at once: reuse the oldest or the same entry
+    for (int i = 0; i < cacheCount; i++) {
+        if (cache[i].hash == hash && cache[i].keySize == keySize && memcmp(cache[i].key, key, keySize) == 0) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == cacheCount && cacheCount == cacheCapacity) {
+        slot = 0;
+        for (int i = 1; i < cacheCount; i++) {
+            if (cache[i].lastUsed < cache[slot].lastUsed)
+                slot = i;
+        }
+    }
+    if (slot < cacheCount) {
+        free(cache[slot].key);
+        free(cache[slot].response);
+    }
+    else
+        cacheCount++;
+    cache[slot].hash = hash;
+    cache[slot].key = key;
+    cache[slot].keySize = keySize;
+    cache[slot].response = copy;
+    cache[slot].responseSize = responseSize;
+    cache[slot].lastUsed = ++cacheClock;
+    pthread_mutex_unlock(&cacheLock);
+}
 
-    printf("No errors, program is syntactically correct\n\n");
+//returns -1 if the connection ends or fails first
+int readAll(int fd, void* buffer, size_t length) {
+    char* p = buffer;
+    while (length > 0) {
+        ssize_t got = read(fd, p, length);
+        if (got <= 0)
+            return -1;
+        p += got;
+        length -= got;
+    }
+    return 0;
 }
 
+int writeAll(int fd, const void* buffer, size_t length) {
+    const char* p = buffer;
+    while (length > 0) {
+        ssize_t put = write(fd, p, length);
+        if (put <= 0)
+            return -1;
+        p += put;
+        length -= put;
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,90 @@
+//Library interface of compiler.c, for compiling PL/0 without the command line
+//
+//  pl0_ctx_t ctx;
+//  pl0_result_t result;
+//  pl0_init(&ctx);
+//  if (pl0_compile(&ctx, src, len, &result) == 0)
+//      ... result.code, result.output ...
+//  else
+//      ... result.diagnostic ...
+//  pl0_free_result(&result);
+//
+//pl0_link merges objects compiled with format PL0_OBJECT into one program, written in the
+//context's format like pl0_compile's output.
+//
+//Build compiler.c with -DPL0_LIBRARY to leave out main. pl0_compile never exits or prints
+//unless the context asks for a listing or a report, and it may run on any number of threads
+//at once: the compiler's tables are thread local and start empty on every call.
+
+#ifndef PL0_H
+#define PL0_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//output formats
+#define PL0_IMAGE 0 // binary image for the VM (see pl0image.h)
+#define PL0_TEXT 1 // "op L M" per line, the VM's text format
+#define PL0_ASM 2 // x86-64 assembly to link with pl0rt.c
+#define PL0_OBJECT 3 // relocatable object for pl0_link (see pl0object.h)
+
+//diagnostic ids past the parser's own (1 .. 28)
+#define PL0_OUT_OF_MEMORY 29
+#define PL0_SOURCE_TOO_LARGE 30
+#define PL0_BAD_OBJECT 31 // pl0_link's errors
+#define PL0_UNDEFINED_PROCEDURE 32
+#define PL0_DUPLICATE_PROCEDURE 33
+#define PL0_DISPLAY_OBJECT 34 // --display object linked for the register ISA
+
+typedef struct
+{
+    int format; // PL0_IMAGE, PL0_TEXT, PL0_ASM or PL0_OBJECT
+    int regIsa; // 1 for the register ISA, ignored with PL0_ASM
+    int peepholeWindow; // longest peephole rule to apply, 0 turns the pass off
+    int deadCode; // 1 to thread jumps and drop unreachable code and procedures, ignored with PL0_OBJECT
+    int optLevel; // 2 adds value numbering and loop optimization over an IR of the whole program, ignored with PL0_OBJECT
+    int foldConstants; // 0 to emit every operation and branch as written
+    int useDisplay; // 1 to reach outer frames through the VM's display, ignored with regIsa
+    int legacyLexer; // 1 for the original character-pair scanner
+    const char* incremental; // file keeping each procedure's code for the next compile, NULL for none
+    //what the command line prints, all off after pl0_init
+    FILE* out; // where the listing and reports go, stdout if NULL
+    int listing; // source and instruction listing
+    int peepholeStats;
+    int deadCodeReport;
+    int memReport;
+    int timeReport;
+    const char* timeReportJson; // file to write the time report to as JSON, NULL for none
+    int lexerBench; // time both scanners instead of compiling
+    int symbolBench; // time the program's symbol lookups instead of emitting code
+    int incrementalReport; // how many procedures the incremental file saved compiling
+} pl0_ctx_t;
+
+typedef struct
+{
+    int id; // error number, 1 .. 28 from the parser or one of the above
+    char message[128]; // what the CLI prints after "Error: "
+    size_t offset; // of the token the parser was at, in the source
+    int line; // 1 based, 0 if the error has no position
+    int column;
+} pl0_diagnostic_t;
+
+typedef struct
+{
+    pl0_diagnostic_t diagnostic; // set when pl0_compile fails
+    int32_t* code; // op, L, M per instruction, or op, a, b, c in the register ISA
+    int codeLength; // instructions
+    int entry; // pc execution starts at
+    int regIsa;
+    char* output; // the image, text or assembly the format asked for
+    size_t outputSize;
+} pl0_result_t;
+
+void pl0_init(pl0_ctx_t* ctx);
+int pl0_compile(const pl0_ctx_t* ctx, const char* src, size_t length, pl0_result_t* result); // 0 or -1
+int pl0_link(const pl0_ctx_t* ctx, const char* const objects[], const size_t lengths[], int count,
+             pl0_result_t* result); // 0 or -1, objects[0] is the program
+void pl0_free_result(pl0_result_t* result);
+
+#endif
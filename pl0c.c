@@ -0,0 +1,187 @@
+//Client for "compiler --server": takes the compiler's command line, has the server compile the
+//source and writes the same output, files and exit status as the compiler would
+//Build with "gcc pl0c.c -o pl0c", the socket is $PL0_SOCKET or SERVER_SOCKET
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "pl0server.h"
+
+//options the compiler takes, any other argument is the source file
+const char* flags[] = {"--text", "--reg", "--asm", "--compile-only", "--no-peephole", "--peephole-stats", "-O0", "-O1", "-O2",
+                       "--no-dce", "--dce-report", "--no-fold", "--display", "--mem-report", "--legacy-lexer",
+                       "--bench-lexer", "--bench-symbols", "--time-report", NULL};
+const char* valueOptions[] = {"--peephole-window", "--time-report-json", "--incremental", "-o", NULL};
+
+//functions
+int isOption(const char* arg, const char* options[]);
+char* readSource(const char* fname, size_t* length);
+int readAll(int fd, void* buffer, size_t length);
+int writeAll(int fd, const void* buffer, size_t length);
+
+int main(int argc, const char* argv[]) {
+    const char* path = getenv("PL0_SOCKET") != NULL ? getenv("PL0_SOCKET") : SERVER_SOCKET;
+    const char* fname = NULL;
+    int fileArg = 0;
+    char* args;
+    size_t argsSize = 0;
+    char cwd[4096];
+    struct sockaddr_un address;
+    server_request_t request;
+    server_response_t response;
+
+    //the source is the last argument that is not an option or an option's value, as in the compiler
+    for (int a = 1; a < argc; a++) {
+        if (isOption(argv[a], valueOptions) && a + 1 < argc)
+            a++;
+        else if (!isOption(argv[a], flags)) {
+            fname = argv[a];
+            fileArg = a;
+        }
+    }
+    if (fname == NULL) {
+        printf("usage: %s [--text] [--reg] [--asm] [--compile-only] [--no-peephole] [--peephole-window n] [--peephole-stats] [-O0|-O1|-O2] [--no-dce] [--dce-report] [--no-fold] [--display] [--mem-report] [--legacy-lexer] [--bench-lexer] [--bench-symbols] [--time-report] [--time-report-json file] [--incremental cache] [-o elf] input.txt\n", argv[0]);
+        return 1;
+    }
+    size_t srcLength;
+    char* src = readSource(fname, &srcLength);
+    if (src == NULL) {
+        printf("cannot open %s\n", fname);
+        return 1;
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        cwd[0] = '\0';
+
+    //options as NUL terminated strings, the server opens the report and cache files itself so their paths are made absolute
+    args = malloc(SERVER_MAX_ARGS);
+    if (args == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int a = 1; a < argc; a++) {
+        char arg[4096 + 4096];
+        if (a == fileArg)
+            continue;
+        if (a > 1 && (strcmp(argv[a - 1], "--time-report-json") == 0 || strcmp(argv[a - 1], "--incremental") == 0)
+            && argv[a][0] != '/' && cwd[0] != '\0')
+            snprintf(arg, sizeof(arg), "%s/%s", cwd, argv[a]);
+        else
+            snprintf(arg, sizeof(arg), "%s", argv[a]);
+        size_t size = strlen(arg) + 1;
+        if (argsSize + size > SERVER_MAX_ARGS) {
+            fprintf(stderr, "too many options\n");
+            return 1;
+        }
+        memcpy(args + argsSize, arg, size);
+        argsSize += size;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "cannot connect to %s\n", path);
+        return 1;
+    }
+    memcpy(request.magic, SERVER_MAGIC, 4);
+    request.version = SERVER_VERSION;
+    request.argsSize = argsSize;
+    request.sourceSize = srcLength;
+    if (writeAll(fd, &request, sizeof(request)) != 0 || writeAll(fd, args, argsSize) != 0
+        || writeAll(fd, src, srcLength) != 0 || readAll(fd, &response, sizeof(response)) != 0
+        || memcmp(response.magic, SERVER_MAGIC, 4) != 0) {
+        fprintf(stderr, "no response from %s\n", path);
+        return 1;
+    }
+    size_t payloadSize = (size_t)response.stdoutSize + response.stderrSize + response.nameSize + response.outputSize;
+    char* payload = malloc(payloadSize + 1);
+    if (payload == NULL || readAll(fd, payload, payloadSize) != 0) {
+        fprintf(stderr, "no response from %s\n", path);
+        return 1;
+    }
+    close(fd);
+
+    //the compiler prints its option warnings before the listing
+    char* out = payload;
+    char* err = out + response.stdoutSize;
+    char* name = err + response.stderrSize;
+    char* output = name + response.nameSize;
+    fwrite(err, 1, response.stderrSize, stderr);
+    fflush(stderr);
+    fwrite(out, 1, response.stdoutSize, stdout);
+    if (response.nameSize > 0) {
+        char outName[4096];
+        snprintf(outName, sizeof(outName), "%.*s", (int)response.nameSize, name);
+        FILE* file = fopen(outName, "wb");
+        if (file == NULL) {
+            printf("cannot create %s\n", outName);
+            return 1;
+        }
+        fwrite(output, 1, response.outputSize, file);
+        fclose(file);
+    }
+    return response.status;
+}
+
+int isOption(const char* arg, const char* options[]) {
+    for (int i = 0; options[i] != NULL; i++) {
+        if (strcmp(arg, options[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+//whole file in one malloc'd buffer, NULL if it cannot be read
+char* readSource(const char* fname, size_t* length) {
+    FILE* file = fopen(fname, "rb");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 4096;
+    char* src = malloc(capacity);
+    *length = 0;
+    while (src != NULL) {
+        *length += fread(src + *length, 1, capacity - *length, file);
+        if (*length < capacity)
+            break;
+        capacity *= 2;
+        char* grown = realloc(src, capacity);
+        if (grown == NULL)
+            free(src);
+        src = grown;
+    }
+    if (src != NULL && ferror(file)) {
+        free(src);
+        src = NULL;
+    }
+    fclose(file);
+    return src;
+}
+
+//returns -1 if the connection ends or fails first
+int readAll(int fd, void* buffer, size_t length) {
+    char* p = buffer;
+    while (length > 0) {
+        ssize_t got = read(fd, p, length);
+        if (got <= 0)
+            return -1;
+        p += got;
+        length -= got;
+    }
+    return 0;
+}
+
+int writeAll(int fd, const void* buffer, size_t length) {
+    const char* p = buffer;
+    while (length > 0) {
+        ssize_t put = write(fd, p, length);
+        if (put <= 0)
+            return -1;
+        p += put;
+        length -= put;
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+//Binary executable image shared by compiler.c (writer) and vm.c (loader)
+//
+//  image_header_t
+//  image_section_t[sectionCount]
+//  section contents, each starting on a 4 byte boundary
+//
+//All fields are stored in host byte order; an image from a machine with the other byte
+//order fails the version check. The code section holds codeLength instructions as
+//(op, L, M) int32 triples, the same words the text format lists, so the VM can run it
+//straight out of the mapped file.
+
+#ifndef PL0IMAGE_H
+#define PL0IMAGE_H
+
+#include <stdint.h>
+
+#define IMAGE_MAGIC "PL0X"
+#define IMAGE_VERSION 1
+#define IMAGE_TEXT_BASE 10 // pc of the first instruction
+
+//header flags
+#define IMAGE_FLAG_REGISTER 1 // code is in the register ISA, (op, a, b, c) int32 quadruples, entry 0
+
+//section kinds
+#define SECTION_CODE 1 // int32 op, L, M (or op, a, b, c) per instruction, required
+#define SECTION_SYMBOLS 2 // image_symbol_t per procedure, optional
+
+typedef struct
+{
+    char magic[4]; // IMAGE_MAGIC
+    uint16_t version; // IMAGE_VERSION
+    uint16_t sectionCount;
+    uint32_t entry; // pc execution starts at
+    uint32_t codeLength; // number of instructions
+    uint32_t maxStack; // deepest single activation record in words, including its operand stack
+    uint32_t flags; // IMAGE_FLAG_*
+} image_header_t;
+
+typedef struct
+{
+    uint32_t kind;
+    uint32_t offset; // from the start of the file
+    uint32_t size; // in bytes
+} image_section_t;
+
+typedef struct
+{
+    int32_t addr; // pc of the procedure's first instruction
+    int32_t level; // lexicographical level it is declared in
+    char name[12];
+} image_symbol_t;
+
+//register ISA
+//register x of the running frame is the word pas[bp - x]: 0..2 hold the static link, dynamic link
+//and return address, then come the variables at their usual addresses and the expression temps
+//pc and return addresses count instructions from 0
+typedef enum
+{
+    RLI = 1, // a := b (immediate)
+    RMOV, // a := b
+    RADD, RSUB, RMUL, RDIV, REQL, RNEQ, RLSS, RLEQ, RGTR, RGEQ, // a := b op c, same order as OPR 1..10
+    RADDI, RSUBI, RMULI, RDIVI, REQLI, RNEQI, RLSSI, RLEQI, RGTRI, RGEQI, // a := b op c (immediate)
+    RODD, // a := odd b
+    RLDN, // a := pas[base(b) - c]
+    RSTN, // pas[base(b) - c] := a
+    RJMP, // goto c
+    RJZ, // if a = 0 goto c
+    RBEQL, RBNEQ, RBLSS, RBLEQ, RBGTR, RBGEQ, // if not (a op b) goto c
+    RBEQLI, RBNEQI, RBLSSI, RBLEQI, RBGTRI, RBGEQI, // if not (a op b (immediate)) goto c
+    RCAL, // call c with the static link base(b)
+    RINC, // allocate a words for the frame
+    RRTN,
+    RWRITE, // write a
+    RREAD, // read into a
+    RHALT
+} reg_op;
+
+#endif
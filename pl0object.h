@@ -0,0 +1,57 @@
+//Relocatable object written by "compiler --compile-only" and merged into an image by "compiler --link"
+//
+//  object_header_t
+//  image_section_t[sectionCount] (see pl0image.h)
+//  section contents, each starting on a 4 byte boundary
+//
+//A module is an ordinary PL/0 program. Its level 0 procedures are exported under their names,
+//and a call of a name the module does not declare imports it from another object. The code
+//section is the parser's output, before the peephole pass: every CAL, JMP, JPC and CLX that is
+//not an import holds a pc in the module's own code, counted from IMAGE_TEXT_BASE like in an
+//image, and the linker adds the module's position to it. Level 0 variables live in the main
+//frame, which is shared by all modules, so the accesses to them are relocated as well.
+//
+//The first object given to the linker is the program: its main block runs, and only the
+//procedures of the others are kept. All fields are in host byte order, like the image's.
+
+#ifndef PL0OBJECT_H
+#define PL0OBJECT_H
+
+#include <stdint.h>
+#include "pl0image.h"
+
+#define OBJECT_MAGIC "PL0O"
+#define OBJECT_VERSION 1
+
+//section kinds, besides SECTION_CODE and SECTION_SYMBOLS
+#define SECTION_RELOCS 3 // object_reloc_t per instruction the linker patches other than local branches
+#define SECTION_IMPORTS 4 // object_import_t per procedure the module calls but does not declare
+
+//relocation kinds
+#define RELOC_DATA 1 // LOD, STO, LDX or STX of a level 0 variable, M is its address in the module
+#define RELOC_IMPORT 2 // CAL or CLX of an import, M is set to the procedure's pc
+
+typedef struct
+{
+    char magic[4]; // OBJECT_MAGIC
+    uint16_t version; // OBJECT_VERSION
+    uint16_t sectionCount;
+    uint32_t codeLength; // number of instructions
+    uint32_t mainStart; // instruction the main block starts at (its INC), the procedures come before it
+    uint32_t globals; // level 0 variables
+    uint32_t flags; // IMAGE_FLAG_*, 0 as objects hold stack code
+} object_header_t;
+
+typedef struct
+{
+    uint32_t index; // instruction
+    uint32_t kind; // RELOC_DATA or RELOC_IMPORT
+    uint32_t import; // index in the import section, for RELOC_IMPORT
+} object_reloc_t;
+
+typedef struct
+{
+    char name[12];
+} object_import_t;
+
+#endif
@@ -0,0 +1,32 @@
+//Runtime for programs compiled with "compiler --asm": the memory, the display and SYS write/read
+//Build with "gcc elf.s pl0rt.c -o program"
+
+#include <stdio.h>
+
+#define ARRAY_SIZE 500 // same as the VM
+#define DISPLAY_SIZE 8
+
+//generated code, returns 1 if pc left the text segment
+int pl0_run(int* pas, int* display);
+
+int pas[ARRAY_SIZE] = {0};
+int display[DISPLAY_SIZE];
+
+//SYS 1
+void pl0_write(int value) {
+    printf("Output result is: %d\n", value);
+}
+
+//SYS 2
+void pl0_read(int* slot) {
+    printf("Please enter an integer: ");
+    scanf("%d", slot);
+}
+
+int main() {
+    //the main frame starts at the top of pas, like the VM's initial bp
+    display[0] = ARRAY_SIZE - 1;
+    if (pl0_run(pas, display) != 0)
+        fprintf(stderr, "pc left the text segment\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+//Compile server protocol between compiler.c --server and the pl0c client, one request per connection
+//
+//  request:   server_request_t
+//             argsSize bytes of options, each NUL terminated, as the compiler's command line
+//             takes them but without the source file
+//             sourceSize bytes of source
+//  response:  server_response_t
+//             stdoutSize, stderrSize, nameSize and outputSize bytes, in that order
+//
+//All fields are in host byte order, the socket never leaves the machine.
+
+#ifndef PL0SERVER_H
+#define PL0SERVER_H
+
+#include <stdint.h>
+
+#define SERVER_MAGIC "PL0S"
+#define SERVER_VERSION 1
+#define SERVER_SOCKET "/tmp/pl0.sock" // socket used when PL0_SOCKET is not set
+#define SERVER_MAX_ARGS 65536 // bytes of options a request may carry
+
+typedef struct
+{
+    char magic[4]; // SERVER_MAGIC
+    uint32_t version; // SERVER_VERSION
+    uint32_t argsSize;
+    uint32_t sourceSize;
+} server_request_t;
+
+typedef struct
+{
+    char magic[4]; // SERVER_MAGIC
+    int32_t status; // exit status of the command line compiler
+    uint32_t cached; // 1 if the response came out of the server's cache
+    uint32_t stdoutSize; // listing, reports and the error message
+    uint32_t stderrSize; // warnings about the options
+    uint32_t nameSize; // file the output goes to, relative to the client's directory, 0 for none
+    uint32_t outputSize; // image, text or assembly
+} server_response_t;
+
+#endif
@@ -0,0 +1,37 @@
+//Binary execution trace format shared by vm.c (writer) and tracedump.c (reader)
+
+#ifndef PL0TRACE_H
+#define PL0TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "PL0T"
+#define TRACE_VERSION 1
+
+//file header, followed by one trace_record_t per executed instruction
+typedef struct
+{
+    char magic[4]; // TRACE_MAGIC
+    int32_t version; // TRACE_VERSION
+    int32_t pc; // initial registers
+    int32_t bp;
+    int32_t sp;
+    int32_t memorySize; // number of words in pas
+} trace_header_t;
+
+//state after one instruction has executed
+//CAL records the static link in slot/value, the dynamic link and return address are implied
+//by the previous record's bp and pc
+typedef struct
+{
+    int32_t pc;
+    int32_t op;
+    int32_t L;
+    int32_t M;
+    int32_t bp;
+    int32_t sp;
+    int32_t slot; // memory word written by the instruction, -1 if none
+    int32_t value; // value written to slot
+} trace_record_t;
+
+#endif
@@ -0,0 +1,231 @@
+//Compiles the same programs on many threads at once through pl0.h and checks every result
+//against a single threaded compile: the output, the instruction words and the diagnostic
+//must be byte for byte the same
+//Build with "gcc -DPL0_LIBRARY -pthread tests/concurrent.c compiler.c -o concurrent", or use tests/run.sh
+//
+//  concurrent [-t threads] [-n rounds] input.txt ...
+//
+//Each input is compiled with every option set in configs, next to a program with an error.
+//Prints the number of compiles and mismatches, and exits 1 if there is any mismatch.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pl0.h"
+
+//option sets each input is compiled with
+typedef struct
+{
+    const char* name;
+    int format;
+    int regIsa;
+    int optLevel;
+    int useDisplay;
+    int peepholeWindow;
+} test_config_t;
+
+//one source compiled with one option set, and the single threaded result to compare with
+typedef struct
+{
+    const char* name;
+    const char* src;
+    size_t length;
+    const test_config_t* config;
+    int status;
+    pl0_result_t expected;
+} test_job_t;
+
+static const test_config_t configs[] = {
+    {"image", PL0_IMAGE, 0, 1, 0, 3},
+    {"text -O0", PL0_TEXT, 0, 0, 0, 0},
+    {"image -O2", PL0_IMAGE, 0, 2, 0, 3},
+    {"reg -O2", PL0_IMAGE, 1, 2, 0, 3},
+    {"display", PL0_IMAGE, 0, 1, 1, 3},
+    {"asm -O2", PL0_ASM, 0, 2, 0, 3},
+    {"object", PL0_OBJECT, 0, 1, 0, 3},
+};
+#define TEST_CONFIGS (int)(sizeof(configs) / sizeof(configs[0]))
+
+//fails at "y", so every thread also goes through error()'s longjmp
+static const char badProgram[] = "var x;\nbegin\n  x := 1;\n  y := x\nend.\n";
+
+//one run of the test, shared by its threads; only mismatches changes once they start
+typedef struct
+{
+    test_job_t* jobs;
+    int jobCount;
+    int rounds;
+    int mismatches;
+    pthread_mutex_t mismatchLock;
+} test_run_t;
+
+//what each thread is started with
+typedef struct
+{
+    test_run_t* run;
+    int index;
+} test_thread_t;
+
+//functions
+static void addJobs(test_run_t* run, const char* name, const char* src, size_t length);
+static int compileJob(const test_job_t* job, pl0_result_t* result);
+static int sameResult(const test_job_t* job, int status, const pl0_result_t* result);
+static void* testThread(void* arg);
+static char* readSource(const char* fname, size_t* length);
+
+int main(int argc, char* argv[]) {
+    test_run_t run = {0};
+    int threads = 8;
+    int a = 1;
+
+    run.rounds = 20;
+    pthread_mutex_init(&run.mismatchLock, NULL);
+
+    for (; a + 1 < argc && argv[a][0] == '-'; a += 2) {
+        if (strcmp(argv[a], "-t") == 0)
+            threads = atoi(argv[a + 1]);
+        else if (strcmp(argv[a], "-n") == 0)
+            run.rounds = atoi(argv[a + 1]);
+        else
+            break;
+    }
+    if (a >= argc || threads < 1 || run.rounds < 1) {
+        printf("usage: %s [-t threads] [-n rounds] input.txt ...\n", argv[0]);
+        return 2;
+    }
+    for (; a < argc; a++) {
+        size_t length;
+        char* src = readSource(argv[a], &length);
+        if (src == NULL) {
+            printf("cannot open %s\n", argv[a]);
+            return 2;
+        }
+        addJobs(&run, argv[a], src, length);
+    }
+    addJobs(&run, "(error)", badProgram, sizeof(badProgram) - 1);
+
+    //the expected results, compiled one at a time
+    for (int j = 0; j < run.jobCount; j++)
+        run.jobs[j].status = compileJob(&run.jobs[j], &run.jobs[j].expected);
+
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    test_thread_t* args = malloc(threads * sizeof(test_thread_t));
+    if (ids == NULL || args == NULL) {
+        printf("out of memory\n");
+        return 2;
+    }
+    for (int t = 0; t < threads; t++) {
+        args[t].run = &run;
+        args[t].index = t;
+        if (pthread_create(&ids[t], NULL, testThread, &args[t]) != 0) {
+            printf("cannot start thread %d\n", t);
+            return 2;
+        }
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+
+    printf("%d compiles on %d threads, %d mismatches\n", threads * run.rounds * run.jobCount, threads, run.mismatches);
+    for (int j = 0; j < run.jobCount; j++)
+        pl0_free_result(&run.jobs[j].expected);
+    //every input read from a file starts a group of TEST_CONFIGS jobs, the error program comes last
+    for (int j = 0; j < run.jobCount - TEST_CONFIGS; j += TEST_CONFIGS)
+        free((char*)run.jobs[j].src);
+    pthread_mutex_destroy(&run.mismatchLock);
+    free(run.jobs);
+    free(args);
+    free(ids);
+    return run.mismatches > 0;
+}
+
+static void addJobs(test_run_t* run, const char* name, const char* src, size_t length) {
+    test_job_t* grown = realloc(run->jobs, (run->jobCount + TEST_CONFIGS) * sizeof(test_job_t));
+    if (grown == NULL) {
+        printf("out of memory\n");
+        exit(2);
+    }
+    run->jobs = grown;
+    for (int c = 0; c < TEST_CONFIGS; c++) {
+        test_job_t* job = &run->jobs[run->jobCount++];
+        memset(job, 0, sizeof(test_job_t));
+        job->name = name;
+        job->src = src;
+        job->length = length;
+        job->config = &configs[c];
+    }
+}
+
+static int compileJob(const test_job_t* job, pl0_result_t* result) {
+    pl0_ctx_t ctx;
+
+    pl0_init(&ctx);
+    ctx.format = job->config->format;
+    ctx.regIsa = job->config->regIsa;
+    ctx.optLevel = job->config->optLevel;
+    ctx.useDisplay = job->config->useDisplay;
+    ctx.peepholeWindow = job->config->peepholeWindow;
+    return pl0_compile(&ctx, job->src, job->length, result);
+}
+
+static int sameResult(const test_job_t* job, int status, const pl0_result_t* result) {
+    const pl0_result_t* expected = &job->expected;
+
+    if (status != job->status)
+        return 0;
+    if (status != 0)
+        return memcmp(&result->diagnostic, &expected->diagnostic, sizeof(pl0_diagnostic_t)) == 0;
+    return result->codeLength == expected->codeLength && result->entry == expected->entry
+        && result->regIsa == expected->regIsa && result->outputSize == expected->outputSize
+        && memcmp(result->code, expected->code, (size_t)result->codeLength * (result->regIsa ? 4 : 3) * 4) == 0
+        && memcmp(result->output, expected->output, result->outputSize) == 0;
+}
+
+//every thread compiles all jobs each round, starting at a different one so that different
+//programs and options run side by side
+static void* testThread(void* arg) {
+    const test_thread_t* thread = arg;
+    test_run_t* run = thread->run;
+    pl0_result_t result;
+
+    for (int r = 0; r < run->rounds; r++) {
+        for (int k = 0; k < run->jobCount; k++) {
+            test_job_t* job = &run->jobs[(k + thread->index * 7 + r) % run->jobCount];
+            int status = compileJob(job, &result);
+            if (!sameResult(job, status, &result)) {
+                pthread_mutex_lock(&run->mismatchLock);
+                if (run->mismatches++ < 10)
+                    printf("mismatch: %s, %s, thread %d, round %d\n", job->name, job->config->name, thread->index, r);
+                pthread_mutex_unlock(&run->mismatchLock);
+            }
+            pl0_free_result(&result);
+        }
+    }
+    return NULL;
+}
+
+//whole file in one malloc'd buffer, NULL if it cannot be read
+static char* readSource(const char* fname, size_t* length) {
+    FILE* file = fopen(fname, "rb");
+    if (file == NULL)
+        return NULL;
+    size_t capacity = 4096;
+    char* src = malloc(capacity);
+    *length = 0;
+    while (src != NULL) {
+        *length += fread(src + *length, 1, capacity - *length, file);
+        if (*length < capacity)
+            break;
+        capacity *= 2;
+        char* grown = realloc(src, capacity);
+        if (grown == NULL)
+            free(src);
+        src = grown;
+    }
+    if (src != NULL && ferror(file)) {
+        free(src);
+        src = NULL;
+    }
+    fclose(file);
+    return src;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Thread safety test for the compiler library (see pl0.h)
+#
+#   tests/run.sh [-t threads] [-n rounds] [-s thread|address]
+#
+# Builds tests/concurrent.c against compiler.c with -DPL0_LIBRARY, optionally under a
+# sanitizer, and compiles every bench/*.txt on the threads (default 8) for n rounds
+# (default 20) with several option sets, comparing each result with a single threaded
+# compile. Exits 1 if any result differs or the sanitizer reports a problem.
+
+threads=8
+rounds=20
+sanitize=
+while getopts t:n:s: opt; do
+    case $opt in
+        t) threads=$OPTARG ;;
+        n) rounds=$OPTARG ;;
+        s) sanitize="-fsanitize=$OPTARG -g" ;;
+        *) sed -n 4p "$0" >&2; exit 2 ;;
+    esac
+done
+
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 $sanitize -DPL0_LIBRARY -pthread -o "$work/concurrent" "$tests/concurrent.c" "$tests/../compiler.c" || exit 2
+
+#a sanitizer report fails the run like a mismatch does
+TSAN_OPTIONS="halt_on_error=1 exitcode=1" ASAN_OPTIONS="exitcode=1" \
+    "$work/concurrent" -t "$threads" -n "$rounds" "$tests"/../bench/*.txt
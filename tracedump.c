@@ -0,0 +1,189 @@
+//Decoder for binary VM traces written by "vm --trace": rebuilds the PC BP SP Stack listing
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pl0trace.h"
+
+//CPU struct
+typedef struct {
+    int bp;
+    int sp;
+    int pc;
+    int ir[3];
+}CPU;
+
+//functions
+void printCpu(CPU cpu);
+void printStackRec(CPU cpu, int index, int nextDL);
+void printUtil(CPU cpu);
+
+//shadow copy of the VM memory, rebuilt from the recorded writes
+int* pas;
+int stackTop;
+
+int main(int argc, const char * argv[]) {
+    trace_header_t header;
+    trace_record_t rec;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        fprintf(stderr, "cannot open %s\n", argv[1]);
+        return 1;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0
+        || header.version != TRACE_VERSION || header.memorySize <= 0) {
+        fprintf(stderr, "%s is not a PL/0 trace\n", argv[1]);
+        return 1;
+    }
+    pas = calloc(header.memorySize, sizeof(int));
+    stackTop = header.memorySize - 1;
+
+    CPU cpu = {header.bp, header.sp, header.pc, {0, 0, 0}};
+
+    //print initial values
+    printf("%18s%-5s%-5s%-5s%-5s\n","", "PC", "BP", "SP", "Stack");
+    printf("Initial values: %4d%6d%5d\n\n", cpu.pc, cpu.bp, cpu.sp);
+
+    while (fread(&rec, sizeof(rec), 1, file) == 1) {
+        //replay the writes, CAL and CLX also pushed the dynamic link and return address
+        if ((rec.op == 5 || rec.op == 13) && rec.bp >= 2 && rec.bp < header.memorySize) {
+            pas[rec.bp - 1] = cpu.bp;
+            pas[rec.bp - 2] = cpu.pc + 3;
+        }
+        if (rec.slot >= 0 && rec.slot < header.memorySize)
+            pas[rec.slot] = rec.value;
+
+        cpu.pc = rec.pc;
+        cpu.bp = rec.bp;
+        cpu.sp = rec.sp;
+        cpu.ir[0] = rec.op;
+        cpu.ir[1] = rec.L;
+        cpu.ir[2] = rec.M;
+
+        //Print CPU & stack
+        printCpu(cpu);
+        printStackRec(cpu, cpu.sp, cpu.bp);
+        puts("");
+    }
+
+    fclose(file);
+    free(pas);
+    return 0;
+}
+
+//prints cpu
+void printCpu(CPU cpu) {
+    printUtil(cpu);
+    printf("%1s%-2d%-10d%-5d%-5d%-5d", "", cpu.ir[1], cpu.ir[2], cpu.pc, cpu.bp, cpu.sp);
+}
+
+//prints operation
+void printUtil(CPU cpu) {
+    printf("%2s", "");
+    switch (cpu.ir[0]) {
+        case 1:
+            printf("%s", "LIT");
+            break;
+        case 2:
+            switch(cpu.ir[2]){
+                case 0:
+                    printf("%s", "RTN");
+                    break;
+                case 1:
+                    printf("%s", "ADD");
+                    break;
+                case 2:
+                    printf("%s", "SUB");
+                    break;
+                case 3:
+                    printf("%s", "MUL");
+                    break;
+                case 4:
+                    printf("%s", "DIV");
+                    break;
+                case 5:
+                    printf("%s", "EQL");
+                    break;
+                case 6:
+                    printf("%s", "NEQ");
+                    break;
+                case 7:
+                    printf("%s", "LSS");
+                    break;
+                case 8:
+                    printf("%s", "LEQ");
+                    break;
+                case 9:
+                    printf("%s", "GTR");
+                    break;
+                case 10:
+                    printf("%s", "GEQ");
+                    break;
+                case 11:
+                    printf("%s", "ODD");
+                    break;
+            }
+            break;
+        case 3:
+            printf("%s", "LOD");
+            break;
+        case 4:
+            printf("%s", "STO");
+            break;
+        case 5:
+            printf("%s", "CAL");
+            break;
+        case 6:
+            printf("%s", "INC");
+            break;
+        case 7:
+            printf("%s", "JMP");
+            break;
+        case 8:
+            printf("%s", "JPC");
+            break;
+        case 9:
+            printf("SYS");
+            break;
+        case 10:
+            printf("%s", "STK");
+            break;
+        case 11:
+            printf("%s", "LDX");
+            break;
+        case 12:
+            printf("%s", "STX");
+            break;
+        case 13:
+            printf("%s", "CLX");
+            break;
+        case 14:
+            printf("%s", "DEN");
+            break;
+        case 15:
+            printf("%s", "DRT");
+            break;
+    }
+}
+
+//recursive version of printStack function
+void printStackRec(CPU cpu, int index, int nextDL)
+{
+    if(index > stackTop)
+        return;
+    if(index >= nextDL)
+    {
+        printStackRec(cpu, index + 1, pas[nextDL - 1]);
+        if(index == nextDL && index != stackTop)
+            printf("| ");
+    }
+    else
+        printStackRec(cpu, index + 1, nextDL);
+
+    printf("%d ", pas[index]);
+}
@@ -1,8 +1,48 @@
 //Von Neumannn Stack Machine
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "pl0image.h"
+#include "pl0trace.h"
 
 #define ARRAY_SIZE 500
+#define TEXT_BASE IMAGE_TEXT_BASE
+#define TRACE_RING_SIZE 4096 // records, must be a power of two
+#define DISPLAY_SIZE 8 // lexicographical levels the display can hold
+#define PROFILE_OPS 16 // opcodes 0 .. 15
+#define PROFILE_OPRS 12 // OPR sub-ops 0 .. 11
+#define PROFILE_DEPTH 256 // calls deeper than this are counted against the procedure at this depth
+#define PROFILE_HOT 20 // pcs listed as hot spots
+#define BATCH_LINE 4096 // longest manifest line
+
+//how a run ended
+#define VM_HALT 0
+#define VM_LEFT_TEXT 1 // the pc left the text segment
+#define VM_TRAP 2 // arithmetic fault (division by zero), only caught in batch mode
+#define VM_LOAD_ERROR 3 // the image or the input could not be opened
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
 //CPU struct
 typedef struct {
@@ -12,255 +52,1578 @@ typedef struct {
     int ir[3];
 }CPU;
 
+//profiler call tree node, one per distinct path of calls from the main block
+typedef struct {
+    int entry; // pc the CAL jumped to, TEXT_BASE for the main block
+    int parent; // -1 for the main block
+    int firstChild;
+    int nextSibling;
+    long long self; // instructions executed in this procedure on this path
+    int depth;
+} profile_node_t;
+
 //functions
-void printCpu(CPU cpu);
-void printStack(CPU cpu);
-void printStackRec(CPU cpu, int index, int nextDL);
 int base( int BP, int L);
-void printUtil(CPU cpu);
+int loadImage(const char* fname, CPU* cpu);
+int loadText(FILE* file, CPU* cpu);
+int checkDisplay();
+void runSwitch(CPU cpu);
+int runThreaded(CPU cpu);
+void runRegister(CPU cpu);
+int runJit(CPU cpu);
+int traceOpen(const char* fname, CPU cpu);
+void traceClose();
+void traceStep(CPU cpu);
+void* traceWriter(void* arg);
+int profileOpen();
+void profileStep(int pc, int op, int M);
+int procedureBody(int i);
+const char* procedureName(int pc);
+const char* procedureAt(int pc);
+void writeFolded(FILE* file, int node);
+int perfOpen(int config);
+void perfStart();
+int perfRead(int fd, long long* value);
+void perfReport(FILE* file);
+void profileReport(const char* fname);
+void vmReset();
+void unloadImage();
+void runRelease();
+int runProgram(CPU cpu, int threaded, int jit);
+int runBatch(const char* manifest, int workers, const char* resultsName, int threaded, int jit, int stats);
+int batchTake(int self);
+void batchRun(int j);
+void* batchWorker(void* arg);
+void trapHandler(int sig);
+void writeJsonString(FILE* file, const char* s, size_t length);
+
+//the machine's state is thread local, so each batch worker runs programs on a VM of its own
 
 //stack
-int pas[ARRAY_SIZE] = {0};
+_Thread_local int pas[ARRAY_SIZE] = {0};
+
+//text segment, instruction words for pc TEXT_BASE .. textEnd - 1 live at text[pc - TEXT_BASE]
+//it points into the mapped image for binary files, or at a heap copy for text files
+_Thread_local const int* text = NULL;
+_Thread_local int textEnd = TEXT_BASE;
+_Thread_local int regIsa = 0; // 1 if the text is register ISA code, four words per instruction
+_Thread_local int regCount = 0; // number of register ISA instructions
+_Thread_local const unsigned char* imageMap = NULL; // mapping of a binary image, for unloadImage
+_Thread_local size_t imageSize = 0;
+_Thread_local int* textWords = NULL; // heap copy of a text image
+
+_Thread_local long long executed = 0; // instructions dispatched by the last run, -1 for native code
+_Thread_local int vmStatus = VM_HALT; // how the last run ended
+int measureDepth = 0; // 1 to have the switch engine record the lowest sp, for --depth
+_Thread_local int lowestSp = ARRAY_SIZE;
+
+//program input and output, stdin and stdout unless a batch job redirects them
+_Thread_local FILE* vmIn = NULL;
+_Thread_local FILE* vmOut = NULL;
+
+//display: base of the innermost active frame of each level, for LDX, STX and CLX
+//level 0 is the main frame, a procedure only keeps its level's entry if the compiler emitted DEN/DRT for it
+_Thread_local int display[DISPLAY_SIZE];
+
+//trace ring buffer, single producer (the VM) and single consumer (the writer thread)
+trace_record_t traceRing[TRACE_RING_SIZE];
+atomic_uint traceHead; // next record the VM writes
+atomic_uint traceTail; // next record the writer drains
+atomic_int traceDone;
+FILE* traceFile = NULL;
+pthread_t traceThread;
+
+//profiler, filled in by the switch engine when --profile is given
+long long opCounts[PROFILE_OPS];
+long long oprCounts[PROFILE_OPRS];
+long long* pcCounts = NULL; // per instruction, NULL when not profiling
+profile_node_t* profileNodes = NULL;
+int profileNodeCount = 0;
+int profileCapacity = 0;
+int profileCurrent = 0; // node of the running procedure
+int profileOverflow = 0; // calls made past PROFILE_DEPTH that have not returned yet
+int perfWanted = 0; // 1 to count cycles and branch misses with perf_event_open
+int perfCycles = -1;
+int perfMisses = -1;
+
+//procedure symbols of a binary image, for the profile
+_Thread_local const image_symbol_t* symbols = NULL;
+_Thread_local int symbolCount = 0;
+
+//batch mode: every job is an image and an input file, run by a fixed pool of workers
+//each worker starts with a share of the jobs and steals from the others when it runs out
+typedef struct {
+    char* image;
+    char* input; // NULL runs with an empty input
+    int status; // VM_HALT .. VM_LOAD_ERROR
+    long long executed; // -1 when the program ran as native code
+    double seconds;
+    char* output; // everything the program printed
+    size_t outputSize;
+} batch_job_t;
+
+//a worker's jobs: the owner takes from the head, thieves take from the tail
+typedef struct {
+    pthread_mutex_t lock;
+    int* jobs;
+    int head;
+    int tail;
+} batch_queue_t;
+
+batch_job_t* batchJobs = NULL;
+int batchJobCount = 0;
+batch_queue_t* batchQueues = NULL;
+int batchWorkers = 0;
+int batchThreaded = 0; // engine the workers run, as chosen with --engine
+int batchJit = 0;
+atomic_int batchSteals;
+_Thread_local sigjmp_buf trapJump; // where a worker resumes after a division by zero
 
 int main(int argc, const char * argv[]) {
-    CPU cpu = {499, 500, 10};
-    int run = 1;
+    CPU cpu = {499, 500, TEXT_BASE};
+    const char* fname = NULL;
+    const char* traceName = NULL;
+    const char* profileName = NULL;
+    const char* manifest = NULL;
+    const char* resultsName = NULL;
+    int workers = 0;
+    int threaded = 0;
+    int jit = 0;
+    int jitRan = 0;
+    int stats = 0;
+    struct timespec start, end;
+
+    //parse options, the last plain argument is the elf file
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--engine") == 0 && a + 1 < argc) {
+            a++;
+            if (strcmp(argv[a], "threaded") == 0)
+                threaded = 1;
+            else if (strcmp(argv[a], "switch") == 0)
+                threaded = 0;
+            else if (strcmp(argv[a], "jit") == 0)
+                jit = 1;
+            else {
+                fprintf(stderr, "unknown engine %s\n", argv[a]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "--trace") == 0 && a + 1 < argc)
+            traceName = argv[++a];
+        else if (strcmp(argv[a], "--stats") == 0)
+            stats = 1;
+        else if (strcmp(argv[a], "--depth") == 0)
+            measureDepth = 1;
+        else if (strcmp(argv[a], "--profile") == 0 && a + 1 < argc)
+            profileName = argv[++a];
+        else if (strcmp(argv[a], "--perf") == 0)
+            perfWanted = 1;
+        else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc)
+            manifest = argv[++a];
+        else if (strcmp(argv[a], "-j") == 0 && a + 1 < argc)
+            workers = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--results") == 0 && a + 1 < argc)
+            resultsName = argv[++a];
+        else
+            fname = argv[a];
+    }
+    vmIn = stdin;
+    vmOut = stdout;
+    if (manifest != NULL) {
+        if (fname != NULL || traceName != NULL || profileName != NULL || perfWanted || measureDepth) {
+            fprintf(stderr, "--batch takes no elf file and does not trace, profile or measure the depth\n");
+            return 1;
+        }
+        return runBatch(manifest, workers, resultsName, threaded, jit, stats);
+    }
+    if (fname == NULL) {
+        fprintf(stderr, "usage: %s [--engine switch|threaded|jit] [--trace trace.bin] [--stats] [--depth] [--profile report.txt] [--perf] elf\n"
+                "       %s [--engine switch|threaded|jit] [--stats] --batch manifest [-j workers] [--results results.json]\n", argv[0], argv[0]);
+        return 1;
+    }
+
+    if (loadImage(fname, &cpu) != 0 || checkDisplay() != 0)
+        return 1;
+    display[0] = cpu.bp;
+
+    //tracing is off unless asked for, decode the file with tracedump
+    if (traceName != NULL && regIsa) {
+        fprintf(stderr, "tracing is only available for stack ISA images\n");
+        return 1;
+    }
+    if (profileName != NULL && (regIsa || traceName != NULL)) {
+        fprintf(stderr, "profiling is only available for untraced stack ISA images\n");
+        return 1;
+    }
+    if (profileName != NULL && profileOpen() != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (traceName != NULL && traceOpen(traceName, cpu) != 0) {
+        fprintf(stderr, "cannot open %s\n", traceName);
+        return 1;
+    }
 
-    //read in from file into text part of stack
-    const char* fname = argv[1];
-    FILE *file = fopen( fname, "r" );
-    int i = 10;
-    while (fscanf(file, "%d", &pas[i]) == 1) {
-        i++;
-    }
-
-    //print initial values
-    printf("%18s%-5s%-5s%-5s%-5s\n","", "PC", "BP", "SP", "Stack");
-    printf("Initial values: %4d%6d%5d\n\n", cpu.pc, cpu.bp, cpu.sp);
-
-     while(run == 1) {
-         //fetch
-         cpu.ir[0] = pas[cpu.pc];
-         cpu.ir[1] = pas[cpu.pc + 1];
-         cpu.ir[2] = pas[cpu.pc + 2];
-         cpu.pc += 3;
-        //execute
-         switch(cpu.ir[0]) {
-             //LIT
-             case 1:
-                 //Literal push
-                 cpu.sp -= 1;
-                 pas[cpu.sp] = cpu.ir[2];
-                 break;
-             //RTN or OPR
-             case 2:
-                 //switch M to execute correct operation
-                 switch(cpu.ir[2]){
-                     //RTN
-                     case 0:
-                         //Returns from a subroutine and restore the caller's AR
-                         cpu.sp = cpu.bp + 1;
-                         cpu.bp = pas[cpu.sp - 2];
-                         cpu.pc = pas[cpu.sp - 3];
-                         break;
-                     //ADD
-                     case 1:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] + pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //SUB
-                     case 2:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] - pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //MUL
-                     case 3:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] * pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //DIV
-                     case 4:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] / pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //EQL
-                     case 5:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] == pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //NEQ
-                     case 6:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] != pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //LSS
-                     case 7:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] < pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //LEQ
-                     case 8:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] <= pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //GTR
-                     case 9:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] > pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                     //GEQ
-                     case 10:
-                         pas[cpu.sp + 1] = pas[cpu.sp + 1] >= pas[cpu.sp];
-                         cpu.sp += 1;
-                         break;
-                 }
-                 break;
-             //LOD
-             case 3:
-                 //Load val to top of stack from stack location @ offset o
-                 //from n lexicographical levels down
-                 cpu.sp -= 1;
-                 pas[cpu.sp] = pas[base(cpu.bp, cpu.ir[1]) - cpu.ir[2]];
-             break;
-             //STO
-             case 4:
-                 //Store value at top of stack in stack location at offset o
-                 //from n lexicographical levels down
-                 pas[base(cpu.bp, cpu.ir[1]) - cpu.ir[2]] = pas[cpu.sp];
-                 cpu.sp += 1;
-                 break;
-             //CAL
-             case 5:
-                 //Call procedure at code index p, generating new AR and
-                 //setting PC to p
-                 pas[cpu.sp - 1] = base(cpu.bp, cpu.ir[1]);
-                 pas[cpu.sp - 2] = cpu.bp;
-                 pas[cpu.sp - 3] = cpu.pc;
-                 cpu.bp = cpu.sp - 1;
-                 cpu.pc = cpu.ir[2];
-                 break;
-             //INC
-             case 6:
-                 //Allocate m locals on the stack
-                 cpu.sp = cpu.sp - cpu.ir[2];
-                 break;
-             //JMP
-             case 7:
-                 //Jump to address a
-                 cpu.pc = cpu.ir[2];
-                 break;
-             //JPC
-             case 8:
-                 //Jump conditionally: if value in pas[cpu.sp] is 0, then
-                 //jump to a and pop the stack
-                 if(pas[cpu.sp] == 0) {
-                     cpu.pc = cpu.ir[2];
-                 }
-                 cpu.sp++;
-                 break;
-             //SYS
-             case 9:
-                 switch(cpu.ir[2]){
-                     case 1:
-                         //Output value in pas[cpu.sp] to std output & pop
-                         printf("Output result is: %d\n", pas[cpu.sp]);
-                         cpu.sp++;
-                         break;
-                     case 2:
-                         //Read an integer from stdin and store it on top of stack
-                         cpu.sp--;
-                         printf("Please enter an integer: ");
-                         scanf("%d", &pas[cpu.sp]);
-                         break;
-                     case 3:
-                         //Halt the program
-                         run = 0;
-                         break;
-                 }
-                 break;
-         }
-
-         //Print CPU & stack
-         printCpu(cpu);
-         printStackRec(cpu, cpu.sp, cpu.bp);
-         puts("");
-     }
+    //only the switch engine measures the depth and profiles
+    if (measureDepth || profileName != NULL)
+        threaded = jit = 0;
+    if (perfWanted)
+        perfStart();
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    jitRan = runProgram(cpu, threaded, jit);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    traceClose();
+    if (vmStatus == VM_LEFT_TEXT)
+        fprintf(stderr, "pc left the text segment\n");
+    if (profileName != NULL)
+        profileReport(profileName);
+    else if (perfWanted)
+        perfReport(stderr);
+    //native code does not count instructions
+    if (stats && jitRan)
+        fprintf(stderr, "ran native code in %.6f s\n",
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    else if (stats)
+        fprintf(stderr, "executed %lld instructions in %.6f s\n", executed,
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    if (measureDepth)
+        fprintf(stderr, "peak stack depth %d words\n", ARRAY_SIZE - lowestSp);
     return 0;
 }
 
-//prints cpu
-void printCpu(CPU cpu) {
-    printUtil(cpu);
-    printf("%1s%-2d%-10d%-5d%-5d%-5d", "", cpu.ir[1], cpu.ir[2], cpu.pc, cpu.bp, cpu.sp);
+//runs the loaded program, returns 1 if it ran as native code
+//the threaded engine and the JIT refuse text they cannot translate, the switch engine runs anything
+int runProgram(CPU cpu, int threaded, int jit) {
+    if (regIsa)
+        runRegister(cpu);
+    else if (jit && runJit(cpu) == 0)
+        return 1;
+    else if (!threaded || runThreaded(cpu) != 0)
+        runSwitch(cpu);
+    return 0;
 }
 
-//prints operation
-void printUtil(CPU cpu) {
-    printf("%2s", "");
-    switch (cpu.ir[0]) {
-        case 1:
-            printf("%s", "LIT");
-            break;
-        case 2:
-            switch(cpu.ir[2]){
-                case 0:
-                    printf("%s", "RTN");
-                    break;
-                case 1:
-                    printf("%s", "ADD");
-                    break;
-                case 2:
-                    printf("%s", "SUB");
-                    break;
-                case 3:
-                    printf("%s", "MUL");
-                    break;
-                case 4:
-                    printf("%s", "DIV");
-                    break;
-                case 5:
-                    printf("%s", "EQL");
-                    break;
-                case 6:
-                    printf("%s", "NEQ");
-                    break;
-                case 7:
-                    printf("%s", "LSS");
-                    break;
-                case 8:
-                    printf("%s", "LEQ");
-                    break;
-                case 9:
-                    printf("%s", "GTR");
-                    break;
-                case 10:
-                    printf("%s", "GEQ");
-                    break;
-            }
-            break;
-        case 3:
-            printf("%s", "LOD");
-            break;
-        case 4:
-            printf("%s", "STO");
-            break;
-        case 5:
-            printf("%s", "CAL");
-            break;
-        case 6:
-            printf("%s", "INC");
-            break;
-        case 7:
-            printf("%s", "JMP");
+//classic fetch/decode/execute loop, inlined once per mode so the plain copy has no trace or depth checks
+static ALWAYS_INLINE void switchLoop(CPU cpu, const int tracing, const int measuring, const int profiling) {
+    int run = 1;
+    long long count = 0;
+
+    while(run == 1) {
+        count++;
+        //fetch
+        if (cpu.pc < TEXT_BASE || cpu.pc + 3 > textEnd) {
+            vmStatus = VM_LEFT_TEXT;
             break;
-        case 8:
-            printf("%s", "JPC");
+        }
+        cpu.ir[0] = text[cpu.pc - TEXT_BASE];
+        cpu.ir[1] = text[cpu.pc - TEXT_BASE + 1];
+        cpu.ir[2] = text[cpu.pc - TEXT_BASE + 2];
+        if (profiling)
+            profileStep(cpu.pc, cpu.ir[0], cpu.ir[2]);
+        cpu.pc += 3;
+       //execute
+        switch(cpu.ir[0]) {
+            //LIT
+            case 1:
+                //Literal push
+                cpu.sp -= 1;
+                pas[cpu.sp] = cpu.ir[2];
+                break;
+            //RTN or OPR
+            case 2:
+                //switch M to execute correct operation
+                switch(cpu.ir[2]){
+                    //RTN
+                    case 0:
+                        //Returns from a subroutine and restore the caller's AR
+                        cpu.sp = cpu.bp + 1;
+                        cpu.bp = pas[cpu.sp - 2];
+                        cpu.pc = pas[cpu.sp - 3];
+                        break;
+                    //ADD
+                    case 1:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] + pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //SUB
+                    case 2:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] - pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //MUL
+                    case 3:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] * pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //DIV
+                    case 4:
+                        //a division by zero traps out of the loop, keep the count a batch job reports
+                        executed = count;
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] / pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //EQL
+                    case 5:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] == pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //NEQ
+                    case 6:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] != pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //LSS
+                    case 7:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] < pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //LEQ
+                    case 8:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] <= pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //GTR
+                    case 9:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] > pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //GEQ
+                    case 10:
+                        pas[cpu.sp + 1] = pas[cpu.sp + 1] >= pas[cpu.sp];
+                        cpu.sp += 1;
+                        break;
+                    //ODD
+                    case 11:
+                        pas[cpu.sp] = pas[cpu.sp] % 2 != 0;
+                        break;
+                }
+                break;
+            //LOD
+            case 3:
+                //Load val to top of stack from stack location @ offset o
+                //from n lexicographical levels down
+                cpu.sp -= 1;
+                pas[cpu.sp] = pas[base(cpu.bp, cpu.ir[1]) - cpu.ir[2]];
             break;
-        case 9:
-            printf("SYS");
+            //STO
+            case 4:
+                //Store value at top of stack in stack location at offset o
+                //from n lexicographical levels down
+                pas[base(cpu.bp, cpu.ir[1]) - cpu.ir[2]] = pas[cpu.sp];
+                cpu.sp += 1;
+                break;
+            //STK
+            case 10:
+                //Store value at top of stack like STO but leave it there
+                pas[base(cpu.bp, cpu.ir[1]) - cpu.ir[2]] = pas[cpu.sp];
+                break;
+            //CAL
+            case 5:
+                //Call procedure at code index p, generating new AR and
+                //setting PC to p
+                pas[cpu.sp - 1] = base(cpu.bp, cpu.ir[1]);
+                pas[cpu.sp - 2] = cpu.bp;
+                pas[cpu.sp - 3] = cpu.pc;
+                cpu.bp = cpu.sp - 1;
+                cpu.pc = cpu.ir[2];
+                break;
+            //LDX
+            case 11:
+                //Load like LOD from the frame of absolute level L, found in the display
+                cpu.sp -= 1;
+                pas[cpu.sp] = pas[display[cpu.ir[1]] - cpu.ir[2]];
+                break;
+            //STX
+            case 12:
+                //Store like STO into the frame of absolute level L
+                pas[display[cpu.ir[1]] - cpu.ir[2]] = pas[cpu.sp];
+                cpu.sp += 1;
+                break;
+            //CLX
+            case 13:
+                //Call like CAL with the frame of absolute level L as static link
+                pas[cpu.sp - 1] = display[cpu.ir[1]];
+                pas[cpu.sp - 2] = cpu.bp;
+                pas[cpu.sp - 3] = cpu.pc;
+                cpu.bp = cpu.sp - 1;
+                cpu.pc = cpu.ir[2];
+                break;
+            //DEN
+            case 14:
+                //Save the display entry of level L at offset M and point it at this frame
+                pas[cpu.bp - cpu.ir[2]] = display[cpu.ir[1]];
+                display[cpu.ir[1]] = cpu.bp;
+                break;
+            //DRT
+            case 15:
+                //Restore the display entry saved by DEN, then return like RTN
+                display[cpu.ir[1]] = pas[cpu.bp - cpu.ir[2]];
+                cpu.sp = cpu.bp + 1;
+                cpu.bp = pas[cpu.sp - 2];
+                cpu.pc = pas[cpu.sp - 3];
+                break;
+            //INC
+            case 6:
+                //Allocate m locals on the stack
+                cpu.sp = cpu.sp - cpu.ir[2];
+                break;
+            //JMP
+            case 7:
+                //Jump to address a
+                cpu.pc = cpu.ir[2];
+                break;
+            //JPC
+            case 8:
+                //Jump conditionally: if value in pas[cpu.sp] is 0, then
+                //jump to a and pop the stack
+                if(pas[cpu.sp] == 0) {
+                    cpu.pc = cpu.ir[2];
+                }
+                cpu.sp++;
+                break;
+            //SYS
+            case 9:
+                switch(cpu.ir[2]){
+                    case 1:
+                        //Output value in pas[cpu.sp] to std output & pop
+                        fprintf(vmOut, "Output result is: %d\n", pas[cpu.sp]);
+                        cpu.sp++;
+                        break;
+                    case 2:
+                        //Read an integer from stdin and store it on top of stack
+                        cpu.sp--;
+                        fprintf(vmOut, "Please enter an integer: ");
+                        fscanf(vmIn, "%d", &pas[cpu.sp]);
+                        break;
+                    case 3:
+                        //Halt the program
+                        run = 0;
+                        break;
+                }
+                break;
+        }
+
+        if (tracing)
+            traceStep(cpu);
+        if (measuring && cpu.sp < lowestSp)
+            lowestSp = cpu.sp;
+    }
+    executed = count;
+}
+
+void runSwitch(CPU cpu) {
+    if (traceFile != NULL)
+        switchLoop(cpu, 1, 0, 0);
+    else if (pcCounts != NULL)
+        switchLoop(cpu, 0, 1, 1);
+    else if (measureDepth)
+        switchLoop(cpu, 0, 1, 0);
+    else
+        switchLoop(cpu, 0, 0, 0);
+}
+
+//pre-decoded instruction for the threaded engine
+typedef struct {
+    const void* handler; // address of the handler label for this op, do_trace when tracing
+    const void* real; // address of the handler label for this op
+    int op;
+    int L;
+    int M;
+    int target; // decoded index of a JMP, JPC or CAL target
+} decoded_t;
+
+//decoded text, kept from run to run so a batch worker reuses its buffer
+_Thread_local decoded_t* decodedCode = NULL;
+_Thread_local int decodedCapacity = 0;
+
+//direct-threaded engine: the text segment is decoded once into handler addresses so every
+//instruction, including each OPR sub-op, costs a single indirect jump instead of two switches
+//returns -1 without running anything if the text cannot be pre-decoded
+int runThreaded(CPU cpu) {
+#if defined(__GNUC__)
+    static const void* oprHandlers[] = {
+        &&do_rtn, &&do_add, &&do_sub, &&do_mul, &&do_div, &&do_eql,
+        &&do_neq, &&do_lss, &&do_leq, &&do_gtr, &&do_geq, &&do_odd
+    };
+    static const void* sysHandlers[] = {&&do_nop, &&do_write, &&do_read, &&do_halt};
+    int n = (textEnd - TEXT_BASE) / 3;
+    decoded_t* code;
+    decoded_t* ip;
+    decoded_t* cur;
+    decoded_t* prev = NULL;
+    long long count = 1;
+    int pc;
+
+    if (n + 1 > decodedCapacity) {
+        free(decodedCode);
+        decodedCode = malloc((n + 1) * sizeof(decoded_t));
+        decodedCapacity = decodedCode != NULL ? n + 1 : 0;
+    }
+    code = decodedCode;
+    if (code == NULL || (cpu.pc - TEXT_BASE) % 3 != 0 || cpu.pc < TEXT_BASE || cpu.pc >= textEnd)
+        return -1;
+
+    //decode
+    for (int i = 0; i < n; i++) {
+        decoded_t* d = &code[i];
+        d->op = text[i * 3];
+        d->L = text[i * 3 + 1];
+        d->M = text[i * 3 + 2];
+        d->target = 0;
+        switch (d->op) {
+            case 1:
+                d->handler = &&do_lit;
+                break;
+            case 2:
+                d->handler = (d->M >= 0 && d->M <= 11) ? oprHandlers[d->M] : &&do_nop;
+                break;
+            case 3:
+                d->handler = &&do_lod;
+                break;
+            case 4:
+                d->handler = &&do_sto;
+                break;
+            case 6:
+                d->handler = &&do_inc;
+                break;
+            case 10:
+                d->handler = &&do_stk;
+                break;
+            case 11:
+                d->handler = &&do_ldx;
+                break;
+            case 12:
+                d->handler = &&do_stx;
+                break;
+            case 14:
+                d->handler = &&do_den;
+                break;
+            case 15:
+                d->handler = &&do_drt;
+                break;
+            case 5:
+            case 7:
+            case 8:
+            case 13:
+                //jump targets must land on an instruction (or just past the last one)
+                if (d->M < TEXT_BASE || d->M > textEnd || (d->M - TEXT_BASE) % 3 != 0)
+                    return -1;
+                d->target = (d->M - TEXT_BASE) / 3;
+                d->handler = d->op == 5 ? &&do_cal : d->op == 7 ? &&do_jmp : d->op == 8 ? &&do_jpc : &&do_clx;
+                break;
+            case 9:
+                d->handler = (d->M >= 0 && d->M <= 3) ? sysHandlers[d->M] : &&do_nop;
+                break;
+            default:
+                d->handler = &&do_nop;
+                break;
+        }
+    }
+    //falling off the end of the text is caught by a sentinel
+    code[n].handler = &&do_end;
+    code[n].op = code[n].L = code[n].M = code[n].target = 0;
+
+    //when tracing every instruction first passes through do_trace, otherwise handlers chain directly
+    for (int i = 0; i <= n; i++) {
+        code[i].real = code[i].handler;
+        if (traceFile != NULL)
+            code[i].handler = &&do_trace;
+    }
+
+#define NEXT() \
+    do { \
+        count++; \
+        cur = ip++; \
+        goto *cur->handler; \
+    } while (0)
+
+    ip = code + (cpu.pc - TEXT_BASE) / 3;
+    cur = ip++;
+    goto *cur->handler;
+
+do_trace:
+    //record the previous instruction now that it has finished
+    if (prev != NULL) {
+        cpu.pc = (int)(cur - code) * 3 + TEXT_BASE;
+        cpu.ir[0] = prev->op;
+        cpu.ir[1] = prev->L;
+        cpu.ir[2] = prev->M;
+        traceStep(cpu);
+    }
+    prev = cur;
+    goto *cur->real;
+do_lit:
+    cpu.sp -= 1;
+    pas[cpu.sp] = cur->M;
+    NEXT();
+do_rtn:
+    cpu.sp = cpu.bp + 1;
+    cpu.bp = pas[cpu.sp - 2];
+    pc = pas[cpu.sp - 3];
+    if (pc < TEXT_BASE || pc > textEnd || (pc - TEXT_BASE) % 3 != 0)
+        goto do_end;
+    ip = code + (pc - TEXT_BASE) / 3;
+    NEXT();
+do_add:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] + pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_sub:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] - pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_mul:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] * pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_div:
+    executed = count;
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] / pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_eql:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] == pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_neq:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] != pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_lss:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] < pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_leq:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] <= pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_gtr:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] > pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_geq:
+    pas[cpu.sp + 1] = pas[cpu.sp + 1] >= pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_odd:
+    pas[cpu.sp] = pas[cpu.sp] % 2 != 0;
+    NEXT();
+do_lod:
+    cpu.sp -= 1;
+    pas[cpu.sp] = pas[base(cpu.bp, cur->L) - cur->M];
+    NEXT();
+do_sto:
+    pas[base(cpu.bp, cur->L) - cur->M] = pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_stk:
+    pas[base(cpu.bp, cur->L) - cur->M] = pas[cpu.sp];
+    NEXT();
+do_cal:
+    pas[cpu.sp - 1] = base(cpu.bp, cur->L);
+    pas[cpu.sp - 2] = cpu.bp;
+    pas[cpu.sp - 3] = (int)(ip - code) * 3 + TEXT_BASE;
+    cpu.bp = cpu.sp - 1;
+    ip = code + cur->target;
+    NEXT();
+do_ldx:
+    cpu.sp -= 1;
+    pas[cpu.sp] = pas[display[cur->L] - cur->M];
+    NEXT();
+do_stx:
+    pas[display[cur->L] - cur->M] = pas[cpu.sp];
+    cpu.sp += 1;
+    NEXT();
+do_clx:
+    pas[cpu.sp - 1] = display[cur->L];
+    pas[cpu.sp - 2] = cpu.bp;
+    pas[cpu.sp - 3] = (int)(ip - code) * 3 + TEXT_BASE;
+    cpu.bp = cpu.sp - 1;
+    ip = code + cur->target;
+    NEXT();
+do_den:
+    pas[cpu.bp - cur->M] = display[cur->L];
+    display[cur->L] = cpu.bp;
+    NEXT();
+do_drt:
+    display[cur->L] = pas[cpu.bp - cur->M];
+    goto do_rtn;
+do_inc:
+    cpu.sp = cpu.sp - cur->M;
+    NEXT();
+do_jmp:
+    ip = code + cur->target;
+    NEXT();
+do_jpc:
+    if (pas[cpu.sp] == 0)
+        ip = code + cur->target;
+    cpu.sp++;
+    NEXT();
+do_write:
+    fprintf(vmOut, "Output result is: %d\n", pas[cpu.sp]);
+    cpu.sp++;
+    NEXT();
+do_read:
+    cpu.sp--;
+    fprintf(vmOut, "Please enter an integer: ");
+    fscanf(vmIn, "%d", &pas[cpu.sp]);
+    NEXT();
+do_nop:
+    NEXT();
+do_halt:
+    if (traceFile != NULL) {
+        cpu.pc = (int)(ip - code) * 3 + TEXT_BASE;
+        cpu.ir[0] = cur->op;
+        cpu.ir[1] = cur->L;
+        cpu.ir[2] = cur->M;
+        traceStep(cpu);
+    }
+    executed = count;
+    return 0;
+do_end:
+    vmStatus = VM_LEFT_TEXT;
+    executed = count;
+    return 0;
+
+#undef NEXT
+#else
+    //computed goto is a GNU extension, other compilers stay on the switch engine
+    return -1;
+#endif
+}
+
+//interpreter for the register ISA, R(x) is register x of the running frame
+void runRegister(CPU cpu) {
+    const int* ins;
+    int pc = cpu.pc;
+    int bp = cpu.bp;
+    int sp = cpu.sp;
+    long long count = 0;
+
+#define R(x) pas[bp - (x)]
+    for (;;) {
+        if (pc < 0 || pc >= regCount) {
+            vmStatus = VM_LEFT_TEXT;
             break;
+        }
+        ins = text + pc * 4;
+        pc++;
+        count++;
+        switch (ins[0]) {
+            case RLI:
+                R(ins[1]) = ins[2];
+                break;
+            case RMOV:
+                R(ins[1]) = R(ins[2]);
+                break;
+            case RADD:
+                R(ins[1]) = R(ins[2]) + R(ins[3]);
+                break;
+            case RSUB:
+                R(ins[1]) = R(ins[2]) - R(ins[3]);
+                break;
+            case RMUL:
+                R(ins[1]) = R(ins[2]) * R(ins[3]);
+                break;
+            case RDIV:
+                executed = count;
+                R(ins[1]) = R(ins[2]) / R(ins[3]);
+                break;
+            case REQL:
+                R(ins[1]) = R(ins[2]) == R(ins[3]);
+                break;
+            case RNEQ:
+                R(ins[1]) = R(ins[2]) != R(ins[3]);
+                break;
+            case RLSS:
+                R(ins[1]) = R(ins[2]) < R(ins[3]);
+                break;
+            case RLEQ:
+                R(ins[1]) = R(ins[2]) <= R(ins[3]);
+                break;
+            case RGTR:
+                R(ins[1]) = R(ins[2]) > R(ins[3]);
+                break;
+            case RGEQ:
+                R(ins[1]) = R(ins[2]) >= R(ins[3]);
+                break;
+            case RADDI:
+                R(ins[1]) = R(ins[2]) + ins[3];
+                break;
+            case RSUBI:
+                R(ins[1]) = R(ins[2]) - ins[3];
+                break;
+            case RMULI:
+                R(ins[1]) = R(ins[2]) * ins[3];
+                break;
+            case RDIVI:
+                executed = count;
+                R(ins[1]) = R(ins[2]) / ins[3];
+                break;
+            case REQLI:
+                R(ins[1]) = R(ins[2]) == ins[3];
+                break;
+            case RNEQI:
+                R(ins[1]) = R(ins[2]) != ins[3];
+                break;
+            case RLSSI:
+                R(ins[1]) = R(ins[2]) < ins[3];
+                break;
+            case RLEQI:
+                R(ins[1]) = R(ins[2]) <= ins[3];
+                break;
+            case RGTRI:
+                R(ins[1]) = R(ins[2]) > ins[3];
+                break;
+            case RGEQI:
+                R(ins[1]) = R(ins[2]) >= ins[3];
+                break;
+            case RODD:
+                R(ins[1]) = R(ins[2]) % 2 != 0;
+                break;
+            case RLDN:
+                R(ins[1]) = pas[base(bp, ins[2]) - ins[3]];
+                break;
+            case RSTN:
+                pas[base(bp, ins[2]) - ins[3]] = R(ins[1]);
+                break;
+            case RJMP:
+                pc = ins[3];
+                break;
+            case RJZ:
+                if (R(ins[1]) == 0)
+                    pc = ins[3];
+                break;
+            case RBEQL:
+                if (!(R(ins[1]) == R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBNEQ:
+                if (!(R(ins[1]) != R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBLSS:
+                if (!(R(ins[1]) < R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBLEQ:
+                if (!(R(ins[1]) <= R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBGTR:
+                if (!(R(ins[1]) > R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBGEQ:
+                if (!(R(ins[1]) >= R(ins[2])))
+                    pc = ins[3];
+                break;
+            case RBEQLI:
+                if (!(R(ins[1]) == ins[2]))
+                    pc = ins[3];
+                break;
+            case RBNEQI:
+                if (!(R(ins[1]) != ins[2]))
+                    pc = ins[3];
+                break;
+            case RBLSSI:
+                if (!(R(ins[1]) < ins[2]))
+                    pc = ins[3];
+                break;
+            case RBLEQI:
+                if (!(R(ins[1]) <= ins[2]))
+                    pc = ins[3];
+                break;
+            case RBGTRI:
+                if (!(R(ins[1]) > ins[2]))
+                    pc = ins[3];
+                break;
+            case RBGEQI:
+                if (!(R(ins[1]) >= ins[2]))
+                    pc = ins[3];
+                break;
+            case RCAL:
+                //same activation record layout as CAL
+                pas[sp - 1] = base(bp, ins[2]);
+                pas[sp - 2] = bp;
+                pas[sp - 3] = pc;
+                bp = sp - 1;
+                pc = ins[3];
+                break;
+            case RINC:
+                sp = sp - ins[1];
+                break;
+            case RRTN:
+                sp = bp + 1;
+                bp = pas[sp - 2];
+                pc = pas[sp - 3];
+                break;
+            case RWRITE:
+                fprintf(vmOut, "Output result is: %d\n", R(ins[1]));
+                break;
+            case RREAD:
+                fprintf(vmOut, "Please enter an integer: ");
+                fscanf(vmIn, "%d", &R(ins[1]));
+                break;
+            case RHALT:
+                executed = count;
+                return;
+        }
+    }
+#undef R
+    executed = count;
+}
+
+/************************************************************
+*
+*   JIT
+*
+************************************************************/
+
+#if defined(__x86_64__) && defined(__GNUC__)
+//x86-64 registers, the low three bits go in ModRM/SIB and bit 3 in the REX prefix
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+//generated code keeps these in callee-saved registers:
+//  rbx  &pas[0]
+//  r12  sp, minus the words pushed since the last flush (jitOff)
+//  r13  bp
+//  r14  &display[0]
+//  r15  native address of every pc, for RTN
+//eax and ecx cache the top two stack words, rdx and esi are scratch
+typedef int (*jit_entry_t)(int* pas, long sp, long bp, const void* start, void** pcTable, int* display);
+
+_Thread_local unsigned char* jitCode = NULL; // code being assembled, copied into an executable mapping when done
+_Thread_local size_t jitSize = 0;
+_Thread_local size_t jitCapacity = 0;
+_Thread_local int jitOff = 0; // sp = r12 + jitOff
+_Thread_local int jitCached = 0; // how many of the top stack words eax (top) and ecx (below it) hold
+_Thread_local unsigned char* jitExec = NULL; // the running code and its pc table, until jitRelease
+_Thread_local size_t jitExecSize = 0;
+_Thread_local void** jitTable = NULL;
+
+void jitByte(int b) {
+    if (jitSize == jitCapacity) {
+        jitCapacity = jitCapacity > 0 ? jitCapacity * 2 : 4096;
+        jitCode = realloc(jitCode, jitCapacity);
+        if (jitCode == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    jitCode[jitSize++] = b;
+}
+
+void jitWord(int32_t w) {
+    for (int i = 0; i < 4; i++)
+        jitByte((uint32_t)w >> (8 * i) & 0xff);
+}
+
+//opcodes above 0xff are two bytes, 0x0f first
+void jitOpcode(int w, int reg, int index, int base, int opcode) {
+    int rex = 0x40 | w << 3 | (reg >> 3) << 2 | (index >> 3 & 1) << 1 | base >> 3;
+    if (rex != 0x40)
+        jitByte(rex);
+    if (opcode > 0xff)
+        jitByte(opcode >> 8);
+    jitByte(opcode & 0xff);
+}
+
+//op reg, [base + index * scale + disp], index -1 for none
+void jitMem(int w, int opcode, int reg, int base, int index, int scale, int32_t disp) {
+    int mod = disp == 0 && (base & 7) != RBP ? 0 : (disp >= -128 && disp <= 127 ? 1 : 2);
+
+    jitOpcode(w, reg, index < 0 ? 0 : index, base, opcode);
+    if (index < 0 && (base & 7) != RSP)
+        jitByte(mod << 6 | (reg & 7) << 3 | (base & 7));
+    else {
+        jitByte(mod << 6 | (reg & 7) << 3 | RSP);
+        jitByte((scale == 8 ? 3 : scale == 4 ? 2 : 0) << 6 | (index < 0 ? RSP : index & 7) << 3 | (base & 7));
+    }
+    if (mod == 1)
+        jitByte(disp & 0xff);
+    else if (mod == 2)
+        jitWord(disp);
+}
+
+//op reg, rm between registers
+void jitReg(int w, int opcode, int reg, int rm) {
+    jitOpcode(w, reg, 0, rm, opcode);
+    jitByte(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+//op reg, pas[sp + d]
+void jitStack(int opcode, int reg, int d) {
+    jitMem(0, opcode, reg, RBX, R12, 4, 4 * (jitOff + d));
+}
+
+//rel32 jump or jcc (0x0f8x) to a native offset that is already known
+void jitJumpTo(int opcode, size_t target) {
+    jitOpcode(0, 0, 0, 0, opcode);
+    jitWord((int32_t)(target - (jitSize + 4)));
+}
+
+//moves r12 up to the real sp
+void jitFlush() {
+    if (jitOff != 0)
+        jitMem(1, 0x8d, R12, R12, -1, 0, jitOff); // lea r12, [r12 + off]
+    jitOff = 0;
+}
+
+//makes eax (and ecx) hold the top n stack words
+void jitLoad(int n) {
+    if (jitCached < 1)
+        jitStack(0x8b, RAX, 0);
+    if (n == 2 && jitCached < 2)
+        jitStack(0x8b, RCX, 1);
+    if (jitCached < n)
+        jitCached = n;
+}
+
+//makes room for a value that is about to be loaded into eax and pushed
+void jitPushPrep() {
+    if (jitCached >= 1)
+        jitReg(0, 0x89, RAX, RCX); // mov ecx, eax
+    jitCached = jitCached >= 1 ? 2 : 1;
+}
+
+//pushes eax, which jitPushPrep made room for
+void jitPush() {
+    jitStack(0x89, RAX, -1);
+    jitOff--;
+}
+
+//index register holding base(bp, L), walking the static links into rdx
+int jitFrame(int L) {
+    if (L <= 0)
+        return R13;
+    jitMem(1, 0x63, RDX, RBX, R13, 4, 0); // movsxd rdx, [rbx + r13 * 4]
+    while (--L > 0)
+        jitMem(1, 0x63, RDX, RBX, RDX, 4, 0);
+    return RDX;
+}
+
+//movsxd rdx, display[L]
+void jitDisplay(int L) {
+    jitMem(1, 0x63, RDX, R14, -1, 0, 4 * L);
+}
+
+//RTN once display entries are restored, the shared return stub looks the pc up in r15
+void jitReturn(size_t returnStub) {
+    jitMem(1, 0x63, RAX, RBX, R13, 4, -8); // return address
+    jitMem(1, 0x8d, R12, R13, -1, 0, 1); // sp = bp + 1
+    jitMem(1, 0x63, R13, RBX, R13, 4, -4); // dynamic link
+    jitJumpTo(0xe9, returnStub);
+}
+
+//calls a C function, whose first argument is already in rdi
+void jitCall(void* fn) {
+    jitByte(0x48);
+    jitByte(0xb8);
+    for (int i = 0; i < 8; i++)
+        jitByte((uint64_t)(uintptr_t)fn >> (8 * i) & 0xff);
+    jitReg(0, 0xff, 2, RAX); // call rax
+    jitCached = 0;
+}
+
+//SYS 1 and 2, called from generated code so the output goes through the same stdio buffers
+void jitWrite(int value) {
+    fprintf(vmOut, "Output result is: %d\n", value);
+}
+
+void jitRead(int* slot) {
+    fprintf(vmOut, "Please enter an integer: ");
+    fscanf(vmIn, "%d", slot);
+}
+
+//unmaps the code of the last run, which a trap in batch mode leaves behind
+void jitRelease() {
+    if (jitExec != NULL)
+        munmap(jitExec, jitExecSize);
+    free(jitTable);
+    jitExec = NULL;
+    jitTable = NULL;
+}
+#endif
+
+//translates the text segment into x86-64 code and runs it
+//returns -1 without running anything if this is not an x86-64 GCC/Clang build or the text has
+//something the translator does not handle (a jump off the instruction grid, an out of range offset)
+int runJit(CPU cpu) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    static const int compareCodes[] = {0x94, 0x95, 0x9c, 0x9e, 0x9f, 0x9d}; // sete .. setge for EQL .. GEQ
+    int n = (textEnd - TEXT_BASE) / 3;
+    char* leader = calloc(n + 1, 1);
+    size_t* native = malloc((n + 1) * sizeof(size_t)); // code offset of each instruction
+    int* stateOff = malloc((n + 1) * sizeof(int)); // jitOff and jitCached at each instruction
+    int* stateCached = malloc((n + 1) * sizeof(int));
+    size_t* fixPos = malloc((n + 1) * sizeof(size_t)); // rel32 words that jump to an instruction
+    int* fixTarget = malloc((n + 1) * sizeof(int));
+    void** pcTable = malloc((textEnd + 1) * sizeof(void*));
+    size_t* entryAt = malloc((n + 1) * sizeof(size_t)); // where RTN lands for each instruction
+    int fixCount = 0;
+    int status = -1;
+
+    if (traceFile != NULL || leader == NULL || native == NULL || stateOff == NULL || stateCached == NULL
+        || fixPos == NULL || fixTarget == NULL || pcTable == NULL || entryAt == NULL
+        || cpu.pc < TEXT_BASE || cpu.pc >= textEnd || (cpu.pc - TEXT_BASE) % 3 != 0)
+        goto done;
+
+    //blocks start at jump targets, return points and the entry, the stack cache is empty there
+    leader[(cpu.pc - TEXT_BASE) / 3] = 1;
+    for (int i = 0; i < n; i++) {
+        int op = text[i * 3], L = text[i * 3 + 1], M = text[i * 3 + 2];
+        if (op == 5 || op == 7 || op == 8 || op == 13) {
+            if (M < TEXT_BASE || M > textEnd || (M - TEXT_BASE) % 3 != 0)
+                goto done;
+            leader[(M - TEXT_BASE) / 3] = 1;
+            if (op == 5 || op == 13)
+                leader[i + 1] = 1;
+        }
+        //operands must fit the addressing modes used below
+        if ((op == 3 || op == 4 || op == 10 || op == 5) && L > 64)
+            goto done;
+        if ((op >= 3 && op <= 4) || (op >= 10 && op <= 15)) {
+            if (M <= -(1 << 28) || M >= 1 << 28)
+                goto done;
+        }
+        if (op == 6 && (M <= -(1 << 20) || M >= 1 << 20))
+            goto done;
+    }
+
+    jitSize = 0;
+    jitOff = 0;
+    jitCached = 0;
+
+    //prologue: save the callee-saved registers, keep rsp 16 byte aligned for calls into C
+    int saved[] = {RBP, RBX, R12, R13, R14, R15};
+    for (int r = 0; r < 6; r++) {
+        if (saved[r] >= 8)
+            jitByte(0x41);
+        jitByte(0x50 + (saved[r] & 7));
+    }
+    jitByte(0x48), jitByte(0x83), jitByte(0xec), jitByte(0x08); // sub rsp, 8
+    jitReg(1, 0x89, RDI, RBX);
+    jitReg(1, 0x89, RSI, R12);
+    jitReg(1, 0x89, RDX, R13);
+    jitReg(1, 0x89, R9, R14);
+    jitReg(1, 0x89, R8, R15);
+    jitReg(0, 0xff, 4, RCX); // jmp rcx
+
+    //exit with the status in eax, 0 for halt and 1 for a pc off the text
+    size_t haltStub = jitSize;
+    jitByte(0x31), jitByte(0xc0); // xor eax, eax
+    size_t exitStub = jitSize;
+    jitByte(0x48), jitByte(0x83), jitByte(0xc4), jitByte(0x08); // add rsp, 8
+    for (int r = 5; r >= 0; r--) {
+        if (saved[r] >= 8)
+            jitByte(0x41);
+        jitByte(0x58 + (saved[r] & 7));
+    }
+    jitByte(0xc3);
+    size_t endStub = jitSize;
+    jitByte(0xb8), jitWord(1); // mov eax, 1
+    jitJumpTo(0xe9, exitStub);
+
+    //return: rax holds the pc, every pc up to textEnd has a table entry
+    size_t returnStub = jitSize;
+    jitReg(1, 0x81, 7, RAX), jitWord(textEnd); // cmp rax, textEnd
+    jitJumpTo(0x0f87, endStub); // ja
+    jitMem(0, 0xff, 4, R15, RAX, 8, 0); // jmp [r15 + rax * 8]
+
+    for (int i = 0; i < n; i++) {
+        int op = text[i * 3], L = text[i * 3 + 1], M = text[i * 3 + 2];
+        int frame;
+
+        if (leader[i]) {
+            jitFlush();
+            jitCached = 0;
+        }
+        native[i] = jitSize;
+        stateOff[i] = jitOff;
+        stateCached[i] = jitCached;
+
+        switch (op) {
+            //LIT
+            case 1:
+                jitPushPrep();
+                jitByte(0xb8), jitWord(M); // mov eax, M
+                jitPush();
+                break;
+            //OPR
+            case 2:
+                if (M == 0) {
+                    jitReturn(returnStub);
+                    jitOff = jitCached = 0;
+                }
+                else if (M >= 1 && M <= 10) {
+                    jitLoad(2);
+                    if (M == 1)
+                        jitReg(0, 0x01, RCX, RAX); // add eax, ecx
+                    else if (M == 2) {
+                        jitReg(0, 0x29, RAX, RCX); // sub ecx, eax
+                        jitReg(0, 0x89, RCX, RAX);
+                    }
+                    else if (M == 3)
+                        jitReg(0, 0x0faf, RAX, RCX); // imul eax, ecx
+                    else if (M == 4) {
+                        //traps on a zero divisor exactly like the interpreters
+                        jitReg(0, 0x89, RAX, RSI);
+                        jitReg(0, 0x89, RCX, RAX);
+                        jitByte(0x99); // cdq
+                        jitReg(0, 0xf7, 7, RSI); // idiv esi
+                    }
+                    else {
+                        jitReg(0, 0x39, RAX, RCX); // cmp ecx, eax
+                        jitReg(0, 0x0f00 | compareCodes[M - 5], 0, RAX); // setcc al
+                        jitReg(0, 0x0fb6, RAX, RAX); // movzx eax, al
+                    }
+                    jitStack(0x89, RAX, 1);
+                    jitOff++;
+                    jitCached = 1;
+                }
+                else if (M == 11) {
+                    jitLoad(1);
+                    jitReg(0, 0x83, 4, RAX), jitByte(1); // and eax, 1
+                    jitStack(0x89, RAX, 0);
+                }
+                break;
+            //LOD
+            case 3:
+                jitPushPrep();
+                frame = jitFrame(L);
+                jitMem(0, 0x8b, RAX, RBX, frame, 4, -4 * M);
+                jitPush();
+                break;
+            //STO, STK
+            case 4:
+            case 10:
+                jitLoad(1);
+                frame = jitFrame(L);
+                jitMem(0, 0x89, RAX, RBX, frame, 4, -4 * M);
+                //the store may have hit a cached word, only STK keeps the top it just wrote
+                if (op == 4) {
+                    jitOff++;
+                    jitCached = 0;
+                }
+                else
+                    jitCached = 1;
+                break;
+            //CAL, CLX
+            case 5:
+            case 13:
+                jitFlush();
+                if (op == 5) {
+                    frame = jitFrame(L);
+                    if (frame == R13)
+                        jitReg(0, 0x89, R13, RDX);
+                }
+                else
+                    jitDisplay(L);
+                jitMem(0, 0x89, RDX, RBX, R12, 4, -4); // static link
+                jitMem(0, 0x89, R13, RBX, R12, 4, -8); // dynamic link
+                jitMem(0, 0xc7, 0, RBX, R12, 4, -12), jitWord((i + 1) * 3 + TEXT_BASE); // return address
+                jitMem(1, 0x8d, R13, R12, -1, 0, -1); // bp = sp - 1
+                jitByte(0xe9), jitWord(0);
+                fixPos[fixCount] = jitSize - 4;
+                fixTarget[fixCount++] = (M - TEXT_BASE) / 3;
+                jitCached = 0;
+                break;
+            //INC
+            case 6:
+                jitOff -= M;
+                jitCached = 0;
+                break;
+            //JMP
+            case 7:
+                jitFlush();
+                jitByte(0xe9), jitWord(0);
+                fixPos[fixCount] = jitSize - 4;
+                fixTarget[fixCount++] = (M - TEXT_BASE) / 3;
+                jitCached = 0;
+                break;
+            //JPC
+            case 8:
+                jitLoad(1);
+                jitReg(0, 0x85, RAX, RAX); // test eax, eax
+                jitOff++;
+                jitFlush(); // lea leaves the flags alone
+                jitByte(0x0f), jitByte(0x84), jitWord(0); // je
+                fixPos[fixCount] = jitSize - 4;
+                fixTarget[fixCount++] = (M - TEXT_BASE) / 3;
+                if (jitCached == 2)
+                    jitReg(0, 0x89, RCX, RAX);
+                jitCached = jitCached == 2 ? 1 : 0;
+                break;
+            //SYS
+            case 9:
+                if (M == 1) {
+                    jitLoad(1);
+                    jitReg(0, 0x89, RAX, RDI);
+                    jitCall((void*)jitWrite);
+                    jitOff++;
+                }
+                else if (M == 2) {
+                    jitMem(1, 0x8d, RDI, RBX, R12, 4, 4 * (jitOff - 1)); // lea rdi, pas[sp - 1]
+                    jitCall((void*)jitRead);
+                    jitOff--;
+                }
+                else if (M == 3) {
+                    jitJumpTo(0xe9, haltStub);
+                    jitOff = jitCached = 0;
+                }
+                break;
+            //LDX
+            case 11:
+                jitPushPrep();
+                jitDisplay(L);
+                jitMem(0, 0x8b, RAX, RBX, RDX, 4, -4 * M);
+                jitPush();
+                break;
+            //STX
+            case 12:
+                jitLoad(1);
+                jitDisplay(L);
+                jitMem(0, 0x89, RAX, RBX, RDX, 4, -4 * M);
+                jitOff++;
+                jitCached = 0;
+                break;
+            //DEN
+            case 14:
+                jitMem(0, 0x8b, RDX, R14, -1, 0, 4 * L);
+                jitMem(0, 0x89, RDX, RBX, R13, 4, -4 * M);
+                jitMem(0, 0x89, R13, R14, -1, 0, 4 * L);
+                jitCached = 0;
+                break;
+            //DRT
+            case 15:
+                jitMem(0, 0x8b, RDX, RBX, R13, 4, -4 * M);
+                jitMem(0, 0x89, RDX, R14, -1, 0, 4 * L);
+                jitReturn(returnStub);
+                jitOff = jitCached = 0;
+                break;
+            //anything else does nothing, as in the interpreters
+        }
+        //the cache never gets far from r12
+        if (jitOff <= -(1 << 20) || jitOff >= 1 << 20)
+            jitFlush();
+    }
+    //falling off the end
+    jitFlush();
+    native[n] = jitSize;
+    jitJumpTo(0xe9, endStub);
+
+    //RTN may land in the middle of a block, give those instructions an entry that sets up
+    //r12 and the cache the way the code before them left it
+    for (int i = 0; i < n; i++) {
+        if (stateOff[i] == 0 && stateCached[i] == 0) {
+            entryAt[i] = native[i];
+            continue;
+        }
+        entryAt[i] = jitSize;
+        jitMem(1, 0x8d, R12, R12, -1, 0, -stateOff[i]);
+        jitOff = stateOff[i];
+        jitCached = 0;
+        jitLoad(stateCached[i]);
+        jitJumpTo(0xe9, native[i]);
+    }
+    for (int f = 0; f < fixCount; f++) {
+        int32_t rel = (int32_t)(native[fixTarget[f]] - (fixPos[f] + 4));
+        memcpy(jitCode + fixPos[f], &rel, 4);
+    }
+
+    //write the code, then make it executable and read only
+    long page = sysconf(_SC_PAGESIZE);
+    size_t mapSize = (jitSize + page - 1) / page * page;
+    unsigned char* exec = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (exec == MAP_FAILED)
+        goto done;
+    memcpy(exec, jitCode, jitSize);
+    if (mprotect(exec, mapSize, PROT_READ | PROT_EXEC) != 0) {
+        munmap(exec, mapSize);
+        goto done;
+    }
+    for (int pc = 0; pc <= textEnd; pc++) {
+        int i = (pc - TEXT_BASE) / 3;
+        if (pc < TEXT_BASE || (pc - TEXT_BASE) % 3 != 0 || i >= n)
+            pcTable[pc] = exec + endStub;
+        else
+            pcTable[pc] = exec + entryAt[i];
+    }
+
+    jitExec = exec;
+    jitExecSize = mapSize;
+    jitTable = pcTable;
+    pcTable = NULL;
+    status = 0;
+
+done:
+    free(leader);
+    free(native);
+    free(stateOff);
+    free(stateCached);
+    free(fixPos);
+    free(fixTarget);
+    free(pcTable);
+    free(entryAt);
+    free(jitCode);
+    jitCode = NULL;
+    jitCapacity = 0;
+    //the translator's tables are gone before the code runs, only jitExec and jitTable are live
+    if (status == 0) {
+        jit_entry_t entry = (jit_entry_t)jitExec;
+        executed = -1;
+        if (entry(pas, cpu.sp, cpu.bp, jitTable[cpu.pc], jitTable, display) != 0)
+            vmStatus = VM_LEFT_TEXT;
+        jitRelease();
+    }
+    return status;
+#else
+    //the translator only emits x86-64, other machines stay on the interpreters
+    (void)cpu;
+    return -1;
+#endif
+}
+
+/************************************************************
+*
+*   LOADING
+*
+************************************************************/
+
+//maps a binary image and points text at its code section, anything else is read as text
+int loadImage(const char* fname, CPU* cpu) {
+    struct stat st;
+    const image_header_t* header;
+    const image_section_t* sections;
+    const unsigned char* map;
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "cannot open %s\n", fname);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(image_header_t)) {
+        close(fd);
+        return loadText(fopen(fname, "r"), cpu);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "cannot map %s\n", fname);
+        return -1;
+    }
+    header = (const image_header_t*)map;
+    if (memcmp(header->magic, IMAGE_MAGIC, 4) != 0) {
+        munmap((void*)map, st.st_size);
+        return loadText(fopen(fname, "r"), cpu);
     }
+
+    //binary image, the mapping stays alive until unloadImage or the process exits
+    imageMap = map;
+    imageSize = st.st_size;
+    if (header->version != IMAGE_VERSION
+        || sizeof(image_header_t) + header->sectionCount * sizeof(image_section_t) > (size_t)st.st_size) {
+        fprintf(stderr, "%s: unsupported image version\n", fname);
+        return -1;
+    }
+    //the code lives in its own segment, so the stack has all of pas
+    if (header->maxStack > ARRAY_SIZE) {
+        fprintf(stderr, "%s: needs %u words of stack, the VM has %d\n", fname, header->maxStack, ARRAY_SIZE);
+        return -1;
+    }
+    regIsa = (header->flags & IMAGE_FLAG_REGISTER) != 0;
+    sections = (const image_section_t*)(header + 1);
+    for (int i = 0; i < header->sectionCount; i++) {
+        if (sections[i].kind == SECTION_SYMBOLS && !regIsa
+            && (uint64_t)sections[i].offset + sections[i].size <= (uint64_t)st.st_size && sections[i].offset % 4 == 0) {
+            symbols = (const image_symbol_t*)(map + sections[i].offset);
+            symbolCount = sections[i].size / sizeof(image_symbol_t);
+        }
+    }
+    for (int i = 0; i < header->sectionCount; i++) {
+        if (sections[i].kind != SECTION_CODE)
+            continue;
+        if ((uint64_t)sections[i].offset + sections[i].size > (uint64_t)st.st_size || sections[i].offset % 4 != 0
+            || sections[i].size != header->codeLength * (regIsa ? 4 : 3) * sizeof(int32_t)) {
+            fprintf(stderr, "%s: corrupt code section\n", fname);
+            return -1;
+        }
+        text = (const int*)(map + sections[i].offset);
+        textEnd = TEXT_BASE + header->codeLength * 3;
+        regCount = header->codeLength;
+        cpu->pc = header->entry;
+        return 0;
+    }
+    fprintf(stderr, "%s: no code section\n", fname);
+    return -1;
+}
+
+//reads whitespace separated instruction words, register ISA text starts with "reg"
+int loadText(FILE* file, CPU* cpu) {
+    int capacity = 3 * 64;
+    int count = 0;
+    int* words = malloc(capacity * sizeof(int));
+
+    if (file == NULL || words == NULL) {
+        fprintf(stderr, "cannot read text image\n");
+        return -1;
+    }
+    int c = fgetc(file);
+    while (c != EOF && isspace(c))
+        c = fgetc(file);
+    if (c == 'r') {
+        regIsa = 1;
+        cpu->pc = 0;
+        fscanf(file, "%*s");
+    }
+    else if (c != EOF)
+        ungetc(c, file);
+    while (fscanf(file, "%d", &words[count]) == 1) {
+        count++;
+        if (count == capacity) {
+            capacity *= 2;
+            words = realloc(words, capacity * sizeof(int));
+            if (words == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return -1;
+            }
+        }
+    }
+    fclose(file);
+
+    textWords = words;
+    text = words;
+    textEnd = TEXT_BASE + count - count % 3;
+    regCount = count / 4;
+    return 0;
+}
+
+//releases the loaded image, so a batch worker can load the next one
+void unloadImage() {
+    if (imageMap != NULL)
+        munmap((void*)imageMap, imageSize);
+    free(textWords);
+    imageMap = NULL;
+    textWords = NULL;
+    text = NULL;
+    textEnd = TEXT_BASE;
+    symbols = NULL;
+    symbolCount = 0;
+}
+
+//the display instructions index display[] with L, refuse code that would leave it
+int checkDisplay() {
+    for (int i = 0; !regIsa && i + 3 <= textEnd - TEXT_BASE; i += 3) {
+        if (text[i] >= 11 && text[i] <= 15 && (text[i + 1] < 0 || text[i + 1] >= DISPLAY_SIZE)) {
+            fprintf(stderr, "level %d at pc %d is outside the display\n", text[i + 1], i + TEXT_BASE);
+            return -1;
+        }
+    }
+    return 0;
 }
 
 int base( int BP, int L) {
@@ -273,39 +1636,669 @@ int base( int BP, int L) {
     return arb;
 }
 
-//prints stack
-void printStack(CPU cpu) {
-    int currentBP = cpu.bp;
+/************************************************************
+*
+*   BATCH
+*
+************************************************************/
+
+//puts the thread's VM back in its starting state before a batch job
+void vmReset() {
+    memset(pas, 0, sizeof(pas));
+    memset(display, 0, sizeof(display));
+    regIsa = 0;
+    regCount = 0;
+    executed = 0;
+    vmStatus = VM_HALT;
+    lowestSp = ARRAY_SIZE;
+}
+
+//frees what the engines keep between runs, and what a trap cut short before it could be freed
+void runRelease() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    jitRelease();
+#endif
+    free(decodedCode);
+    decodedCode = NULL;
+    decodedCapacity = 0;
+}
+
+//SIGFPE is raised in the thread that divided, send it back to the job it was running
+void trapHandler(int sig) {
+    (void)sig;
+    siglongjmp(trapJump, 1);
+}
+
+//reads the manifest, runs every job on the worker pool and writes one JSON line per job in
+//manifest order, to resultsName or stdout
+int runBatch(const char* manifest, int workers, const char* resultsName, int threaded, int jit, int stats) {
+    static const char* statusNames[] = {"halt", "left text", "trap", "load error"};
+    FILE* file = fopen(manifest, "r");
+    FILE* results = stdout;
+    char line[BATCH_LINE];
+    char image[BATCH_LINE];
+    char input[BATCH_LINE];
+    int capacity = 0;
+    pthread_t* threads;
+    char* started;
+    struct sigaction action;
+    struct timespec start, end;
+
+    if (file == NULL) {
+        fprintf(stderr, "cannot open %s\n", manifest);
+        return 1;
+    }
+    //one job per line, an image and optionally the file its reads come from; # starts a comment
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int fields = sscanf(line, "%s %s", image, input);
+        if (fields < 1 || image[0] == '#')
+            continue;
+        if (batchJobCount == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 64;
+            batchJobs = realloc(batchJobs, capacity * sizeof(batch_job_t));
+            if (batchJobs == NULL) {
+                fprintf(stderr, "out of memory\n");
+                return 1;
+            }
+        }
+        batch_job_t* job = &batchJobs[batchJobCount++];
+        memset(job, 0, sizeof(batch_job_t));
+        job->image = strdup(image);
+        job->input = fields == 2 ? strdup(input) : NULL;
+        if (job->image == NULL || (fields == 2 && job->input == NULL)) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    fclose(file);
+
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > batchJobCount)
+        workers = batchJobCount;
+    if (workers <= 0)
+        workers = 1;
+    batchWorkers = workers;
+    batchThreaded = threaded;
+    batchJit = jit;
+
+    //deal the jobs out round robin, so a run of long jobs in the manifest is spread over the workers
+    batchQueues = calloc(workers, sizeof(batch_queue_t));
+    threads = malloc(workers * sizeof(pthread_t));
+    started = calloc(workers, 1);
+    if (batchQueues == NULL || threads == NULL || started == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_init(&batchQueues[w].lock, NULL);
+        batchQueues[w].jobs = malloc((batchJobCount / workers + 1) * sizeof(int));
+        if (batchQueues[w].jobs == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    for (int j = 0; j < batchJobCount; j++) {
+        batch_queue_t* queue = &batchQueues[j % workers];
+        queue->jobs[queue->tail++] = j;
+    }
+
+    //a division by zero ends the job that made it, not the batch
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = trapHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGFPE, &action, NULL);
+
+    //the main thread is worker 0, the jobs of a worker that fails to start are stolen by the others
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int w = 1; w < workers; w++) {
+        started[w] = pthread_create(&threads[w], NULL, batchWorker, (void*)(intptr_t)w) == 0;
+        if (!started[w])
+            fprintf(stderr, "cannot start worker %d\n", w);
+    }
+    batchWorker((void*)0);
+    for (int w = 1; w < workers; w++) {
+        if (started[w])
+            pthread_join(threads[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (resultsName != NULL && (results = fopen(resultsName, "w")) == NULL) {
+        fprintf(stderr, "cannot open %s\n", resultsName);
+        return 1;
+    }
+    for (int j = 0; j < batchJobCount; j++) {
+        batch_job_t* job = &batchJobs[j];
+        fprintf(results, "{\"job\": %d, \"image\": ", j);
+        writeJsonString(results, job->image, strlen(job->image));
+        fprintf(results, ", \"input\": ");
+        if (job->input != NULL)
+            writeJsonString(results, job->input, strlen(job->input));
+        else
+            fprintf(results, "null");
+        fprintf(results, ", \"status\": \"%s\", \"instructions\": ", statusNames[job->status]);
+        //native code does not count instructions
+        if (job->executed >= 0)
+            fprintf(results, "%lld", job->executed);
+        else
+            fprintf(results, "null");
+        fprintf(results, ", \"time_s\": %.6f, \"output\": ", job->seconds);
+        writeJsonString(results, job->output, job->outputSize);
+        fprintf(results, "}\n");
+    }
+    if (results != stdout)
+        fclose(results);
+    if (stats)
+        fprintf(stderr, "ran %d jobs on %d workers in %.6f s, %d stolen\n", batchJobCount, workers,
+                (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, atomic_load(&batchSteals));
+
+    for (int j = 0; j < batchJobCount; j++) {
+        free(batchJobs[j].image);
+        free(batchJobs[j].input);
+        free(batchJobs[j].output);
+    }
+    for (int w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&batchQueues[w].lock);
+        free(batchQueues[w].jobs);
+    }
+    free(batchJobs);
+    free(batchQueues);
+    free(threads);
+    free(started);
+    return 0;
+}
+
+//next job for worker self: the head of its own queue, or else the tail of another worker's
+//jobs are never added once the workers start, so finding every queue empty means the batch is done
+int batchTake(int self) {
+    for (int k = 0; k < batchWorkers; k++) {
+        batch_queue_t* queue = &batchQueues[(self + k) % batchWorkers];
+        int j = -1;
+        pthread_mutex_lock(&queue->lock);
+        if (queue->head < queue->tail)
+            j = k == 0 ? queue->jobs[queue->head++] : queue->jobs[--queue->tail];
+        pthread_mutex_unlock(&queue->lock);
+        if (j >= 0) {
+            if (k > 0)
+                atomic_fetch_add(&batchSteals, 1);
+            return j;
+        }
+    }
+    return -1;
+}
+
+//loads and runs job j on this thread's VM, with its output going to a memory buffer
+void batchRun(int j) {
+    batch_job_t* job = &batchJobs[j];
+    CPU cpu = {499, 500, TEXT_BASE, {0}};
+    const char* inputName = job->input != NULL ? job->input : "/dev/null";
+    FILE* in = fopen(inputName, "r");
+    FILE* out = open_memstream(&job->output, &job->outputSize);
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    vmReset();
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "cannot open %s\n", in == NULL ? inputName : "an output buffer");
+        vmStatus = VM_LOAD_ERROR;
+    }
+    else if (loadImage(job->image, &cpu) != 0 || checkDisplay() != 0)
+        vmStatus = VM_LOAD_ERROR;
+    else {
+        vmIn = in;
+        vmOut = out;
+        display[0] = cpu.bp;
+        if (sigsetjmp(trapJump, 1) == 0)
+            runProgram(cpu, batchThreaded, batchJit);
+        else {
+            vmStatus = VM_TRAP;
+            runRelease();
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unloadImage();
+    job->status = vmStatus;
+    job->executed = executed;
+    job->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    vmIn = stdin;
+    vmOut = stdout;
+    if (in != NULL)
+        fclose(in);
+    if (out != NULL)
+        fclose(out);
+}
+
+void* batchWorker(void* arg) {
+    int self = (int)(intptr_t)arg;
+    int j;
 
+    while ((j = batchTake(self)) >= 0)
+        batchRun(j);
+    runRelease();
+    return NULL;
+}
+
+//writes length bytes of s as a JSON string, NULL as ""
+void writeJsonString(FILE* file, const char* s, size_t length) {
+    fputc('"', file);
+    for (size_t i = 0; s != NULL && i < length; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            fprintf(file, "\\%c", c);
+        else if (c == '\n')
+            fprintf(file, "\\n");
+        else if (c < 0x20)
+            fprintf(file, "\\u%04x", c);
+        else
+            fputc(c, file);
+    }
+    fputc('"', file);
+}
+
+/************************************************************
+*
+*   PROFILING
+*
+************************************************************/
 
-     // Print elements from the top of the stack down to the stack pointer
-     for (int i = ARRAY_SIZE - 1; i >= cpu.sp; i--) {
+//allocates the counters, every call path gets a node below the root (the main block)
+int profileOpen() {
+    int n = (textEnd - TEXT_BASE) / 3;
 
-         //Iterate through Dynamic Links and print "|" for activation record if they correspond to current index
-          while(currentBP < 499){
-              if(currentBP == i) {
-                  printf("| ");
-              }
-              currentBP = pas[currentBP - 1];
-          }
-         currentBP = cpu.bp;
-         printf("%d ", pas[i]);
-     }
- }
+    pcCounts = calloc(n > 0 ? n : 1, sizeof(long long));
+    profileCapacity = 64;
+    profileNodes = malloc(profileCapacity * sizeof(profile_node_t));
+    if (pcCounts == NULL || profileNodes == NULL)
+        return -1;
+    profileNodes[0] = (profile_node_t){TEXT_BASE, -1, -1, -1, 0, 0};
+    profileNodeCount = 1;
+    profileCurrent = 0;
+    return 0;
+}
+
+//counts the instruction about to run at pc and follows calls and returns along the call tree
+void profileStep(int pc, int op, int M) {
+    profile_node_t* node = &profileNodes[profileCurrent];
 
-//recursive version of printStack function
-void printStackRec(CPU cpu, int index, int nextDL)
-{
-    if(index > 499)
+    opCounts[op >= 0 && op < PROFILE_OPS ? op : 0]++;
+    if (op == 2 && M >= 0 && M < PROFILE_OPRS)
+        oprCounts[M]++;
+    pcCounts[(pc - TEXT_BASE) / 3]++;
+    node->self++;
+
+    //CAL and CLX always transfer, RTN and DRT always return
+    if (op == 5 || op == 13) {
+        if (node->depth == PROFILE_DEPTH) {
+            profileOverflow++;
+            return;
+        }
+        int child = node->firstChild;
+        while (child >= 0 && profileNodes[child].entry != M)
+            child = profileNodes[child].nextSibling;
+        if (child < 0) {
+            if (profileNodeCount == profileCapacity) {
+                profileCapacity *= 2;
+                profileNodes = realloc(profileNodes, profileCapacity * sizeof(profile_node_t));
+                if (profileNodes == NULL) {
+                    fprintf(stderr, "out of memory\n");
+                    exit(1);
+                }
+                node = &profileNodes[profileCurrent];
+            }
+            child = profileNodeCount++;
+            profileNodes[child] = (profile_node_t){M, profileCurrent, -1, node->firstChild, 0, node->depth + 1};
+            node->firstChild = child;
+        }
+        profileCurrent = child;
+    }
+    else if ((op == 2 && M == 0) || op == 15) {
+        if (profileOverflow > 0)
+            profileOverflow--;
+        else if (node->parent >= 0)
+            profileCurrent = node->parent;
+    }
+}
+
+//pc of the statement code of symbol i
+//symbols point at the block's first instruction, which may be a JMP over nested procedures
+int procedureBody(int i) {
+    int addr = symbols[i].addr;
+    for (int hops = 0; hops < 8 && addr >= TEXT_BASE && addr + 3 <= textEnd
+         && (addr - TEXT_BASE) % 3 == 0 && text[addr - TEXT_BASE] == 7; hops++)
+        addr = text[addr - TEXT_BASE + 2];
+    return addr;
+}
+
+//name of the procedure whose code starts at pc, from the image's symbol section
+//the image does not promise a terminating NUL in the name
+const char* procedureName(int pc) {
+    static char name[16];
+
+    if (pc == TEXT_BASE)
+        return "main";
+    for (int i = 0; i < symbolCount; i++) {
+        if (procedureBody(i) == pc || symbols[i].addr == pc) {
+            snprintf(name, sizeof(name), "%.*s", (int)sizeof(symbols[i].name), symbols[i].name);
+            return name;
+        }
+    }
+    snprintf(name, sizeof(name), "pc%d", pc);
+    return name;
+}
+
+//name of the procedure whose statement code contains pc, which runs from its body to the first RTN
+const char* procedureAt(int pc) {
+    for (int i = 0; i < symbolCount; i++) {
+        int body = procedureBody(i);
+        if (pc < body || (body - TEXT_BASE) % 3 != 0)
+            continue;
+        for (int at = body; at + 3 <= textEnd && at <= pc; at += 3) {
+            int op = text[at - TEXT_BASE];
+            if (at == pc)
+                return procedureName(body);
+            if ((op == 2 && text[at - TEXT_BASE + 2] == 0) || op == 15)
+                break;
+        }
+    }
+    return "main";
+}
+
+//caller;callee;... self-count lines for flamegraph.pl and similar tools
+void writeFolded(FILE* file, int node) {
+    int path[PROFILE_DEPTH + 1];
+    int depth = 0;
+
+    if (profileNodes[node].self > 0) {
+        for (int n = node; n >= 0; n = profileNodes[n].parent)
+            path[depth++] = n;
+        while (depth-- > 0)
+            fprintf(file, "%s%s", procedureName(profileNodes[path[depth]].entry), depth > 0 ? ";" : "");
+        fprintf(file, " %lld\n", profileNodes[node].self);
+    }
+    for (int child = profileNodes[node].firstChild; child >= 0; child = profileNodes[child].nextSibling)
+        writeFolded(file, child);
+}
+
+//opens the hardware counters, returns -1 for each one the kernel refuses
+int perfOpen(int config) {
+#if defined(__linux__)
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)config;
+    return -1;
+#endif
+}
+
+void perfStart() {
+#if defined(__linux__)
+    perfCycles = perfOpen(PERF_COUNT_HW_CPU_CYCLES);
+    perfMisses = perfOpen(PERF_COUNT_HW_BRANCH_MISSES);
+    if (perfCycles >= 0)
+        ioctl(perfCycles, PERF_EVENT_IOC_ENABLE, 0);
+    if (perfMisses >= 0)
+        ioctl(perfMisses, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+//reads a counter into value, returns 0 if it was never opened
+int perfRead(int fd, long long* value) {
+#if defined(__linux__)
+    if (fd < 0)
+        return 0;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, value, sizeof(*value)) != sizeof(*value))
+        return 0;
+    close(fd);
+    return 1;
+#else
+    (void)fd;
+    (void)value;
+    return 0;
+#endif
+}
+
+//prints the hardware counters as "name value" lines, or says why there are none
+void perfReport(FILE* file) {
+    long long cycles;
+    long long misses;
+    int haveCycles = perfRead(perfCycles, &cycles);
+    int haveMisses = perfRead(perfMisses, &misses);
+
+    if (!haveCycles && !haveMisses) {
+        fprintf(file, "hardware counters unavailable (perf_event_open refused, see /proc/sys/kernel/perf_event_paranoid)\n");
         return;
-    if(index >= nextDL)
-    {
-        printStackRec(cpu, index + 1, pas[nextDL - 1]);
-        if(index == nextDL && index != ARRAY_SIZE - 1)
-            printf("| ");
     }
-    else
-        printStackRec(cpu, index + 1, nextDL);
+    if (haveCycles)
+        fprintf(file, "%-16s%lld\n", "cycles", cycles);
+    if (haveMisses)
+        fprintf(file, "%-16s%lld\n", "branch misses", misses);
+}
+
+//writes the report to fname and the folded stacks to fname.folded
+void profileReport(const char* fname) {
+    static const char* opNames[PROFILE_OPS] = {
+        "?", "LIT", "OPR", "LOD", "STO", "CAL", "INC", "JMP", "JPC", "SYS", "STK", "LDX", "STX", "CLX", "DEN", "DRT"
+    };
+    static const char* oprNames[PROFILE_OPRS] = {
+        "RTN", "ADD", "SUB", "MUL", "DIV", "EQL", "NEQ", "LSS", "LEQ", "GTR", "GEQ", "ODD"
+    };
+    int n = (textEnd - TEXT_BASE) / 3;
+    long long total = 0;
+    char foldedName[4096];
+    FILE* file = fopen(fname, "w");
+
+    if (file == NULL) {
+        fprintf(stderr, "cannot create %s\n", fname);
+        return;
+    }
+    for (int op = 0; op < PROFILE_OPS; op++)
+        total += opCounts[op];
+    if (total == 0)
+        total = 1;
+
+    fprintf(file, "%lld instructions\n", executed);
+    if (perfWanted)
+        perfReport(file);
+
+    fprintf(file, "\nopcode mix\n");
+    for (int op = 0; op < PROFILE_OPS; op++) {
+        if (opCounts[op] == 0)
+            continue;
+        if (op != 2) {
+            fprintf(file, "  %-8s%14lld %6.2f%%\n", opNames[op], opCounts[op], 100.0 * opCounts[op] / total);
+            continue;
+        }
+        for (int m = 0; m < PROFILE_OPRS; m++)
+            if (oprCounts[m] > 0)
+                fprintf(file, "  OPR %-4s%14lld %6.2f%%\n", oprNames[m], oprCounts[m], 100.0 * oprCounts[m] / total);
+    }
+
+    //selection of the busiest pcs, the text is small enough to scan once per line
+    fprintf(file, "\nhot spots\n  %6s %14s %7s  %-12s %s\n", "pc", "count", "", "instruction", "procedure");
+    char* shown = calloc(n > 0 ? n : 1, 1);
+    for (int line = 0; shown != NULL && line < PROFILE_HOT; line++) {
+        int best = -1;
+        for (int i = 0; i < n; i++)
+            if (!shown[i] && pcCounts[i] > 0 && (best < 0 || pcCounts[i] > pcCounts[best]))
+                best = i;
+        if (best < 0)
+            break;
+        shown[best] = 1;
+        int op = text[best * 3];
+        fprintf(file, "  %6d %14lld %6.2f%%  %-3s %3d %4d  %s\n", best * 3 + TEXT_BASE, pcCounts[best],
+                100.0 * pcCounts[best] / total, op >= 0 && op < PROFILE_OPS ? opNames[op] : "?",
+                text[best * 3 + 1], text[best * 3 + 2], procedureAt(best * 3 + TEXT_BASE));
+    }
+    free(shown);
+
+    //self counts summed over every path that reached the procedure
+    fprintf(file, "\nprocedures (self)\n");
+    for (int i = 0; i < profileNodeCount; i++) {
+        int entry = profileNodes[i].entry;
+        long long self = 0;
+        int first = 1;
+        for (int j = 0; j < profileNodeCount; j++) {
+            if (profileNodes[j].entry != entry)
+                continue;
+            if (j < i)
+                first = 0;
+            self += profileNodes[j].self;
+        }
+        if (first)
+            fprintf(file, "  %-12s%14lld %6.2f%%\n", procedureName(entry), self, 100.0 * self / total);
+    }
+    fclose(file);
+
+    snprintf(foldedName, sizeof(foldedName), "%s.folded", fname);
+    file = fopen(foldedName, "w");
+    if (file == NULL) {
+        fprintf(stderr, "cannot create %s\n", foldedName);
+        return;
+    }
+    writeFolded(file, 0);
+    fclose(file);
+}
+
+/************************************************************
+*
+*   TRACING
+*
+************************************************************/
+
+//opens the trace file and starts the writer thread
+int traceOpen(const char* fname, CPU cpu) {
+    trace_header_t header;
 
-    printf("%d ", pas[index]);
+    traceFile = fopen(fname, "wb");
+    if (traceFile == NULL)
+        return -1;
+
+    memcpy(header.magic, TRACE_MAGIC, 4);
+    header.version = TRACE_VERSION;
+    header.pc = cpu.pc;
+    header.bp = cpu.bp;
+    header.sp = cpu.sp;
+    header.memorySize = ARRAY_SIZE;
+    fwrite(&header, sizeof(header), 1, traceFile);
+
+    atomic_store(&traceHead, 0);
+    atomic_store(&traceTail, 0);
+    atomic_store(&traceDone, 0);
+    if (pthread_create(&traceThread, NULL, traceWriter, NULL) != 0) {
+        fclose(traceFile);
+        traceFile = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+//lets the writer drain what is left and closes the file
+void traceClose() {
+    if (traceFile == NULL)
+        return;
+    atomic_store_explicit(&traceDone, 1, memory_order_release);
+    pthread_join(traceThread, NULL);
+    fclose(traceFile);
+    traceFile = NULL;
+}
+
+//appends the state after the instruction in cpu.ir to the ring, waits only if the writer fell a full ring behind
+void traceStep(CPU cpu) {
+    unsigned head = atomic_load_explicit(&traceHead, memory_order_relaxed);
+    trace_record_t* rec;
+
+    while (head - atomic_load_explicit(&traceTail, memory_order_acquire) == TRACE_RING_SIZE)
+        sched_yield();
+
+    rec = &traceRing[head & (TRACE_RING_SIZE - 1)];
+    rec->pc = cpu.pc;
+    rec->op = cpu.ir[0];
+    rec->L = cpu.ir[1];
+    rec->M = cpu.ir[2];
+    rec->bp = cpu.bp;
+    rec->sp = cpu.sp;
+
+    //the word this instruction wrote, worked out from the state after it ran
+    switch (cpu.ir[0]) {
+        //LIT, LOD
+        case 1:
+        case 3:
+            rec->slot = cpu.sp;
+            break;
+        //OPR writes the result in place, RTN writes nothing
+        case 2:
+            rec->slot = cpu.ir[2] == 0 ? -1 : cpu.sp;
+            break;
+        //STO, STK
+        case 4:
+        case 10:
+            rec->slot = base(cpu.bp, cpu.ir[1]) - cpu.ir[2];
+            break;
+        //LDX
+        case 11:
+            rec->slot = cpu.sp;
+            break;
+        //STX
+        case 12:
+            rec->slot = display[cpu.ir[1]] - cpu.ir[2];
+            break;
+        //CAL, CLX, static link
+        case 5:
+        case 13:
+            rec->slot = cpu.bp;
+            break;
+        //DEN, saved display entry
+        case 14:
+            rec->slot = cpu.bp - cpu.ir[2];
+            break;
+        //SYS read
+        case 9:
+            rec->slot = cpu.ir[2] == 2 ? cpu.sp : -1;
+            break;
+        default:
+            rec->slot = -1;
+            break;
+    }
+    rec->value = (rec->slot >= 0 && rec->slot < ARRAY_SIZE) ? pas[rec->slot] : 0;
+
+    atomic_store_explicit(&traceHead, head + 1, memory_order_release);
+}
+
+//background thread that drains the ring into the trace file
+void* traceWriter(void* arg) {
+    unsigned tail = atomic_load_explicit(&traceTail, memory_order_relaxed);
+    (void)arg;
+
+    for (;;) {
+        unsigned head = atomic_load_explicit(&traceHead, memory_order_acquire);
+
+        if (head == tail) {
+            //the VM sets traceDone after its last record, so check it before sampling head again
+            if (atomic_load_explicit(&traceDone, memory_order_acquire)
+                && atomic_load_explicit(&traceHead, memory_order_acquire) == tail)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        //write up to the wrap point in one go
+        unsigned start = tail & (TRACE_RING_SIZE - 1);
+        unsigned count = head - tail;
+        if (count > TRACE_RING_SIZE - start)
+            count = TRACE_RING_SIZE - start;
+        fwrite(&traceRing[start], sizeof(trace_record_t), count, traceFile);
+
+        tail += count;
+        atomic_store_explicit(&traceTail, tail, memory_order_release);
+    }
+    return NULL;
 }